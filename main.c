@@ -12,17 +12,73 @@
 //      6. Support input and output redirection
 //      7. Support running commands in foreground and background processes
 //      8. Implement custom handlers for 2 signals, SIGINT and SIGTSTP
+//      9. Schedule delayed and periodic commands with at, every and sched
+//     10. List background processes with jobs, and optionally stream their
+//         output back to the terminal (set -o bgstream)
+//     11. Connect commands into pipelines with |, running built in commands
+//         as threads of the shell instead of child processes
+//     12. Compile a script into a standalone C program (--compile)
+//     13. Shell variables and indexed/associative arrays, set by assignment
+//         lines, read, and mapfile, with ${NAME#PATTERN} style operators
+//     14. Quoting with '...' and "..."
+//     15. [[ ]] conditionals with file tests, glob and regex matching
+//     16. Prompt templates (PROMPT) with asynchronous, cached segments
+//     17. Jump to frecent directories with z
+//     18. "did you mean" suggestions for commands that are not found
+//     19. Pass listening sockets to servers with listen (socket activation)
+//     20. Restart failed background jobs with supervise
+//     21. Run independent script lines at the same time (--parallel)
+//     22. Prefetch the commands and input files of upcoming script lines
+//     23. Journal of finished script lines, to resume a failed run (--journal)
+//     24. wc built in, counting with SIMD
+//     25. Typed records passed between built in pipeline stages by pointer
+//         instead of as text (set -o records)
+//     26. kill built in that signals jobs (%N, %NAME, --all, --tag) by 
+//         process group
+//     27. Pipe throughput and backpressure of each pipeline stage 
+//         (set -o pipestat, pipestat)
+//     28. Pool of spawner threads launching commands at the same time 
+//         (SPAWN_THREADS)
+//     29. Database of how long commands take, to find the slow ones and 
+//         the ones getting slower (stats, set -o slowwarn)
+//     30. exec built in, to replace the shell with a command or redirect 
+//         the shell's own file descriptors
 
 
+#define _GNU_SOURCE         // strchrnul, pipe2, fopencookie, splice, clone
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <regex.h>
+#include <dirent.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
 
 struct command_line {
     char *command;
@@ -31,21 +87,740 @@ struct command_line {
     char *input_file;
     char *output_file;
     bool run_in_background;
+    int stream_fd;  // pipe for streaming background output (bgstream), or -1
+    struct command_line *next;  // next command in a pipeline, or NULL
+    struct assignment *assignments; // for a line of NAME=VALUE words only
+    int assignment_count;
+    int *listen_fds;        // sockets passed by the listen command
+    int listen_fd_count;
+    char *listen_names;     // LISTEN_FDNAMES
 };
 
-char *get_command_line();
-char *variable_expansion(char *command_line_str);
+// NAME=VALUE, NAME[SUBSCRIPT]=VALUE or NAME=(VALUE...) (+= to append), with
+// the subscript and values already expanded. keys holds the KEY of each
+// [KEY]=VALUE list element, NULL for the others.
+struct assignment {
+    char *name;
+    char *subscript;
+    bool append;
+    bool is_list;
+    char **values;
+    char **keys;
+    int value_count;
+};
+
+// Field being built while expanding a word
+struct field {
+    char *text;
+    size_t len;
+    size_t capacity;
+    bool quoted;            // had quotes, so kept even if empty
+    bool empty_array;       // had "${NAME[@]}" of an empty array
+};
+
+// Restart policy of a job started by the "supervise" built in command
+struct supervisor {
+    int max_restarts;
+    int restart_count;
+    long backoff;           // seconds to wait before the next restart
+    long backoff_initial;
+    long backoff_max;
+    time_t started;         // start of the current run (seconds since epoch)
+    time_t restart_at;      // when the job is restarted after it failed
+    int pidfd;              // readable when the current run exits, or -1
+    bool killed;            // sent SIGKILL by the kill builtin: no restart
+};
+#define SUPERVISE_MAX_RESTARTS 5
+#define SUPERVISE_BACKOFF 1
+#define SUPERVISE_BACKOFF_MAX 60
+
+// Background process started by the shell. A supervised job waiting to be
+// restarted stays in the table with a pid of 0.
+struct background_proc {
+    pid_t pid;
+    pid_t pgid;             // process group (shared by a background pipeline)
+    int job_id;             // job number shown by "jobs" and streamed output
+    char *command_str;      // command line that started the process
+    char *tag;              // JOBTAG when the job was started, or NULL
+    struct supervisor *supervisor;  // NULL if the job is not supervised
+};
+struct job_table {
+    struct background_proc *procs;
+    int count;
+    int capacity;
+    int next_job_id;
+};
+
+// Files a line of a --parallel script reads and writes (absolute paths)
+struct file_effects {
+    char **paths;
+    bool *writes;           // true if the matching path is written
+    int count;
+};
+
+// Line of a --parallel script that is running in a subshell, or has exited
+// and is waiting for the lines before it to finish
+struct parallel_line {
+    pid_t pid;              // subshell running the line, 0 once it has exited
+    int pidfd;              // readable when the subshell exits, or -1
+    int status;             // status the line left
+    int prompts;            // prompts to print first, for blank/comment lines
+    FILE *out;              // stdout of the line, printed when it finishes
+    FILE *err;              // stderr of the line
+    struct file_effects effects;
+};
+
+// Journal of the lines of a script run with --journal, see journal_open
+struct journal_entry {
+    off_t offset;           // where the line starts in the script
+    uint32_t hash;          // hash of the text of the line
+};
+struct journal {
+    int fd;                 // -1 if there is no journal
+    struct journal_entry *done; // lines that succeeded in earlier runs, sorted
+    int done_count;
+    bool resuming;          // still skipping lines that succeeded before
+    bool verify;            // skipped lines must still have their output files
+    bool unsynced;          // records written since the last fdatasync
+    struct timespec last_sync;
+};
+#define JOURNAL_SYNC_MS 1000
+
+// Counts of the wc builtin
+struct wc_counts {
+    unsigned long long lines;
+    unsigned long long words;
+    unsigned long long bytes;
+    bool in_word;           // the last byte counted was part of a word
+    bool lines_only;        // words are not needed, only look for newlines
+};
+
+// Line of a compiled script: parsed at compile time, or kept as source when
+// it needs expanding at run time
+struct compiled_line {
+    struct command_line *command_line;
+    char *source;
+};
+
+// Command built into the shell. run returns the builtin's exit status.
+// pipeline_safe builtins only read shell state, so they can run on a worker
+// thread as a pipeline stage; the others change shell state and do nothing
+// inside a pipeline (as if run in a subshell). sets_status builtins stand in
+// for external commands and set the status when run on their own.
+struct builtin {
+    char *name;
+    int (*run)(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs);
+    bool pipeline_safe;
+    bool sets_status;
+    bool pipeline_last;     // may run as the last stage of a foreground 
+                            // pipeline, where it can set shell variables
+    bool records_in;        // can read batches of records (set -o records)
+    bool records_out;       // can write batches of records
+    bool shell_redirects;   // < and > redirect the shell itself (exec)
+};
+
+// One command of a pipeline
+struct pipeline_stage {
+    struct command_line *command_line;
+    struct builtin *builtin;    // NULL for an external command
+    bool threaded;              // builtin running on a worker thread
+    bool last;                  // last stage of the pipeline
+    int in_fd;                  // pipe from the previous stage, or -1
+    int out_fd;                 // pipe to the next stage, or -1
+    FILE *in;                   // streams used by a threaded builtin
+    FILE *out;
+    struct record_queue *records_in;    // instead of in/out between two
+    struct record_queue *records_out;   // builtins that use records
+    pid_t pid;
+    pthread_t thread;
+    int exit_status;
+    int *status;
+    struct job_table *jobs;
+};
+
+// Lock-free single-producer single-consumer byte queue connecting two 
+// threaded builtin stages. head and tail count bytes read and written.
+struct byte_queue {
+    char *data;
+    size_t capacity;        // power of two
+    size_t head;            // advanced by the reader only
+    size_t tail;            // advanced by the writer only
+    bool writer_closed;
+    bool reader_closed;
+    int open_ends;          // freed when both ends are closed
+};
+
+// Typed records passed by pointer between neighboring builtin pipeline stages
+// that both understand them (set -o records), instead of being printed as 
+// text and parsed again by the next stage. Text is only made at the ends.
+enum record_kind {
+    RECORD_STRING,
+    RECORD_INT              // a decimal integer, kept as text as well
+};
+
+struct record {
+    enum record_kind kind;
+    size_t offset;          // of the text in the batch's data
+    size_t len;             // not counting a newline
+    long long number;       // value of a RECORD_INT
+};
+
+// Records travel in batches, with the text of all of them in one block
+struct record_batch {
+    struct record *records;
+    size_t count;
+    size_t capacity;
+    char *data;
+};
+
+#define RECORD_QUEUE_SIZE 16    // batches in flight between two stages
+#define RECORD_BLOCK 65536      // text read at a time into one batch
+
+// Lock-free single-producer single-consumer queue of batch pointers between
+// two threaded builtin stages, working like a byte_queue
+struct record_queue {
+    struct record_batch *batches[RECORD_QUEUE_SIZE];
+    size_t head;            // advanced by the reader only
+    size_t tail;            // advanced by the writer only
+    bool writer_closed;
+    bool reader_closed;
+    int open_ends;          // freed when both ends are closed
+};
+
+// Input of a builtin that reads records: the record queue from the previous 
+// stage, or text from a FILE split into one record per line
+struct record_reader {
+    struct record_queue *queue;
+    FILE *file;
+    char *pending;          // unfinished last line of the previous block
+    size_t pending_len;
+    bool done;
+};
+
+// Relay between two stages of a pipeline run with set -o pipestat. It moves 
+// the data from the writer's pipe to the reader's with splice, and times how
+// long each side keeps the other waiting.
+struct pipe_relay {
+    char *writer;           // commands on either side
+    char *reader;
+    int writer_stage;       // index of the writer in the pipeline
+    int in_fd;              // read end of the pipe from the writer
+    int out_fd;             // write end of the pipe to the reader
+    pthread_t thread;
+    unsigned long long bytes;
+    long long full_ns;      // time waiting for the reader, whose pipe was full
+    long long empty_ns;     // time waiting for the writer to write something
+    long long elapsed_ns;
+};
+#define PIPE_RELAY_CHUNK 65536
+
+// A command handed to the spawner pool. Everything the child needs is copied
+// when the request is made, so the command line can be freed before the 
+// command is launched.
+struct spawn_request {
+    char *command;
+    char **args;            // NULL terminated
+    char *input_file;
+    char *output_file;
+    int in_fd;              // pipes to pipeline neighbors, -1 if none
+    int out_fd;
+    int stream_fd;          // write end of the bgstream pipe, -1 if none
+    int stream_read_fd;     // its read end, for the shell
+    bool background;
+    bool detached;          // typed at the prompt, the shell doesn't wait
+    char *command_str;      // for the job table (background only)
+    char *tag;              // JOBTAG when the request was made
+    pid_t pid;              // set by the spawner, -1 if clone failed
+    int error;              // errno of a failed clone
+    bool collected;         // taken off the completion stack by the shell
+    struct spawn_request *next;     // link in the completion stack
+};
+#define SPAWN_QUEUE_SIZE 256        // requests waiting for a spawner
+#define SPAWN_STACK_SIZE 65536      // stack of a child until it execs
+#define SPAWN_MAX_THREADS 64
+
+// File descriptors the shell keeps open are moved to SHELL_FD_MIN or above,
+// leaving 3 to 9 for exec to redirect (as bash does)
+#define SHELL_FD_MIN 10
+
+// Spawner threads (SPAWN_THREADS of them) launching commands for the shell.
+// Requests go to the spawners through a ring (one producer, the shell, and
+// many consumers that claim head with compare-and-swap), and come back on a
+// lock-free stack that only the shell pops. Idle threads sleep on futexes.
+struct spawn_pool {
+    pthread_t *threads;
+    int thread_count;
+    pid_t pid;              // process the threads belong to
+    struct spawn_request *queue[SPAWN_QUEUE_SIZE];
+    size_t head;            // claimed by the spawners
+    size_t tail;            // advanced by the shell only
+    int submit_seq;         // futex the spawners sleep on
+    bool stopping;
+    struct spawn_request *completed;    // pushed by spawners, taken by shell
+    int completion_seq;     // futex the shell sleeps on
+    int in_flight;          // submitted and not yet collected (shell only)
+    sigset_t mask;          // signal mask of the shell, for the children
+};
+
+// Shell options, turned on with "set -o NAME" and off with "set +o NAME"
+enum shell_option {
+    OPT_BGSTREAM,           // stream background output to the terminal
+    OPT_BGORDER,            // ...grouped per job, in launch order
+    OPT_RECORDS,            // pass records between builtin pipeline stages
+    OPT_PIPESTAT,           // measure the pipes between pipeline stages
+    OPT_SLOWWARN,           // warn when a command is slower than usual
+    OPT_COUNT
+};
+
+// Output of a background process being streamed back to the terminal
+struct output_stream {
+    int job_id;
+    pid_t pid;
+    int fd;                 // read end of the job's output pipe, -1 at EOF
+    char *buffer;           // output not yet printed
+    size_t len;
+    size_t capacity;
+};
+
+// What woke the shell up while waiting at an interactive prompt
+enum prompt_event {
+    PROMPT_INPUT,
+    PROMPT_TIMER,
+    PROMPT_OUTPUT,
+    PROMPT_CHILD,           // a supervised job exited
+    PROMPT_SEGMENT          // a prompt segment finished or timed out
+};
+
+// Asynchronous prompt segment \(COMMAND): the first line of its output is 
+// cached per directory, and refreshed in the background each time the 
+// prompt is drawn
+struct prompt_segment {
+    char *command;          // NULL for an empty slot
+    char *cwd;              // directory the value belongs to
+    char *value;            // last value, NULL until the first run finishes
+    pid_t pid;              // refresh in progress, 0 if none
+    int fd;                 // read end of the refresh's output pipe
+    char buffer[256];       // start of the refresh's output
+    size_t len;
+    struct timespec deadline;   // refresh is killed after this (monotonic)
+    unsigned long last_used;    // to replace the least recently used slot
+};
+#define PROMPT_CACHE_SIZE 32
+#define PROMPT_SEGMENT_MAX 256
+#define PROMPT_TIMEOUT_MS 1000
+#define PREFETCH_LINES 8
+#define PREFETCH_BUFFER 4096    // longer lines are not looked ahead at
+
+// Scheduled command created by the "at" and "every" built in commands
+struct scheduled_command {
+    int id;
+    char *command_str;      // command line to run (no trailing newline)
+    time_t deadline;        // absolute time of next run (seconds since epoch)
+    long interval;          // seconds between runs, 0 for one-shot "at"
+    bool queue_overlaps;    // queue (true) or skip (false) overlapping runs
+    pid_t running_pid;      // PID of run in progress, 0 if none
+    int queued_runs;        // runs waiting for the current run to finish
+    int run_count;
+    int skipped_count;
+    int heap_index;         // position in sched_heap
+    int restart_job_id;     // supervised job to restart, 0 for "at"/"every"
+};
+
+// Cached PATH lookups used to catch "command not found" before forking
+struct path_cache_entry {
+    char *name;             // command name, NULL for an empty slot
+    char *path;             // where execvp() would find it, NULL if nowhere
+};
+struct path_cache {
+    char *path_env;         // value of PATH the cache was built for
+    char **dirs;            // PATH split into directories
+    struct timespec *dir_mtimes; // mtime of each directory when last checked
+    int dir_count;
+    bool cacheable;         // false if PATH has relative directories
+    struct path_cache_entry *entries;   // open addressing hash table
+    size_t capacity;
+    size_t count;
+    char *uncached_result;  // last lookup result when not cacheable
+};
+
+// BK-tree of the file names in the PATH directories, for "did you mean"
+// suggestions. distance is the edit distance from a node to its parent. 
+// While the tree is built each node's children are a linked list; once it is
+// complete the nodes are packed in breadth first order, so the children of a
+// node are next to each other (sorted by distance) and the words are in one
+// block in the same order.
+#define BK_MAX_WORD 64
+#define BK_MAX_SUGGESTIONS 5
+struct bk_node {
+    char *word;
+    int distance;
+    int max_child_distance; // largest distance of a child
+    int first_child;        // -1 if none
+    int child_count;        // once packed
+    int next_sibling;       // -1 if none, while building
+};
+struct bk_tree {
+    struct bk_node *nodes;  // nodes[0] is the root
+    int node_count;
+    int node_capacity;
+    char *words;            // all of the words once packed
+    char *path_env;         // PATH the tree was built for
+    struct timespec *dir_mtimes;    // mtime of each PATH directory then
+};
+struct bk_suggestion {
+    char *word;
+    int distance;
+};
+// Word prepared for pattern_distance
+struct bk_pattern {
+    char *word;
+    int len;
+    uint64_t masks[256];    // bit i set if word[i] is that character
+};
+
+// Shell variable. An indexed array keeps its elements in elements (NULL for
+// unset indexes), an associative array in the open addressing hash table 
+// assoc. Elements read by mapfile point into one block, storage.
+enum var_type {VAR_SCALAR, VAR_INDEXED, VAR_ASSOC};
+struct assoc_entry {
+    char *key;              // NULL for an empty slot
+    char *value;
+};
+struct shell_var {
+    char *name;             // NULL for an empty slot
+    enum var_type type;
+    char *value;            // scalar value, NULL if not set
+    char **elements;
+    int element_count;      // highest set index + 1
+    int element_capacity;
+    struct assoc_entry *assoc;
+    size_t assoc_capacity;
+    size_t assoc_count;
+    char *storage;
+    size_t storage_len;
+};
+struct var_table {
+    struct shell_var *entries;  // open addressing hash table
+    size_t capacity;
+    size_t count;
+};
+
+// Compiled glob pattern for ${NAME#PATTERN} and friends: a list of parts, 
+// each literal text, ?, * or a [...] class (a bitmap of the member bytes)
+enum glob_part_type {GLOB_LITERAL, GLOB_ANY, GLOB_STAR, GLOB_CLASS};
+struct glob_part {
+    enum glob_part_type type;
+    char *text;             // GLOB_LITERAL, points into glob->literal
+    size_t len;
+    uint8_t members[32];    // GLOB_CLASS
+};
+struct glob {
+    char *pattern;          // source text, the cache key
+    struct glob_part *parts;
+    int part_count;
+    char *literal;          // unescaped text of all literal parts
+    size_t min_len;         // shortest string that can match
+    size_t max_len;         // longest, SIZE_MAX if there is a *
+    bool has_star;
+    int first_char;         // first character of any match, or -1
+};
+#define GLOB_CACHE_SIZE 64
+
+// State of one [[ ... ]] expression while it is evaluated
+struct stat_memo {
+    char *path;
+    bool exists;            // false if stat() failed
+    struct stat file_stat;
+};
+struct conditional {
+    char **args;            // words between [[ and ]]
+    int count;
+    int pos;                // next word to parse
+    bool error;             // syntax or other error, the result is false
+    struct stat_memo *stats;    // files stat()ed so far
+    int stat_count;
+    int stat_capacity;
+};
+// Compiled =~ regular expression, kept in regex_cache
+struct regex_cache_entry {
+    char *pattern;          // NULL for an empty slot
+    regex_t regex;
+};
+#define REGEX_CACHE_SIZE 64
+
+// Listening socket created by the listen command, kept open until the shell
+// exits so restarted commands can take it over
+struct listen_socket {
+    char *address;          // as given to listen
+    char *path;             // socket file of a unix socket, or NULL
+    int fd;
+};
+
+// Database file mapped into memory and shared by all running shells
+struct mapped_db {
+    int fd;
+    void *data;             // the mapping, NULL until opened
+    size_t size;
+    bool failed;            // could not be opened, don't try again
+};
+
+// z database: directories the shell changed into, ranked by frecency
+#define Z_DB_MAGIC 0x317a6473   // "sdz1"
+#define Z_PATH_MAX 480
+#define Z_MAX_ENTRIES 512
+#define Z_MAX_TOTAL 9000        // ranks are aged when their sum passes this
+struct z_entry {
+    char path[Z_PATH_MAX];
+    double rank;            // number of visits, aged over time
+    int64_t last_visit;     // seconds since the epoch
+};
+struct z_db {
+    uint32_t magic;         // Z_DB_MAGIC
+    uint32_t count;         // entries in use
+    double total_rank;      // sum of the ranks
+    struct z_entry entries[Z_MAX_ENTRIES];
+};
+struct z_match {
+    char path[Z_PATH_MAX];
+    double score;
+};
+
+// stats database: how long each kind of command line took. A kind is the 
+// command names of its stages and the shape of its arguments (see stats_key).
+// Durations are counted in buckets 4 to each power of two microseconds, 
+// which gives percentiles within 12.5%.
+#define STATS_DB_MAGIC 0x31747373   // "sst1"
+#define STATS_NAME_MAX 48
+#define STATS_EXAMPLE_MAX 64
+#define STATS_MAX_ENTRIES 512
+#define STATS_BUCKETS 160           // up to 2^40 microseconds (12 days)
+#define STATS_MIN_RUNS 10           // before --regressed and slowwarn use it
+#define STATS_TOP_ROWS 10
+struct stats_entry {
+    char name[STATS_NAME_MAX];      // command names, "|" between stages
+    char example[STATS_EXAMPLE_MAX];    // the last command line of the kind
+    uint32_t shape;                 // hash of the shape of the arguments
+    uint32_t count;
+    double mean_ms;
+    double recent_ms;               // moving average of the latest runs
+    int64_t last_run;               // seconds since the epoch
+    uint32_t exits[3];              // exit value 0, 1, anything else
+    uint32_t buckets[STATS_BUCKETS];
+};
+struct stats_db {
+    uint32_t magic;                 // STATS_DB_MAGIC
+    uint32_t count;                 // entries in use
+    struct stats_entry entries[STATS_MAX_ENTRIES];
+};
+
+char *get_command_line(int *status, struct job_table *jobs);
+void run_background_work(int *status, struct job_table *jobs);
+void run_command_line(struct command_line *command_line, int *status,
+                      struct job_table *jobs);
+void shell_cleanup(struct job_table *jobs);
+void prefetch_script_lines();
+void prefetch_file(char *path);
+char *render_prompt(int *status, struct job_table *jobs, bool refresh);
+struct prompt_segment *prompt_segment_lookup(char *command, char *cwd);
+void start_segment_refresh(struct prompt_segment *segment);
+bool read_prompt_segments();
+bool finish_segment_refresh(struct prompt_segment *segment, bool keep);
+int prompt_timeout_ms();
+void free_prompt_cache();
 struct command_line *parse_command_line(char *command_line_str);
+char *next_word_start(char *str);
+char *next_word(char **cursor);
+int expand_word(char *word, char **fields, int field_count, bool split);
+void field_append(struct field *field, char *str, size_t len);
+int end_field(struct field *field, char **fields, int field_count, bool keep_empty);
+char *expand_string(char *word);
+size_t expand_parameter(char *str, char ***values, int *value_count);
+bool apply_operator(char *op, char *name, char *subscript, bool all, 
+                    char ***values, int *value_count);
+bool apply_substring(char *spec, bool all, char ***values, int *value_count);
+bool parse_number(char *str, long *number);
+char *remove_match(char *pattern, char *value, bool prefix, bool longest);
+char *replace_matches(char *spec, char *value);
+struct glob *glob_compile(char *pattern);
+struct glob *glob_parse(char *pattern);
+char *glob_class_end(char *c);
+bool glob_match(struct glob *glob, char *str, size_t len);
+bool glob_star_skip(struct glob *glob, int star_part, char *str, size_t len, 
+                    size_t *pos);
+void glob_free(struct glob *glob);
+char *matching_brace(char *str);
+void add_value(char ***values, int *value_count, char *value);
+bool parse_assignments(char *command_line_str, struct command_line *command_line);
+void add_list_element(struct assignment *assignment, char *element);
+size_t assignment_name_length(char *word);
 void initialize_struct(struct command_line *command_line_parsed);
 void handle_command_line(struct command_line *command_line_parsed, int *status,
-                         int *background_procs, int *bg_proc_count);
-void display_status(int *status);
+                         struct job_table *jobs);
+struct builtin *find_builtin(char *command);
+void run_builtin(struct builtin *builtin, struct command_line *command_line,
+                 int *status, struct job_table *jobs);
+int cd_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs);
+int status_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs);
+int at_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs);
+int every_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs);
+int echo_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+int read_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+void split_fields(char *text, bool *quoted, size_t len, char *array_name,
+                  char **names, int name_count);
+ssize_t read_record(int fd, int delim, char **record, size_t *capacity);
+int declare_command(struct command_line *command_line, FILE *in, FILE *out,
+                    int *status, struct job_table *jobs);
+void print_declaration(struct shell_var *var, FILE *out);
+int mapfile_command(struct command_line *command_line, FILE *in, FILE *out,
+                    int *status, struct job_table *jobs);
+char *read_all(FILE *in, size_t *len);
+int supervise_command(struct command_line *command_line, FILE *in, FILE *out,
+                      int *status, struct job_table *jobs);
+bool supervise_job_done(struct job_table *jobs, int index, int child_status);
+void restart_supervised_job(int job_id, int *status, struct job_table *jobs);
+int supervise_watch(pid_t pid);
+void supervise_unwatch(struct supervisor *policy);
+void free_supervisor(struct supervisor *policy);
+void write_seconds(long seconds, FILE *stream);
+int wc_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs);
+void wc_print(struct wc_counts *counts, bool lines, bool words, bool chars,
+              bool bytes, int width, char *name, FILE *out);
+bool wc_count_file(FILE *in, struct wc_counts *counts);
+void wc_count_records(struct record_queue *queue, struct wc_counts *counts);
+void wc_count(unsigned char *data, size_t len, struct wc_counts *counts);
+size_t wc_count_scalar(unsigned char *data, size_t len, struct wc_counts *counts);
+#ifdef __x86_64__
+size_t wc_count_sse2(unsigned char *data, size_t len, struct wc_counts *counts);
+size_t wc_count_avx2(unsigned char *data, size_t len, struct wc_counts *counts);
+#endif
+int filter_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs);
+int take_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+int kill_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+int parse_signal(char *name);
+int select_jobs(char *spec, struct job_table *jobs, bool *selected);
+void cancel_supervised_restart(struct job_table *jobs, int index);
+int pipestat_command(struct command_line *command_line, FILE *in, FILE *out,
+                     int *status, struct job_table *jobs);
+int exec_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+int exec_redirect(char **args, int count);
+bool exec_file_redirect(int fd, char *path, int flags);
+int move_shell_fd(int fd);
+void display_status(int *status, FILE *out);
 void change_dir(char *envpath);
 char *get_cwd();
-void check_background_procs(int *background_procs, int *bg_proc_count, int *status);
-void remove_val_at_index(int *arr, int *arr_length, int index);
+void check_background_procs(struct job_table *jobs, int *status);
+void add_background_proc(struct job_table *jobs, pid_t pid, char *command_str);
+void remove_background_proc(struct job_table *jobs, int index);
 void fork_child(struct command_line *command_line, int *status, 
-                int *background_procs, int *bg_proc_count);
+                struct job_table *jobs);
+bool prespawn_check(struct command_line *command_line, int *status);
+bool spawn_pool_ready();
+void spawn_pool_start(int thread_count);
+void spawn_pool_stop();
+void *run_spawner(void *arg);
+struct spawn_request *spawn_queue_take();
+int spawn_child(void *arg);
+void spawn_child_error(int fd, char *first, char *second, char *third);
+struct spawn_request *spawn_request_create(struct command_line *command_line, 
+                                           int in_fd, int out_fd);
+void free_spawn_request(struct spawn_request *request);
+void submit_spawn(struct spawn_request *request);
+void collect_spawns(struct job_table *jobs);
+void wait_spawns(struct job_table *jobs, struct spawn_request **requests, 
+                 int count);
+void finish_background_spawn(struct job_table *jobs, 
+                             struct spawn_request *request);
+void spawn_command(struct command_line *command_line, int stream_read_fd, 
+                   int *status, struct job_table *jobs);
+void futex_wait(int *address, int value);
+void futex_wake(int *address, int count);
+char *resolve_command_path(char *command);
+void path_cache_sync();
+bool path_dirs_changed();
+struct path_cache_entry *path_cache_lookup(char *command);
+void path_cache_grow();
+void path_cache_clear();
+void exec_child(struct command_line *command_line, int in_fd, int out_fd, 
+                int *status);
+void set_foreground_status(int child_status, int *status);
+void run_pipeline(struct command_line *pipeline, int *status, struct job_table *jobs);
+void open_builtin_stage_files(struct pipeline_stage *stage, bool first, bool last);
+void *run_builtin_stage(void *arg);
+void run_forked_builtin_stage(struct pipeline_stage *stage);
+struct byte_queue *byte_queue_create(size_t capacity);
+FILE *byte_queue_open(struct byte_queue *queue, bool writer);
+void byte_queue_wait(int *attempts);
+ssize_t byte_queue_write(void *cookie, const char *buffer, size_t size);
+ssize_t byte_queue_read(void *cookie, char *buffer, size_t size);
+int byte_queue_close_writer(void *cookie);
+int byte_queue_close_reader(void *cookie);
+void byte_queue_release(struct byte_queue *queue);
+void *run_pipe_relay(void *arg);
+long long monotonic_ns();
+void free_pipe_relays(struct pipe_relay *relays, int count);
+struct record_batch *record_batch_split(char *data, size_t len, bool numbers);
+bool record_is_number(char *text, size_t len, long long *number);
+void record_batch_free(struct record_batch *batch);
+struct record_queue *record_queue_create();
+bool record_queue_put(struct record_queue *queue, struct record_batch *batch);
+struct record_batch *record_queue_get(struct record_queue *queue);
+void record_queue_close(struct record_queue *queue, bool writer);
+void record_reader_open(struct record_reader *reader, struct record_queue *queue,
+                        FILE *file);
+struct record_batch *record_read_batch(struct record_reader *reader);
+void record_reader_close(struct record_reader *reader);
+bool record_write_batch(struct record_queue *queue, FILE *out, 
+                        struct record_batch *batch);
+bool record_write_text(struct record_queue *queue, FILE *out, char *text, 
+                       size_t len, bool numbers);
+int records_from_text(int (*run)(struct command_line *command_line, FILE *in, 
+                                 FILE *out, int *status, struct job_table *jobs),
+                      struct command_line *command_line, FILE *in, int *status,
+                      struct job_table *jobs, bool numbers);
+void suggest_commands(char *command);
+void bk_tree_search(int node, struct bk_pattern *pattern, int max_distance,
+                    struct bk_suggestion *suggestions, int *count);
+void bk_pattern_init(struct bk_pattern *pattern, char *word);
+int pattern_distance(struct bk_pattern *pattern, char *text);
+int edit_distance(char *a, char *b, bool transpose, int limit);
+void command_index_sync();
+void bk_tree_insert(char *word);
+void bk_tree_pack();
+void command_index_free();
+uint32_t hash_string(char *str);
+struct shell_var *var_lookup(char *name);
+void var_grow();
+struct shell_var *var_create(char *name);
+void var_clear(struct shell_var *var);
+void free_element(struct shell_var *var, char *element);
+struct shell_var *var_reset(char *name);
+void set_var(char *name, char *value);
+void set_var_array(char *name, char **elements, int element_count);
+char *get_var(char *name);
+void var_make_indexed(struct shell_var *var);
+long array_index(struct shell_var *var, char *subscript);
+void set_index(struct shell_var *var, long index, char *value, bool append);
+char *append_value(char *old, char *value);
+struct assoc_entry *assoc_lookup(struct shell_var *var, char *key);
+void assoc_grow(struct shell_var *var);
+void assoc_set(struct shell_var *var, char *key, char *value, bool append);
+char *get_element(struct shell_var *var, char *subscript);
+int var_element_count(struct shell_var *var);
+void var_all_values(struct shell_var *var, bool keys, char ***values, int *value_count);
+void run_assignments(struct command_line *command_line);
+size_t var_name_length(char *str);
 void input_redirect(struct command_line *command_line, int *status);
 void output_redirect(struct command_line *command_line, int *status);
 void ignore_SIGINT();
@@ -53,14 +828,235 @@ void restore_SIGINT();
 void handle_SIGTSTP(int signo);
 void signal_handling();
 void ignore_SIGTSTP();
-void kill_children(int *background_procs, int bg_proc_count);
+void kill_children(struct job_table *jobs);
+int compile_script(int argc, char *argv[]);
+bool journal_open(int argc, char *argv[]);
+void journal_load(FILE *old);
+int compare_journal_entries(const void *a, const void *b);
+bool journal_skip(off_t offset, uint32_t hash, struct command_line *command_line);
+void journal_record(off_t offset, uint32_t hash, int status, long duration);
+void journal_sync();
+void journal_close();
+int parallel_script(int argc, char *argv[]);
+void print_prompts(int count, bool background_work, int *status, 
+                   struct job_table *jobs);
+bool changes_shell(struct command_line *command_line);
+bool parse_effects_directive(char *text, struct file_effects *effects);
+void add_command_effects(struct command_line *command_line, 
+                         struct file_effects *effects);
+void add_file_effect(struct file_effects *effects, char *path, bool write);
+bool effects_conflict(struct parallel_line *window, int first, int count,
+                      int workers, struct file_effects *effects);
+bool paths_overlap(char *a, char *b);
+void free_file_effects(struct file_effects *effects);
+void start_parallel_line(struct parallel_line *line, 
+                         struct command_line *command_line, int *status,
+                         struct job_table *jobs);
+void wait_parallel_lines(struct parallel_line *window, int first, int count, 
+                         int workers);
+void parallel_line_done(struct parallel_line *line, int child_status);
+void finish_parallel_lines(struct parallel_line *window, int *first, 
+                           int *count, int workers, int *status, 
+                           struct job_table *jobs);
+void copy_stream(FILE *from, FILE *to);
+void emit_command_line(FILE *out, FILE *resolved_list, 
+                      struct command_line *command_line, int line_number, 
+                      int stage);
+void emit_c_string(FILE *out, char *str);
+int run_compiled_script(struct compiled_line *script, 
+                        struct command_line **resolved_commands);
 void free_memory(struct command_line *command_line_parsed);
 void print_command_line(struct command_line *command_line_parsed);
+char *join_command_args(struct command_line *command_line, int start);
+void write_quoted(char *word, FILE *stream);
+bool parse_duration(char *str, long *seconds);
+bool parse_at_time(char *str, time_t *deadline);
+void schedule_command(struct command_line *command_line, int start,
+                      time_t deadline, long interval, bool queue_overlaps,
+                      FILE *out);
+int compare_scheduled_commands(const void *a, const void *b);
+int sched_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs);
+void sched_heap_push(struct scheduled_command *entry);
+struct scheduled_command *sched_heap_remove(int index);
+void sched_sift_up(int index);
+void sched_sift_down(int index);
+void sched_swap(int i, int j);
+void sched_rearm_timer();
+bool sched_due();
+enum prompt_event wait_for_input();
+void run_scheduled_commands(int *status, struct job_table *jobs);
+void launch_scheduled_command(struct scheduled_command *entry, int *status,
+                              struct job_table *jobs);
+void sched_job_done(pid_t pid, int *status, struct job_table *jobs);
+void sched_free_all();
+int set_command(struct command_line *command_line, FILE *in, FILE *out,
+                int *status, struct job_table *jobs);
+int conditional_command(struct command_line *command_line, FILE *in, FILE *out,
+                        int *status, struct job_table *jobs);
+bool cond_or(struct conditional *cond, bool evaluate);
+bool cond_and(struct conditional *cond, bool evaluate);
+bool cond_not(struct conditional *cond, bool evaluate);
+bool cond_test(struct conditional *cond, bool evaluate);
+bool is_binary_operator(char *word);
+bool cond_binary(struct conditional *cond, char *left, char *op, char *right);
+struct stat *cond_stat(struct conditional *cond, char *path);
+bool cond_regex_match(struct conditional *cond, char *str, char *pattern);
+regex_t *regex_compile(char *pattern);
+int z_command(struct command_line *command_line, FILE *in, FILE *out,
+              int *status, struct job_table *jobs);
+bool z_path_matches(char *path, char **fragments, int fragment_count, 
+                    bool ignore_case);
+double z_frecency(struct z_entry *entry, time_t now);
+int compare_z_matches(const void *a, const void *b);
+void z_record_visit(char *path);
+char *z_db_path();
+struct z_db *z_db_open();
+bool mapped_db_open(struct mapped_db *db, char *path, size_t size, uint32_t magic);
+void mapped_db_lock(struct mapped_db *db, int operation);
+void mapped_db_close(struct mapped_db *db);
+int stats_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs);
+void stats_record(struct command_line *command_line, long long duration_us, 
+                  int status);
+void stats_key(struct command_line *command_line, char *name, uint32_t *shape,
+               char *example);
+struct stats_entry *stats_find(struct stats_db *db, char *name, uint32_t shape);
+int stats_bucket(long long duration_us);
+double stats_percentile(struct stats_entry *entry, double fraction);
+int compare_stats_rows(const void *a, const void *b);
+struct stats_db *stats_db_open();
+char *stats_db_path();
+int jobs_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs);
+int listen_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs);
+int get_listen_socket(char *address);
+bool close_listen_socket(char *address);
+void pass_listen_fds(struct command_line *command_line);
+void add_output_stream(int job_id, pid_t pid, int fd);
+bool read_output_stream(struct output_stream *stream);
+bool emit_stream_lines(struct output_stream *stream, bool at_prompt, bool printed);
+bool drain_output_streams(bool at_prompt);
+void free_output_streams();
 
 // Info on sig_atomic_t: 
 // https://wiki.sei.cmu.edu/confluence/display/c/SIG31-C.+Do+not+access+shared+objects+in+signal+handlers
 volatile sig_atomic_t foreground_only = 0; // global variable for handling SIGTSTP signal
 
+struct builtin builtins[] = {
+    {.name = "cd", .run = cd_command},
+    {.name = "status", .run = status_command, .pipeline_safe = true},
+    {.name = "echo", .run = echo_command,
+     .pipeline_safe = true, .sets_status = true, .records_out = true},
+    {.name = "read", .run = read_command,
+     .sets_status = true, .pipeline_last = true},
+    {.name = "mapfile", .run = mapfile_command,
+     .sets_status = true, .pipeline_last = true},
+    {.name = "readarray", .run = mapfile_command,
+     .sets_status = true, .pipeline_last = true},
+    {.name = "declare", .run = declare_command, .sets_status = true},
+    {.name = "at", .run = at_command},
+    {.name = "every", .run = every_command},
+    {.name = "sched", .run = sched_command, .pipeline_safe = true},
+    {.name = "set", .run = set_command},
+    {.name = "jobs", .run = jobs_command, .pipeline_safe = true},
+    {.name = "[[", .run = conditional_command, .sets_status = true},
+    {.name = "z", .run = z_command},
+    {.name = "listen", .run = listen_command},
+    {.name = "supervise", .run = supervise_command},
+    {.name = "wc", .run = wc_command,
+     .pipeline_safe = true, .sets_status = true, .records_in = true,
+     .records_out = true},
+    {.name = "filter", .run = filter_command,
+     .pipeline_safe = true, .sets_status = true, .records_in = true,
+     .records_out = true},
+    {.name = "take", .run = take_command,
+     .pipeline_safe = true, .sets_status = true, .records_in = true,
+     .records_out = true},
+    {.name = "kill", .run = kill_command, .sets_status = true},
+    {.name = "pipestat", .run = pipestat_command, .pipeline_safe = true},
+    {.name = "stats", .run = stats_command, .pipeline_safe = true},
+    {.name = "exec", .run = exec_command,
+     .sets_status = true, .shell_redirects = true}
+};
+
+// true on the worker thread of a builtin pipeline stage
+__thread bool pipeline_stage_thread = false;
+// record queues of the builtin pipeline stage on this thread, NULL where it
+// reads or writes text
+__thread struct record_queue *stage_records_in = NULL;
+__thread struct record_queue *stage_records_out = NULL;
+
+char *shell_option_names[OPT_COUNT] = {"bgstream", "bgorder", "records", 
+                                       "pipestat", "slowwarn"};
+bool shell_options[OPT_COUNT] = {false};
+
+// Spawner threads, started when SPAWN_THREADS is set to 1 or more
+struct spawn_pool spawn_pool;
+
+// The command line typed at the prompt that is running. A background command
+// from it is launched without waiting (see spawn_command).
+struct command_line *prompt_command_line = NULL;
+
+// Pipes between the stages of the last pipeline run with set -o pipestat
+struct pipe_relay *pipe_relays = NULL;
+int pipe_relay_count = 0;
+
+// Background output streams in launch order, all read through one epoll set
+struct output_stream **output_streams = NULL;
+int output_stream_count = 0;
+int output_epoll_fd = -1;
+
+// Prompt segments, see render_prompt
+struct prompt_segment prompt_cache[PROMPT_CACHE_SIZE] = {0};
+unsigned long prompt_use_count = 0;
+int prompt_refresh_count = 0;   // segments with a refresh running
+int prompt_epoll_fd = -1;       // output pipes of running refreshes
+long last_command_ms = 0;       // how long the last command line took
+
+// pidfds of running supervised jobs, so a crash is noticed at the prompt
+int supervise_epoll_fd = -1;
+int supervise_watch_count = 0;
+
+// Scheduled commands are kept in a min-heap ordered by deadline. A single
+// timerfd is armed for the earliest deadline so that an interactive prompt can
+// wake up and run commands as they come due.
+struct scheduled_command **sched_heap = NULL;
+int sched_count = 0;
+int sched_capacity = 0;
+int sched_next_id = 1;
+int sched_timer_fd = -1;
+
+struct path_cache path_cache = {0};
+struct bk_tree command_index = {0};
+
+// Shell variables
+struct var_table shell_vars = {0};
+
+// Recently used glob patterns, indexed by hash of the pattern
+struct glob *glob_cache[GLOB_CACHE_SIZE] = {0};
+
+// Recently used =~ regular expressions, indexed by hash of the pattern
+struct regex_cache_entry regex_cache[REGEX_CACHE_SIZE] = {0};
+
+// Lookahead of a script read from a file on stdin, see prefetch_script_lines
+off_t prefetch_offset = 0;      // end of the lines already prefetched
+
+// Journal written with --journal
+struct journal journal = {-1};
+
+// Directory database of the z command
+struct mapped_db z_db_file = {0};
+
+// Command duration database of the stats command
+struct mapped_db stats_db_file = {0};
+double *stats_sort_keys = NULL;     // for compare_stats_rows
+
+// Sockets created by the listen command
+struct listen_socket *listen_sockets = NULL;
+int listen_socket_count = 0;
+
 
 /*******************************************************************************
 Main() performs the following tasks:
@@ -71,17 +1067,26 @@ Main() performs the following tasks:
 - checks for completion of background processes
 - frees memory
 *******************************************************************************/
-int main() {
+#ifndef SMALLSH_RUNTIME
+int main(int argc, char *argv[]) {
+    if ((argc > 1) && !strcmp(argv[1], "--compile")) {
+        return compile_script(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--parallel")) {
+        return parallel_script(argc, argv);
+    }
+    if ((argc > 1) && !strcmp(argv[1], "--journal") && !journal_open(argc, argv)) {
+        return 2;
+    }
     ignore_SIGINT();    // parent and background processes ignore SIGINT 
     signal_handling();  // setup signal handler for SIGTSTP
     int status = 0;
     char *command_line_str = NULL;  // used to read command line from user
-    char *command_line_expanded;    // points to string after variable expansion
     struct command_line *command_line_parsed;
+    off_t line_offset = 0;          // where the line starts, for --journal
     // printf("smallsh program PID = %d\n", getpid());
-    // allocate memory for array to hold PIDs of background processes PIDs
-    int *background_procs = calloc(100, sizeof(int));     
-    int bg_proc_count = 0;    // length of background_procs array
+    // table of background processes, grows as needed
+    struct job_table jobs = {NULL, 0, 0, 1};
     // outer do/while loop checks for exit command
     do {
         // inner do/while loop checks background processes and gets command line
@@ -89,311 +1094,4740 @@ int main() {
         do {
             // free previous command_line_str
             free(command_line_str);
-            // check status of background processes
-            check_background_procs(background_procs, &bg_proc_count, &status);
-            command_line_str = get_command_line();
+            run_background_work(&status, &jobs);
+            if (journal.fd != -1) {
+                line_offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+            }
+            command_line_str = get_command_line(&status, &jobs);
         } while (isspace(command_line_str[0]) | (command_line_str[0] == '#'));
 
-        // if first command is not exit, perform variable expansion, parse the
-        // command line, and then handle the command line
+        // if first command is not exit, parse the command line (with variable
+        // expansion), and then handle the command line
         if (strcmp("exit\n", command_line_str)) {
-            command_line_expanded = variable_expansion(command_line_str);
-            command_line_parsed = parse_command_line(command_line_expanded);
+            uint32_t line_hash = hash_string(command_line_str);
+            command_line_parsed = parse_command_line(command_line_str);
             // print_command_line(command_line_parsed);
-            handle_command_line(command_line_parsed, &status, 
-                                background_procs, &bg_proc_count);
-            free(command_line_expanded);
+            // a resumed --journal run skips lines that are already done
+            if (!journal_skip(line_offset, line_hash, command_line_parsed)) {
+                journal_sync();
+                run_command_line(command_line_parsed, &status, &jobs);
+                journal_record(line_offset, line_hash, status, last_command_ms);
+            }
             free_memory(command_line_parsed);
         }
     } while (strcmp("exit\n", command_line_str));
     // exit
-    // when exit is run, shell must kill any other processes or jobs that the
-    // shell has started before terminating
-    kill_children(background_procs, bg_proc_count);
-    free(background_procs);
+    shell_cleanup(&jobs);
     // free final command_line_str
     free(command_line_str);
     // printf("the process with PID %d is returning from main\n", getpid());
     return 0;
 }
+#endif
 
 /******************************************************************************
-get_command_line prompts user and gets command_line string:
-- Display ": " prompt.
-- Use getline() to read the command line string entered by the user.
-- Return command line string.
+Work done between command lines: add background jobs the spawner pool has
+launched to the job table, print streamed background output, check status of
+background processes, and run any scheduled commands whose deadline has 
+passed.
 ******************************************************************************/
-char *get_command_line() {
-    char *buffer = NULL;  // used to read command line from user
-    size_t len = 0;       // used for getline()
-    ssize_t lread;                  
-    printf(": ");
-    fflush(stdout);
-    lread = getline(&buffer, &len, stdin);
-    if (lread == -1) {
-        printf("error reading line\n");
+void run_background_work(int *status, struct job_table *jobs) {
+    if (isatty(STDIN_FILENO)) {
+        // background PIDs are printed before the next prompt, as without the
+        // spawner pool; a script goes on reading lines while they launch
+        wait_spawns(jobs, NULL, 0);
+    } else {
+        collect_spawns(jobs);
     }
-    return buffer;
+    drain_output_streams(false);
+    check_background_procs(jobs, status);
+    run_scheduled_commands(status, jobs);
 }
 
 /******************************************************************************
-Expands any instance of "$$" in a command into the process ID of the smallsh
-program. The expanded command has max length of 2048 characters per assignment
-specs.
-******************************************************************************/
-char *variable_expansion(char *command_line_str) {
-    // allocate memory for new string after variable expansion
-    char *command_line_expanded = calloc(2048, sizeof(char));        
-    char *var = "$$";       // variable to expand
-    char *return_string;    // point to substring returned from strstr
-    char *str_pointer = command_line_str;  // keep track of position in command_line_str
-    char *pid = calloc(sizeof(char), 100); // used to convert PID to string
-    // convert PID to string
-    sprintf(pid, "%d", getpid());
-    // printf("pid = %s; length of pid = %lu\n", pid, strlen(pid));
-    // search for var in string pointed to by str_pointer
-    return_string = strstr(str_pointer, var);
-    // printf("substring = %s\n", return_string);
-    // continue to search for var and replace with PID, move str_pointer down
-    // the command_line string
-    while (return_string != NULL) {
-        // concatenate the string up until the var is found
-        strncat(command_line_expanded, str_pointer, (strlen(str_pointer) - strlen(return_string)));
-        // concatenate the PID (to replace var)
-        strcat(command_line_expanded, pid);
-        // advance pointer to position after found var
-        str_pointer += strlen(str_pointer) - strlen(return_string) + strlen(var);
-        // search for next var and assign substring to return_string
-        return_string = strstr(str_pointer, var);
-    }
-    // add on the last of the string after final $$ is found (-1 to remove 
-    // newline char)
-    strncat(command_line_expanded, str_pointer, strlen(str_pointer) - 1);
-    free(pid);
-    return command_line_expanded;
-}
-
-/******************************************************************************
-Parse the command line. Use strtok_r to get tokens, check for special symbols,
-and store command in array. Save all command line data to command_line struct.
-Does not do any error checking on the command line (per assignment specs).
-Parameters: command_line string
-Returns: command_line struct
+Run a parsed command line, and time it for the prompt's \t and the stats 
+database. '&' is ignored while in foreground-only mode.
 ******************************************************************************/
-struct command_line *parse_command_line(char *command_line_str) {
-    // allocate memory for parsed command line struct
-    struct command_line *command_line_parsed = malloc(sizeof(struct command_line));
-    // initialize the new command line struct to NULL/0 values
-    initialize_struct(command_line_parsed);
-    
-    char *saveptr1;
-    // First token is the command, add command to command_line struct
-    char *token = strtok_r(command_line_str, " ", &saveptr1);
-    command_line_parsed->command = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(command_line_parsed->command, token);
-    // allocate memory for arg list (per assignment specs, max 512 arguments)
-    char **args_list = malloc(512 * sizeof(*args_list));
-    // allocate memory and copy in 1st token (command) to args_list
-    args_list[0] = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(args_list[0], token);
-    int args_count = 1;     // keep track of length of args_list
-    // Get next token before entering while loop
-    token = strtok_r(NULL, " ", &saveptr1);
-    while (token) {
-        // printf("token = %s, token length = %lu\n", token, strlen(token));
-        if ((token[0] == '<') & (strlen(token) == 1)) {
-            // if < found, get next token which will be input_file and copy
-            // to command_line struct
-            token = strtok_r(NULL, " ", &saveptr1);
-            command_line_parsed->input_file = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(command_line_parsed->input_file, token);
-        }
-        else if ((token[0] == '>') & (strlen(token) == 1)) {
-            // if > found, get next token which will be output_file and copy
-            // to command_line struct
-            token = strtok_r(NULL, " ", &saveptr1);
-            command_line_parsed->output_file = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(command_line_parsed->output_file, token);
+void run_command_line(struct command_line *command_line, int *status,
+                      struct job_table *jobs) 
+{
+    if (foreground_only) {
+        command_line->run_in_background = false;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    prompt_command_line = command_line;
+    handle_command_line(command_line, status, jobs);
+    prompt_command_line = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    last_command_ms = (end.tv_sec - start.tv_sec) * 1000 
+                      + (end.tv_nsec - start.tv_nsec) / 1000000;
+    stats_record(command_line, (end.tv_sec - start.tv_sec) * 1000000LL 
+                               + (end.tv_nsec - start.tv_nsec) / 1000, *status);
+}
+
+/******************************************************************************
+smallsh --journal FILE [--resume [--verify]] SCRIPT
+Run SCRIPT as "smallsh < SCRIPT" does, and append a record to the journal FILE
+each time a line of the script finishes:
+    OFFSET STATUS MILLISECONDS HASH
+OFFSET is where the line starts in SCRIPT and HASH is a hash of its text. The
+journal is opened with O_APPEND and flushed to disk with fdatasync() at most 
+once every JOURNAL_SYNC_MS, after a record is written or before the next line
+starts, so a long run of quick lines costs few syncs. If the shell dies, the 
+records that can be lost are those of the lines that finished in the 
+JOURNAL_SYNC_MS before the line then running started (they run again on 
+resume).
+Without --resume the journal is started over. With --resume, lines at the 
+start of the script that have a record with status 0 and the same hash are 
+skipped, and the script carries on from the first line that has not 
+succeeded. Lines that set up the shell (assignments, cd, declare, set, and 
+read and mapfile, which read the lines after them) are run again so the 
+script continues with the same state. With --verify a skipped line must also
+still have its output files.
+Returns: false if the arguments or files are bad
+******************************************************************************/
+bool journal_open(int argc, char *argv[]) {
+    char *script_path = NULL;
+    char *journal_path = (argc > 2) ? argv[2] : NULL;
+    bool resume = false;
+    for (int i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--resume")) {
+            resume = true;
+        } else if (!strcmp(argv[i], "--verify")) {
+            journal.verify = true;
+        } else if (!script_path) {
+            script_path = argv[i];
+        } else {
+            script_path = NULL;
+            break;
         }
-        else {
-            // if none of the above apply, add token to arg_list array and 
-            // increment args_count
-            args_list[args_count] = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(args_list[args_count], token);
-            args_count++;
-        }
-        // get next token and repeat loop
-        token = strtok_r(NULL, " ", &saveptr1);
-    }
-    // if there is at least two args, check the final args_list position for
-    // & character, if found update command_line struct member and 'delete'
-    // & from args_list
-    if (args_count > 1) {
-        if (!strcmp(args_list[args_count - 1], "&")) {
-            command_line_parsed->run_in_background = true;
-            free(args_list[args_count - 1]);
-            args_count--;  
+    }
+    if (!journal_path || !script_path || (journal.verify && !resume)) {
+        fprintf(stderr, "usage: smallsh --journal FILE [--resume [--verify]] SCRIPT\n");
+        return false;
+    }
+    int script_fd = open(script_path, O_RDONLY | O_CLOEXEC);
+    if ((script_fd == -1) || (dup2(script_fd, STDIN_FILENO) == -1)) {
+        fprintf(stderr, "cannot open %s for input\n", script_path);
+        return false;
+    }
+    close(script_fd);
+    if (resume) {
+        FILE *old = fopen(journal_path, "re");
+        if (old) {
+            journal_load(old);
+            fclose(old);
         }
+        journal.resuming = true;
     }
-    // assign args list and count to command_line struct
-    command_line_parsed->args = args_list;
-    command_line_parsed->args_count = args_count;
-        
-    return command_line_parsed;
+    journal.fd = move_shell_fd(open(journal_path, 
+                                    O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC 
+                                        | (resume ? 0 : O_TRUNC), 0644));
+    if (journal.fd == -1) {
+        fprintf(stderr, "cannot open %s for output\n", journal_path);
+        return false;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &journal.last_sync);
+    return true;
 }
 
 /******************************************************************************
-Initialize a new command_line struct, this cleared several read memory warnings
-The warnings were with the printf and free memory functions since the 
-parse_command line function does not assign a value to all of the structure
-members.
+Read the records of lines that succeeded from an existing journal, sorted by 
+offset. A torn record at the end (the shell died while writing it) is 
+ignored.
 ******************************************************************************/
-void initialize_struct(struct command_line *command_line_parsed) {
-    command_line_parsed->command = NULL;
-    command_line_parsed->args = NULL;
-    command_line_parsed->args_count = 0;
-    command_line_parsed->input_file = NULL;
-    command_line_parsed->output_file = NULL;
-    command_line_parsed->run_in_background = 0;
+void journal_load(FILE *old) {
+    long long offset;
+    int status;
+    long duration;
+    uint32_t hash;
+    char *line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, old) != -1) {
+        if ((sscanf(line, "%lld %d %ld %" SCNu32, &offset, &status, &duration, 
+                    &hash) != 4) || (status != 0)) {
+            continue;
+        }
+        journal.done = realloc(journal.done, 
+                               (journal.done_count + 1) * sizeof(*journal.done));
+        journal.done[journal.done_count].offset = offset;
+        journal.done[journal.done_count++].hash = hash;
+    }
+    free(line);
+    qsort(journal.done, journal.done_count, sizeof(*journal.done), 
+          compare_journal_entries);
 }
 
+/******************************************************************************
+Compare two journal records by offset, then hash (the line at an offset may
+have changed between runs), for qsort and bsearch.
+******************************************************************************/
+int compare_journal_entries(const void *a, const void *b) {
+    const struct journal_entry *x = a;
+    const struct journal_entry *y = b;
+    if (x->offset != y->offset) {
+        return (x->offset < y->offset) ? -1 : 1;
+    }
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
 
 /******************************************************************************
-Handle the command from the comand line. 
-Built in commands "cd" and "status" are passed to their respective functions.
-All other commands are sent to fork_child function to process.
-Before forking, add NULl to end of args list
+Decide whether a line of a resumed script is skipped: it is while the lines
+read so far have all succeeded before (see journal_open). The first line 
+that has not ends resuming, and it and every line after it run.
+Parameters: offset of the line in the script, hash of its text, parsed line
 ******************************************************************************/
-void handle_command_line(struct command_line *command_line, int *status,
-                         int *background_procs, int *bg_proc_count) 
-{
-    if (!strcmp(command_line->command, "cd")) {
-        // Handle "cd" command
-        if (command_line->args_count == 1) {
-            // change directory to Home environment variable if "cd" is
-            // the only arg in args_list
-            change_dir(getenv("HOME"));
-        } else {
-            // change directory to path specified after "cd" command
-            change_dir(command_line->args[1]);
+bool journal_skip(off_t offset, uint32_t hash, struct command_line *command_line) {
+    if (!journal.resuming) {
+        return false;
+    }
+    struct journal_entry key = {offset, hash};
+    bool done = bsearch(&key, journal.done, journal.done_count, sizeof(key),
+                        compare_journal_entries);
+    for (struct command_line *stage = command_line; done && stage; 
+             stage = stage->next) {
+        if (journal.verify && stage->output_file 
+                && (access(stage->output_file, F_OK) == -1)) {
+            done = false;
         }
     }
-    else if (!strcmp(command_line->command, "status")) {
-        // handle status command    
-        display_status(status);
+    if (!done) {
+        journal.resuming = false;
+        return false;
     }
-    else {
-        // add NULL to args list
-        command_line->args[command_line->args_count] = NULL;
-        command_line->args_count += 1;
-        // print_command_line(command_line);
-        fork_child(command_line, status, background_procs, bg_proc_count);
+    static char *setup[] = {"cd", "declare", "set", "read", "mapfile", 
+                            "readarray", NULL};
+    if (command_line->assignment_count) {
+        return false;
+    }
+    for (int i = 0; setup[i]; i++) {
+        if (!strcmp(command_line->command, setup[i])) {
+            return false;
+        }
     }
+    return true;
 }
 
 /******************************************************************************
-Displays either the exit status or the terminating signal of the last
-ran foreground command. 
-If status is 0 or 1, print exit status message.
-If status is > 1, print terminating signal message.
+Append the record of a finished line to the journal, and sync the journal if 
+it has not been synced for JOURNAL_SYNC_MS (see journal_sync).
 ******************************************************************************/
-void display_status(int *status) {
-    if ((*status == 0) || (*status == 1)) {
-        printf("exit value %d\n", *status);
-        fflush(stdout);
-    } else {
-        printf("terminated by signal %d\n", *status);
-        fflush(stdout);
+void journal_record(off_t offset, uint32_t hash, int status, long duration) {
+    if (journal.fd == -1) {
+        return;
     }
+    char record[80];
+    int len = snprintf(record, sizeof(record), "%lld %d %ld %" PRIu32 "\n", 
+                       (long long)offset, status, duration, hash);
+    if (write(journal.fd, record, len) != len) {
+        perror("journal");
+    }
+    journal.unsynced = true;
+    journal_sync();
 }
 
 /******************************************************************************
-Change cwd to path specified.
-Free memory allocated from getcwd call after changing directory.
+Sync the journal if records have been written since the last sync and that 
+was at least JOURNAL_SYNC_MS ago. Also called before each line starts, so the
+records of quick lines are not left unsynced while a long line runs.
 ******************************************************************************/
-void change_dir(char *envpath) {
-    int change_dir_num = chdir(envpath);
-    // On chdir success, zero is returned.  On error, -1 is returned
-    if (change_dir_num == -1) {
-        printf("Error changing directories.\n");
-        fflush(stdout);
+void journal_sync() {
+    if ((journal.fd == -1) || !journal.unsynced) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if ((now.tv_sec - journal.last_sync.tv_sec) * 1000 
+            + (now.tv_nsec - journal.last_sync.tv_nsec) / 1000000 
+            >= JOURNAL_SYNC_MS) {
+        fdatasync(journal.fd);
+        journal.last_sync = now;
+        journal.unsynced = false;
     }
-    char *cwd = get_cwd();
-    // printf("cwd after change dir: %s\n", cwd);
-    free(cwd);
 }
 
 /******************************************************************************
-Get and return the current working directory.
-https://man7.org/linux/man-pages/man3/getcwd.3.html
-    "glibc's getcwd() allocates the buffer dynamically using malloc(3) if buf
-     is NULL.  In this case, the allocated buffer has the length size unless
-     size is zero, when buf is allocated as big as necessary.  The caller 
-     should free(3) the returned buffer.
+Sync and close the journal at exit.
 ******************************************************************************/
-char *get_cwd() {
-    char *cwd;
-    char *buffer = NULL;
-    size_t len = 0;
-    cwd = getcwd(buffer, len);
-    return cwd;
+void journal_close() {
+    if (journal.fd != -1) {
+        if (journal.unsynced) {
+            fdatasync(journal.fd);
+        }
+        close(journal.fd);
+        journal.fd = -1;
+    }
+    free(journal.done);
+    journal.done = NULL;
 }
 
 /******************************************************************************
-Iterate through background_procs array and use waitpid on each process PID. 
-Display message if process is complete with process exit status. 
-Remove process from array if it is complete.
-Basic structure of WIFEXITED code modified from course exploration Process API
- - Monitoring Child Processes
+When exit is run, shell must kill any other processes or jobs that the shell
+has started before terminating, then free the job table, scheduled commands
+and output streams.
 ******************************************************************************/
-void check_background_procs(int *background_procs, int *bg_proc_count, int *status) {
-    int i;
-    int arr_length = *bg_proc_count;
-    int pid_check;
-    int child_status;
-    for (i = 0; i < arr_length; i++) {
-        // printf("background proc PID: %d\n", background_procs[i]);
-        pid_check = waitpid(background_procs[i], &child_status, WNOHANG);
-        // printf("child_status: %d, pid_check: %d\n", child_status, pid_check);
-        // if waitpid returnes the child pid, the child process is complete and
-        // can be removed from the background_procs list
-        if (pid_check == background_procs[i]) {
-            // remove PID from background_procs list
-            remove_val_at_index(background_procs, bg_proc_count, i);
-            // roll back i by one if a value was removed 
-            i -= 1;
-            // display background PID status and exit value or signal termination
-            if(WIFEXITED(child_status)) {
-                printf("background pid %d is done: exit value %d\n", pid_check, WEXITSTATUS(child_status));
-                fflush(stdout);
-            } else {
-                printf("background pid %d is done: terminated by signal %d\n", pid_check, WTERMSIG(child_status));
-                fflush(stdout);
-            }
-        }
+void shell_cleanup(struct job_table *jobs) {
+    wait_spawns(jobs, NULL, 0);
+    kill_children(jobs);
+    free(jobs->procs);
+    sched_free_all();
+    free_output_streams();
+    free_prompt_cache();
+    mapped_db_close(&z_db_file);
+    mapped_db_close(&stats_db_file);
+    command_index_free();
+    close_listen_socket(NULL);
+    journal_close();
+    if (supervise_epoll_fd != -1) {
+        close(supervise_epoll_fd);
     }
+    free_pipe_relays(pipe_relays, pipe_relay_count);
+    spawn_pool_stop();
 }
 
 /******************************************************************************
-Removes the value from the given array at the specified index.
-Paramaters: ptr to array, ptr to array length, index of val to be removed
+get_command_line prompts user and gets command_line string:
+- Display the prompt (": ", or built from PROMPT by render_prompt).
+- While waiting at an interactive prompt, run scheduled commands as their
+  deadlines pass and print streamed background output as it arrives, then
+  redisplay the prompt. When an asynchronous prompt segment gets a new value
+  the prompt is redrawn in place.
+- Use read_record() to read the command line string entered by the user (end
+  of input is treated as the exit command).
+- When a script is read from a file, look ahead at the lines after it.
+- Return command line string.
 ******************************************************************************/
-void remove_val_at_index(int *arr, int *arr_length, int index) {
-    int i;
-    for (i = index; i < *arr_length - 1; i++) {
-        arr[i] = arr[i + 1];
+char *get_command_line(int *status, struct job_table *jobs) {
+    char *buffer = NULL;  // used to read command line from user
+    size_t len = 0;       // used for read_record()
+    ssize_t lread;                  
+    // segments are only refreshed for a person at a terminal, not scripts
+    char *prompt = render_prompt(status, jobs, isatty(STDIN_FILENO));
+    printf("%s", prompt);
+    fflush(stdout);
+    enum prompt_event event;
+    while ((event = wait_for_input()) != PROMPT_INPUT) {
+        if ((event == PROMPT_OUTPUT) && drain_output_streams(true)) {
+            printf("%s", prompt);
+            fflush(stdout);
+        } else if ((event == PROMPT_TIMER) && sched_due()) {
+            printf("\n");
+            run_scheduled_commands(status, jobs);
+            printf("%s", prompt);
+            fflush(stdout);
+        } else if (event == PROMPT_TIMER) {
+            sched_rearm_timer();
+        } else if (event == PROMPT_CHILD) {
+            printf("\n");
+            check_background_procs(jobs, status);
+            printf("%s", prompt);
+            fflush(stdout);
+        } else if ((event == PROMPT_SEGMENT) && read_prompt_segments()) {
+            // go back to the first line of the prompt, clear it and redraw
+            int lines = 0;
+            for (char *c = prompt; (c = strchr(c, '\n')); c++) {
+                lines++;
+            }
+            printf(lines ? "\r\033[%dA\033[J" : "\r\033[J", lines);
+            free(prompt);
+            prompt = render_prompt(status, jobs, false);
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+    }
+    free(prompt);
+    // read_record leaves the rest of the input unread, so child processes
+    // and the read command see the lines after this one
+    lread = read_record(STDIN_FILENO, '\n', &buffer, &len);
+    if (lread == -1) {
+        printf("error reading line\n");
+    }
+    if (lread <= 0) {
+        // end of input, same as the exit command
+        free(buffer);
+        buffer = strdup("exit\n");
+    } else {
+        prefetch_script_lines();
     }
-    *arr_length -= 1;
+    return buffer;
 }
 
 /******************************************************************************
-Fork a child process.
-First add forked child to background_proc array if process to run in background
-In child 
-    - restore SIGINT for foreground processes, ignore SIGTSTP for both 
-      foreground and background processes
-    - call redirect input/output functions
-    - use execvp to run command with args
+When a script is read from a regular file on stdin, look ahead at the next 
+PREFETCH lines (8 if the variable is not set, 0 turns lookahead off) while 
+the current line runs: their commands are resolved on PATH, which fills 
+path_cache, and the kernel is asked to start reading the executables and '<'
+input files into the page cache (POSIX_FADV_WILLNEED), so the commands don't
+start cold. The lines are read with pread(), which leaves the file offset 
+where the shell and its children expect it, and are only scanned for words: 
+lines with $ or quotes are skipped, since what they run isn't known until 
+they are expanded. Each line is looked at once; prefetch_offset is where the
+lines already looked at end.
+https://man7.org/linux/man-pages/man2/posix_fadvise.2.html
+******************************************************************************/
+void prefetch_script_lines() {
+    static int stdin_regular = -1;
+    if (stdin_regular == -1) {
+        struct stat stdin_stat;
+        stdin_regular = (fstat(STDIN_FILENO, &stdin_stat) == 0) 
+                            && S_ISREG(stdin_stat.st_mode);
+    }
+    char *lines_str = get_var("PREFETCH");
+    long lines = lines_str ? strtol(lines_str, NULL, 10) : PREFETCH_LINES;
+    off_t offset = stdin_regular ? lseek(STDIN_FILENO, 0, SEEK_CUR) : -1;
+    if ((lines <= 0) || (offset == -1)) {
+        return;
+    }
+    char buffer[PREFETCH_BUFFER + 1];
+    ssize_t len = pread(STDIN_FILENO, buffer, PREFETCH_BUFFER, offset);
+    if (len <= 0) {
+        return;
+    }
+    buffer[len] = '\0';
+    char *line = buffer;
+    char *end;
+    for (; (lines > 0) && (end = strchr(line, '\n')); line = end + 1, lines--) {
+        *end = '\0';
+        off_t line_end = offset + (end + 1 - buffer);
+        if ((line_end <= prefetch_offset) || (line[0] == '#') 
+                || line[strcspn(line, "$'\"")]) {
+            continue;
+        }
+        prefetch_offset = line_end;
+        // the first word of each command of a pipeline is run, the word 
+        // after '<' is read
+        bool command = true;
+        char *save = NULL;
+        for (char *word = strtok_r(line, " \t", &save); word; 
+                 word = strtok_r(NULL, " \t", &save)) {
+            if (!strcmp(word, "<") || !strcmp(word, ">")) {
+                char *file = strtok_r(NULL, " \t", &save);
+                if (file && (word[0] == '<')) {
+                    prefetch_file(file);
+                }
+            } else if (!strcmp(word, "|")) {
+                command = true;
+            } else if (command && !strchr(word, '=')) {
+                command = false;
+                char *path = find_builtin(word) ? NULL : resolve_command_path(word);
+                if (path) {
+                    prefetch_file(path);
+                }
+            }
+        }
+    }
+}
+
+/******************************************************************************
+Start reading a file into the page cache in the background.
+******************************************************************************/
+void prefetch_file(char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+    if (fd != -1) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/******************************************************************************
+Build the prompt from the PROMPT variable, or ": " if it is not set. PROMPT 
+is copied as is except for these escapes:
+    \w  current directory (with $HOME shown as ~)   \W  its last component
+    \j  number of background jobs       \s  status of the last command
+    \t  how long the last command took  \n  newline     \\  backslash
+    \(COMMAND)  first line of the output of COMMAND (a simple command)
+\(COMMAND) segments are asynchronous: the value shown is the one cached for
+the current directory (empty the first time), and if refresh is true a new
+run is started in the background. get_command_line redraws the prompt when 
+it finishes (see read_prompt_segments).
+Returns: allocated prompt string
+******************************************************************************/
+char *render_prompt(int *status, struct job_table *jobs, bool refresh) {
+    char *template = get_var("PROMPT");
+    if (!template) {
+        return strdup(": ");
+    }
+    char *cwd = get_cwd();
+    char *prompt = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&prompt, &len);
+    for (char *c = template; *c; c++) {
+        if ((c[0] != '\\') || !c[1]) {
+            fputc(*c, stream);
+            continue;
+        }
+        c++;
+        if ((*c == 'w') || (*c == 'W')) {
+            char *home = getenv("HOME");
+            size_t home_len = home ? strlen(home) : 0;
+            if (!cwd) {
+                continue;
+            } else if (*c == 'W') {
+                char *base = strrchr(cwd, '/');
+                fputs((base && base[1]) ? base + 1 : cwd, stream);
+            } else if (home_len && !strncmp(cwd, home, home_len) 
+                           && ((cwd[home_len] == '/') || !cwd[home_len])) {
+                fprintf(stream, "~%s", cwd + home_len);
+            } else {
+                fputs(cwd, stream);
+            }
+        } else if (*c == 'j') {
+            fprintf(stream, "%d", jobs->count);
+        } else if (*c == 's') {
+            fprintf(stream, "%d", *status);
+        } else if (*c == 't') {
+            if (last_command_ms < 1000) {
+                fprintf(stream, "%ldms", last_command_ms);
+            } else if (last_command_ms < 60000) {
+                fprintf(stream, "%.1fs", last_command_ms / 1000.0);
+            } else {
+                fprintf(stream, "%ldm%02lds", last_command_ms / 60000, 
+                        last_command_ms / 1000 % 60);
+            }
+        } else if (*c == 'n') {
+            fputc('\n', stream);
+        } else if ((*c == '(') && cwd) {
+            // find the matching ), the command may contain parentheses
+            int depth = 1;
+            char *end = c + 1;
+            while (*end) {
+                depth += (*end == '(') - (*end == ')');
+                if (depth == 0) {
+                    break;
+                }
+                end++;
+            }
+            char *command = strndup(c + 1, end - c - 1);
+            struct prompt_segment *segment = prompt_segment_lookup(command, cwd);
+            if (refresh && !segment->pid) {
+                start_segment_refresh(segment);
+            }
+            if (segment->value) {
+                fputs(segment->value, stream);
+            }
+            free(command);
+            c = *end ? end : end - 1;
+        } else {
+            fputc(*c, stream);
+        }
+    }
+    fclose(stream);
+    free(cwd);
+    return prompt;
+}
+
+/******************************************************************************
+Find the cached segment for command in directory cwd. If there is none, take
+an empty slot of prompt_cache or the least recently used one (stopping its
+refresh if it has one running).
+******************************************************************************/
+struct prompt_segment *prompt_segment_lookup(char *command, char *cwd) {
+    struct prompt_segment *oldest = &prompt_cache[0];
+    prompt_use_count++;
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_segment *segment = &prompt_cache[i];
+        if (segment->command && !strcmp(segment->command, command) 
+                && !strcmp(segment->cwd, cwd)) {
+            segment->last_used = prompt_use_count;
+            return segment;
+        }
+        if (segment->last_used < oldest->last_used) {
+            oldest = segment;
+        }
+    }
+    if (oldest->pid) {
+        kill(oldest->pid, SIGKILL);
+        finish_segment_refresh(oldest, false);
+    }
+    free(oldest->command);
+    free(oldest->cwd);
+    free(oldest->value);
+    memset(oldest, 0, sizeof(struct prompt_segment));
+    oldest->command = strdup(command);
+    oldest->cwd = strdup(cwd);
+    oldest->last_used = prompt_use_count;
+    oldest->fd = -1;
+    return oldest;
+}
+
+/******************************************************************************
+Start running a segment's command in the background with its output going to
+a pipe, which is added to prompt_epoll_fd. Its stdin and stderr are 
+/dev/null. The run is killed if it takes longer than PROMPT_TIMEOUT 
+milliseconds (PROMPT_TIMEOUT_MS by default).
+******************************************************************************/
+void start_segment_refresh(struct prompt_segment *segment) {
+    if (prompt_epoll_fd == -1) {
+        prompt_epoll_fd = move_shell_fd(epoll_create1(EPOLL_CLOEXEC));
+        if (prompt_epoll_fd == -1) {
+            return;
+        }
+    }
+    int pipe_fds[2];
+    if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+        return;
+    }
+    // don't let the child flush a copy of anything still buffered
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        close(pipe_fds[0]);
+        close(pipe_fds[1]);
+        return;
+    }
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_RDWR);
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        int status = 0;
+        struct command_line *command_line = parse_command_line(segment->command);
+        // stays out of the way of ^C like a background process
+        command_line->run_in_background = true;
+        command_line->args[command_line->args_count] = NULL;
+        exec_child(command_line, -1, pipe_fds[1], &status);
+    }
+    close(pipe_fds[1]);
+    fcntl(pipe_fds[0], F_SETFL, O_NONBLOCK);
+    segment->pid = pid;
+    segment->fd = pipe_fds[0];
+    segment->len = 0;
+    char *timeout_str = get_var("PROMPT_TIMEOUT");
+    long timeout = timeout_str ? strtol(timeout_str, NULL, 10) : PROMPT_TIMEOUT_MS;
+    clock_gettime(CLOCK_MONOTONIC, &segment->deadline);
+    segment->deadline.tv_sec += timeout / 1000;
+    segment->deadline.tv_nsec += timeout % 1000 * 1000000;
+    if (segment->deadline.tv_nsec >= 1000000000) {
+        segment->deadline.tv_sec++;
+        segment->deadline.tv_nsec -= 1000000000;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = segment};
+    epoll_ctl(prompt_epoll_fd, EPOLL_CTL_ADD, segment->fd, &event);
+    prompt_refresh_count++;
+}
+
+/******************************************************************************
+Read whatever output the running segment refreshes have produced. A refresh
+is done at end of file; one that passed its deadline is killed and the old
+value kept.
+Returns: true if any segment's value changed (the prompt should be redrawn)
+******************************************************************************/
+bool read_prompt_segments() {
+    bool changed = false;
+    if (prompt_refresh_count == 0) {
+        return false;
+    }
+    struct epoll_event events[PROMPT_CACHE_SIZE];
+    int ready = epoll_wait(prompt_epoll_fd, events, PROMPT_CACHE_SIZE, 0);
+    for (int i = 0; i < ready; i++) {
+        struct prompt_segment *segment = events[i].data.ptr;
+        char chunk[4096];
+        ssize_t nread;
+        while ((nread = read(segment->fd, chunk, sizeof(chunk))) > 0) {
+            // only the first line is shown, but keep reading so the command
+            // does not block on a full pipe
+            if (segment->len < PROMPT_SEGMENT_MAX) {
+                size_t keep = PROMPT_SEGMENT_MAX - segment->len;
+                keep = ((size_t)nread < keep) ? (size_t)nread : keep;
+                memcpy(segment->buffer + segment->len, chunk, keep);
+                segment->len += keep;
+            }
+        }
+        if ((nread == 0) || ((nread == -1) && (errno != EAGAIN))) {
+            changed |= finish_segment_refresh(segment, true);
+        }
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_segment *segment = &prompt_cache[i];
+        if (segment->pid && ((now.tv_sec > segment->deadline.tv_sec)
+                             || ((now.tv_sec == segment->deadline.tv_sec)
+                                 && (now.tv_nsec >= segment->deadline.tv_nsec)))) {
+            kill(segment->pid, SIGKILL);
+            finish_segment_refresh(segment, false);
+        }
+    }
+    return changed;
+}
+
+/******************************************************************************
+End a segment refresh: close its pipe and reap the process. If keep is true
+the first line of its output becomes the segment's value.
+Returns: true if the value changed
+******************************************************************************/
+bool finish_segment_refresh(struct prompt_segment *segment, bool keep) {
+    epoll_ctl(prompt_epoll_fd, EPOLL_CTL_DEL, segment->fd, NULL);
+    close(segment->fd);
+    segment->fd = -1;
+    waitpid(segment->pid, NULL, 0);
+    segment->pid = 0;
+    prompt_refresh_count--;
+    if (!keep) {
+        return false;
+    }
+    char *newline = memchr(segment->buffer, '\n', segment->len);
+    char *value = strndup(segment->buffer, 
+                          newline ? (size_t)(newline - segment->buffer) : segment->len);
+    bool changed = !segment->value || strcmp(segment->value, value);
+    free(segment->value);
+    segment->value = value;
+    return changed;
+}
+
+/******************************************************************************
+Returns the milliseconds until the earliest segment refresh deadline, or -1 
+if no refresh is running (for poll()).
+******************************************************************************/
+int prompt_timeout_ms() {
+    if (prompt_refresh_count == 0) {
+        return -1;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long timeout = -1;
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_segment *segment = &prompt_cache[i];
+        if (!segment->pid) {
+            continue;
+        }
+        long left = (segment->deadline.tv_sec - now.tv_sec) * 1000 
+                    + (segment->deadline.tv_nsec - now.tv_nsec) / 1000000 + 1;
+        left = (left < 0) ? 0 : left;
+        timeout = ((timeout == -1) || (left < timeout)) ? left : timeout;
+    }
+    return timeout;
+}
+
+/******************************************************************************
+Stop any running segment refreshes and free the prompt cache.
+******************************************************************************/
+void free_prompt_cache() {
+    for (int i = 0; i < PROMPT_CACHE_SIZE; i++) {
+        struct prompt_segment *segment = &prompt_cache[i];
+        if (segment->pid) {
+            kill(segment->pid, SIGKILL);
+            finish_segment_refresh(segment, false);
+        }
+        free(segment->command);
+        free(segment->cwd);
+        free(segment->value);
+    }
+    memset(prompt_cache, 0, sizeof(prompt_cache));
+    if (prompt_epoll_fd != -1) {
+        close(prompt_epoll_fd);
+        prompt_epoll_fd = -1;
+    }
+}
+
+/******************************************************************************
+Parse the command line. Split it into words (see next_word), check for special
+symbols, and expand the other words into the args array (see expand_word).
+The words of a [[ ... ]] conditional are expanded without splitting.
+Save all command line data to command_line struct. A line made up only of
+assignments (NAME=VALUE, NAME[SUBSCRIPT]=VALUE, NAME=(VALUE...), or += to 
+append) is saved as a list of assignments with no command. 
+Does not do any error checking on the command line (per assignment specs).
+Parameters: command_line string, not modified
+Returns: command_line struct
+******************************************************************************/
+struct command_line *parse_command_line(char *command_line_str) {
+    // allocate memory for parsed command line struct
+    struct command_line *command_line_parsed = malloc(sizeof(struct command_line));
+    // initialize the new command line struct to NULL/0 values
+    initialize_struct(command_line_parsed);
+    if (parse_assignments(command_line_str, command_line_parsed)) {
+        return command_line_parsed;
+    }
+    char *cursor = command_line_str;
+    // allocate memory for arg list (per assignment specs, max 512 arguments)
+    char **args_list = malloc(512 * sizeof(*args_list));
+    int args_count = 0;     // keep track of length of args_list
+    bool first = true;      // the first word is always part of the command
+    bool conditional = false;   // inside [[ ... ]]
+    char *word;
+    while ((word = next_word(&cursor))) {
+        // printf("word = %s, word length = %lu\n", word, strlen(word));
+        if (first) {
+            args_count = expand_word(word, args_list, args_count, true);
+            conditional = !strcmp(word, "[[");
+            first = false;
+        }
+        else if (conditional && (args_count < 511)) {
+            // words of [[ ... ]] are not split, and an empty one is kept as
+            // an operand; < > | are operators there, not redirections
+            args_list[args_count++] = expand_string(word);
+            conditional = strcmp(word, "]]");
+        }
+        else if (!strcmp(word, "|") && next_word_start(cursor)) {
+            // if | found, the rest of the line is the next command of the
+            // pipeline, parse it into its own command_line struct
+            command_line_parsed->next = parse_command_line(cursor);
+            command_line_parsed->run_in_background = 
+                command_line_parsed->next->run_in_background;
+            free(word);
+            break;
+        }
+        else if (!strcmp(word, "&") && !next_word_start(cursor)) {
+            // & as the last word runs the command in the background
+            command_line_parsed->run_in_background = true;
+        }
+        else if ((!strcmp(word, "<") || !strcmp(word, ">")) && next_word_start(cursor)) {
+            // if < or > found, the next word is input_file or output_file
+            char **file = (word[0] == '<') ? &command_line_parsed->input_file 
+                                           : &command_line_parsed->output_file;
+            char *file_word = next_word(&cursor);
+            free(*file);
+            *file = expand_string(file_word);
+            free(file_word);
+        }
+        else {
+            // if none of the above apply, expand the word into args_list
+            args_count = expand_word(word, args_list, args_count, true);
+        }
+        free(word);
+    }
+    // a command that expanded to nothing is left empty, and does nothing
+    if (args_count == 0) {
+        args_list[args_count++] = strdup("");
+    }
+    command_line_parsed->command = strdup(args_list[0]);
+    // assign args list and count to command_line struct
+    command_line_parsed->args = args_list;
+    command_line_parsed->args_count = args_count;
+        
+    return command_line_parsed;
+}
+
+/******************************************************************************
+Returns a pointer to the start of the next word in str, or NULL if only spaces
+(and the newline) are left.
+******************************************************************************/
+char *next_word_start(char *str) {
+    str += strspn(str, " ");
+    return ((*str == '\0') || (*str == '\n')) ? NULL : str;
+}
+
+/******************************************************************************
+Copy the next word of the command line, starting at *cursor, and move *cursor
+past it. Words are separated by spaces, except inside '...' or "..." quotes
+and ${...} expansions. The quotes are kept in the word; expand_word removes 
+them.
+Returns: allocated word, or NULL at the end of the line
+******************************************************************************/
+char *next_word(char **cursor) {
+    char *start = next_word_start(*cursor);
+    if (!start) {
+        return NULL;
+    }
+    char *end = start;
+    char quote = '\0';
+    while (*end && (*end != '\n') && (quote || (*end != ' '))) {
+        char *brace;
+        if ((quote != '\'') && (end[0] == '$') && (end[1] == '{') 
+                && (brace = matching_brace(end + 1))) {
+            end = brace + 1;
+            continue;
+        }
+        if (quote && (*end == quote)) {
+            quote = '\0';
+        } else if (!quote && ((*end == '\'') || (*end == '"'))) {
+            quote = *end;
+        }
+        end++;
+    }
+    *cursor = end;
+    return strndup(start, end - start);
+}
+
+/******************************************************************************
+Expand one word of the command line into fields, appended to fields starting
+at field_count (at most 511 fields, per assignment specs):
+- '...' is copied as is; "..." allows $ expansions but they are not split
+- $$ expands into the process ID of the smallsh program
+- $NAME, ${NAME}, ${NAME[SUBSCRIPT]} etc. expand as described in 
+  expand_parameter. "${NAME[@]}" gives one field per array element, without
+  splitting any of them
+- unless split is false, unquoted expansions are split into separate fields
+  on spaces, tabs and newlines
+A word that expands to nothing (and had no quotes) gives no field.
+Returns: new field count
+******************************************************************************/
+int expand_word(char *word, char **fields, int field_count, bool split) {
+    struct field field = {0};
+    bool in_double = false;
+    char *c = word;
+    while (*c) {
+        if ((*c == '\'') && !in_double) {
+            char *end = strchrnul(c + 1, '\'');
+            field_append(&field, c + 1, end - c - 1);
+            field.quoted = true;
+            c = *end ? end + 1 : end;
+        }
+        else if (*c == '"') {
+            in_double = !in_double;
+            field.quoted = true;
+            c++;
+        }
+        else if ((c[0] == '$') && (c[1] == '$')) {
+            char pid[32];
+            sprintf(pid, "%d", getpid());
+            field_append(&field, pid, strlen(pid));
+            c += 2;
+        }
+        else if (*c == '$') {
+            char **values;
+            int value_count;
+            size_t len = expand_parameter(c, &values, &value_count);
+            if (len == 0) {
+                field_append(&field, c, 1);
+                c++;
+                continue;
+            }
+            for (int i = 0; i < value_count; i++) {
+                if (i > 0) {
+                    // each array element starts a new field
+                    field_count = end_field(&field, fields, field_count, true);
+                }
+                if (in_double || !split) {
+                    field_append(&field, values[i], strlen(values[i]));
+                } else {
+                    for (char *v = values[i]; *v; v++) {
+                        if ((*v == ' ') || (*v == '\t') || (*v == '\n')) {
+                            field_count = end_field(&field, fields, field_count, false);
+                        } else {
+                            field_append(&field, v, 1);
+                        }
+                    }
+                }
+                free(values[i]);
+            }
+            // "${NAME[@]}" of an empty array gives no field at all
+            if ((value_count == 0) && (c[1] == '{') && strstr(c, "[@]}")) {
+                field.empty_array = true;
+            }
+            free(values);
+            c += len;
+        }
+        else {
+            field_append(&field, c, 1);
+            c++;
+        }
+    }
+    if (field.empty_array && (field.len == 0)) {
+        field.quoted = false;
+    }
+    field_count = end_field(&field, fields, field_count, false);
+    free(field.text);
+    return field_count;
+}
+
+/******************************************************************************
+Append len characters of str to the field being built by expand_word.
+******************************************************************************/
+void field_append(struct field *field, char *str, size_t len) {
+    if (field->len + len + 1 > field->capacity) {
+        field->capacity = (field->len + len + 1) * 2;
+        field->text = realloc(field->text, field->capacity);
+    }
+    memcpy(field->text + field->len, str, len);
+    field->len += len;
+    field->text[field->len] = '\0';
+}
+
+/******************************************************************************
+Finish the field being built by expand_word: add it to fields if it has any
+text, was quoted, or keep_empty is true, then start a new empty field.
+Returns: new field count
+******************************************************************************/
+int end_field(struct field *field, char **fields, int field_count, bool keep_empty) {
+    if (((field->len > 0) || field->quoted || keep_empty) && (field_count < 511)) {
+        fields[field_count++] = field->len ? strndup(field->text, field->len) : strdup("");
+    }
+    field->len = 0;
+    field->quoted = false;
+    return field_count;
+}
+
+/******************************************************************************
+Expand a word into a single string: quotes are removed and expansions are not
+split, array elements are joined with spaces.
+Returns: allocated string
+******************************************************************************/
+char *expand_string(char *word) {
+    char *fields[512];
+    int field_count = expand_word(word, fields, 0, false);
+    char *joined = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&joined, &len);
+    for (int i = 0; i < field_count; i++) {
+        fprintf(stream, i ? " %s" : "%s", fields[i]);
+        free(fields[i]);
+    }
+    fclose(stream);
+    return joined;
+}
+
+/******************************************************************************
+Expand the variable reference at the start of str:
+    $NAME, ${NAME}          value of a variable (element 0 of an array), or
+                            of an environment variable
+    ${NAME[SUBSCRIPT]}      array element; SUBSCRIPT is expanded first, and is
+                            an index (negative counts from the end) or a key
+    ${NAME[@]}, ${NAME[*]}  all elements, as separate values for @ and joined
+                            with spaces for *
+    ${#NAME[@]}             number of elements
+    ${!NAME[@]}             indexes (keys) of the set elements
+    ${NAME<op>}             value changed by an operator, see apply_operator
+Unset variables expand to one empty value.
+Returns: length of the reference, or 0 if str does not start with one. The
+values are returned in *values (allocated, caller frees each value and the 
+array) and *value_count.
+******************************************************************************/
+size_t expand_parameter(char *str, char ***values, int *value_count) {
+    *values = NULL;
+    *value_count = 0;
+    if (str[1] != '{') {
+        size_t name_len = var_name_length(str + 1);
+        if (name_len == 0) {
+            return 0;
+        }
+        char *name = strndup(str + 1, name_len);
+        char *value = get_var(name);
+        add_value(values, value_count, value ? value : "");
+        free(name);
+        return name_len + 1;
+    }
+    char *end = matching_brace(str + 1);
+    if (!end) {
+        return 0;
+    }
+    char *p = str + 2;
+    char prefix = '\0';
+    if (((*p == '#') || (*p == '!')) && var_name_length(p + 1)) {
+        prefix = *p++;
+    }
+    size_t name_len = var_name_length(p);
+    if (name_len == 0) {
+        return 0;
+    }
+    char *name = strndup(p, name_len);
+    p += name_len;
+    char *subscript = NULL;
+    if (*p == '[') {
+        char *close = strchr(p, ']');
+        if (!close || (close > end)) {
+            free(name);
+            return 0;
+        }
+        char *raw = strndup(p + 1, close - p - 1);
+        subscript = expand_string(raw);
+        free(raw);
+        p = close + 1;
+    }
+    struct shell_var *var = var_lookup(name);
+    bool all = subscript && (!strcmp(subscript, "@") || !strcmp(subscript, "*"));
+    if (prefix == '#') {
+        char count[32];
+        if (all) {
+            sprintf(count, "%d", var_element_count(var));
+        } else {
+            char *value = subscript ? get_element(var, subscript) : get_var(name);
+            sprintf(count, "%zu", value ? strlen(value) : 0);
+        }
+        add_value(values, value_count, count);
+    } else if (all) {
+        var_all_values(var, prefix == '!', values, value_count);
+    } else {
+        char *value = subscript ? get_element(var, subscript) : get_var(name);
+        if (value) {
+            add_value(values, value_count, value);
+        }
+    }
+    if (p != end) {
+        char *op = strndup(p, end - p);
+        bool applied = !prefix && apply_operator(op, name, subscript, all, 
+                                                 values, value_count);
+        free(op);
+        if (!applied) {
+            // not a supported expansion
+            for (int i = 0; i < *value_count; i++) {
+                free((*values)[i]);
+            }
+            free(*values);
+            *values = NULL;
+            *value_count = 0;
+            free(name);
+            free(subscript);
+            return 0;
+        }
+    }
+    if (!all && (*value_count == 0)) {
+        // unset
+        add_value(values, value_count, "");
+    } else if (all && (subscript[0] == '*')) {
+        // join into one value
+        char *joined = NULL;
+        size_t len = 0;
+        FILE *stream = open_memstream(&joined, &len);
+        for (int i = 0; i < *value_count; i++) {
+            fprintf(stream, i ? " %s" : "%s", (*values)[i]);
+            free((*values)[i]);
+        }
+        fclose(stream);
+        *value_count = 0;
+        add_value(values, value_count, joined);
+        free(joined);
+    }
+    free(name);
+    free(subscript);
+    return end - str + 1;
+}
+
+/******************************************************************************
+Apply the operator part of ${NAME<op>} to the values of the variable (one 
+value, or one per element for ${NAME[@]}; no values if it is unset):
+    :-WORD  -WORD   WORD if unset or empty (- only if unset)
+    :=WORD  =WORD   as :-, and also assign WORD to NAME
+    :+WORD  +WORD   WORD if set and not empty (+ if set), otherwise nothing
+    :?WORD  ?WORD   print WORD as an error if unset or empty
+    :OFFSET[:LENGTH]    substring (a slice of the elements for [@]); a
+                    negative OFFSET or LENGTH counts from the end, write it
+                    as :(-2) or ": -2"
+    #PATTERN  ##PATTERN     remove the shortest/longest matching prefix
+    %PATTERN  %%PATTERN     remove the shortest/longest matching suffix
+    /PATTERN/REPLACEMENT    replace the longest match of PATTERN (// all 
+                    matches, /# only at the start, /% only at the end)
+    ^^  ,,  ^  ,    upper/lower case all characters, or the first one
+PATTERN is a glob (*, ?, [...]); WORD, PATTERN and REPLACEMENT are expanded
+first. Patterns are compiled once and cached (see glob_compile).
+Returns: false if op is not one of these (nothing is changed)
+******************************************************************************/
+bool apply_operator(char *op, char *name, char *subscript, bool all, 
+                    char ***values, int *value_count)
+{
+    bool unset = (*value_count == 0);
+    bool null = unset || ((*value_count == 1) && !(*values)[0][0]);
+    char kind = op[0];
+    bool colon = (kind == ':') && op[1] && strchr("-=+?", op[1]);
+    if (colon) {
+        kind = op[1];
+    }
+    if (strchr("-=+?", kind)) {
+        char *word = expand_string(op + (colon ? 2 : 1));
+        bool empty = colon ? null : unset;
+        if ((kind == '+') != empty) {
+            // replace the values with WORD
+            for (int i = 0; i < *value_count; i++) {
+                free((*values)[i]);
+            }
+            *value_count = 0;
+            if (kind != '?') {
+                add_value(values, value_count, word);
+            }
+        }
+        if ((kind == '=') && empty) {
+            if (subscript) {
+                fprintf(stderr, "%s[%s]: cannot assign in this way\n", name, subscript);
+            } else {
+                set_var(name, word);
+            }
+        } else if ((kind == '?') && empty) {
+            fprintf(stderr, "%s: %s\n", name, word[0] ? word : "parameter null or not set");
+        }
+        free(word);
+        return true;
+    }
+    if (kind == ':') {
+        return apply_substring(op + 1, all, values, value_count);
+    }
+    for (int i = 0; i < *value_count; i++) {
+        char *result;
+        if ((kind == '#') || (kind == '%')) {
+            bool longest = (op[1] == kind);
+            char *pattern = expand_string(op + (longest ? 2 : 1));
+            result = remove_match(pattern, (*values)[i], kind == '#', longest);
+            free(pattern);
+        } else if (kind == '/') {
+            result = replace_matches(op + 1, (*values)[i]);
+        } else if ((kind == '^') || (kind == ',')) {
+            result = strdup((*values)[i]);
+            size_t count = (op[1] == kind) ? strlen(result) : (result[0] ? 1 : 0);
+            for (size_t j = 0; j < count; j++) {
+                result[j] = (kind == '^') ? toupper((unsigned char)result[j]) 
+                                          : tolower((unsigned char)result[j]);
+            }
+        } else {
+            return false;
+        }
+        free((*values)[i]);
+        (*values)[i] = result;
+    }
+    return true;
+}
+
+/******************************************************************************
+${NAME:OFFSET[:LENGTH]}: replace each value with its substring, or for an 
+array (all is true) keep only that slice of the elements. OFFSET and LENGTH
+are numbers, or names of variables holding them.
+Returns: false if the offset is missing
+******************************************************************************/
+bool apply_substring(char *spec, bool all, char ***values, int *value_count) {
+    char *expanded = expand_string(spec);
+    char *length_str = strchr(expanded, ':');
+    if (length_str) {
+        *length_str++ = '\0';
+    }
+    long offset;
+    long length = LONG_MAX;
+    bool ok = parse_number(expanded, &offset) 
+                  && (!length_str || parse_number(length_str, &length));
+    free(expanded);
+    if (!ok) {
+        return false;
+    }
+    if (all) {
+        // slice of the elements
+        long count = *value_count;
+        long start = (offset < 0) ? count + offset : offset;
+        start = (start < 0) ? count : (start > count ? count : start);
+        long stop = (length < 0) ? count + length : (length > count - start ? count : start + length);
+        stop = (stop < start) ? start : stop;
+        for (long i = 0; i < count; i++) {
+            if ((i < start) || (i >= stop)) {
+                free((*values)[i]);
+            }
+        }
+        memmove(*values, *values + start, (stop - start) * sizeof(char *));
+        *value_count = stop - start;
+        return true;
+    }
+    for (int i = 0; i < *value_count; i++) {
+        long len = strlen((*values)[i]);
+        long start = (offset < 0) ? len + offset : offset;
+        start = (start < 0) ? len : (start > len ? len : start);
+        long stop = (length < 0) ? len + length : (length > len - start ? len : start + length);
+        stop = (stop < start) ? start : stop;
+        char *result = strndup((*values)[i] + start, stop - start);
+        free((*values)[i]);
+        (*values)[i] = result;
+    }
+    return true;
+}
+
+/******************************************************************************
+Parse an offset or length for ${NAME:OFFSET:LENGTH}: an integer (spaces and
+one pair of parentheses around it are ignored) or the name of a variable
+holding one.
+Returns: false if str is not a number
+******************************************************************************/
+bool parse_number(char *str, long *number) {
+    str += strspn(str, " (");
+    char *end;
+    if (var_name_length(str)) {
+        char *value = get_var(str);
+        *number = value ? strtol(value, NULL, 10) : 0;
+        return true;
+    }
+    *number = strtol(str, &end, 10);
+    return (end != str) && (end[strspn(end, " )")] == '\0');
+}
+
+/******************************************************************************
+Return a copy of value with the shortest (or longest) prefix (or suffix) that
+matches pattern removed.
+******************************************************************************/
+char *remove_match(char *pattern, char *value, bool prefix, bool longest) {
+    struct glob *glob = glob_compile(pattern);
+    size_t len = strlen(value);
+    size_t max_len = (glob->max_len < len) ? glob->max_len : len;
+    if (glob->min_len <= max_len) {
+        for (size_t i = 0; i <= max_len - glob->min_len; i++) {
+            size_t match_len = longest ? max_len - i : glob->min_len + i;
+            char *start = prefix ? value : value + len - match_len;
+            if (glob_match(glob, start, match_len)) {
+                return prefix ? strdup(value + match_len) : strndup(value, len - match_len);
+            }
+        }
+    }
+    return strdup(value);
+}
+
+/******************************************************************************
+${NAME/PATTERN/REPLACEMENT}: spec is the part after the first /. Replace the
+longest match of PATTERN at the first position it matches (every position
+for //, only the start for /#, only the end for /%).
+Returns: allocated result
+******************************************************************************/
+char *replace_matches(char *spec, char *value) {
+    char mode = '\0';
+    if ((spec[0] == '/') || (spec[0] == '#') || (spec[0] == '%')) {
+        mode = *spec++;
+    }
+    // the pattern ends at the first / that is not quoted with a backslash
+    char *slash = spec;
+    while (*slash && (*slash != '/')) {
+        slash += (slash[0] == '\\' && slash[1]) ? 2 : 1;
+    }
+    char *raw_pattern = strndup(spec, slash - spec);
+    char *pattern = expand_string(raw_pattern);
+    char *replacement = expand_string(*slash ? slash + 1 : "");
+    free(raw_pattern);
+    struct glob *glob = glob_compile(pattern);
+    size_t len = strlen(value);
+    char *result = NULL;
+    size_t result_len = 0;
+    FILE *stream = open_memstream(&result, &result_len);
+    size_t pos = 0;
+    bool replaced = false;
+    while (pattern[0] && (pos <= len) && !(replaced && (mode != '/'))) {
+        if ((mode == '#') && (pos > 0)) {
+            break;
+        }
+        // skip ahead to where the pattern's first literal character appears
+        // (/# and /% only try one position)
+        if ((glob->first_char != -1) && (mode != '%') && (mode != '#')) {
+            char *next = memchr(value + pos, glob->first_char, len - pos);
+            if (!next) {
+                break;
+            }
+            fwrite(value + pos, 1, next - (value + pos), stream);
+            pos = next - value;
+        }
+        size_t match_len = 0;
+        bool found = false;
+        size_t max_len = (glob->max_len < len - pos) ? glob->max_len : len - pos;
+        if (mode == '%') {
+            // only a match that ends at the end of the value
+            found = (len - pos <= glob->max_len) && (len - pos >= glob->min_len)
+                        && glob_match(glob, value + pos, len - pos);
+            match_len = len - pos;
+        } else {
+            for (size_t k = max_len + 1; k-- > glob->min_len;) {
+                if (glob_match(glob, value + pos, k)) {
+                    found = true;
+                    match_len = k;
+                    break;
+                }
+            }
+        }
+        if (found && (match_len > 0)) {
+            fputs(replacement, stream);
+            pos += match_len;
+            replaced = true;
+        } else if (pos < len) {
+            fputc(value[pos++], stream);
+        } else {
+            break;
+        }
+    }
+    if (pos < len) {
+        fputs(value + pos, stream);
+    }
+    fclose(stream);
+    free(pattern);
+    free(replacement);
+    return result;
+}
+
+/******************************************************************************
+Compile a glob pattern into a list of parts: runs of literal characters, ?,
+* and [...] classes ([!...] or [^...] to negate, with a-z ranges). A 
+backslash makes the next character literal. Compiled patterns are kept in a
+small direct-mapped cache indexed by the hash of the pattern text, so a 
+pattern used again (in a loop over many values) is only compiled once.
+Returns: the compiled pattern, owned by the cache
+******************************************************************************/
+struct glob *glob_compile(char *pattern) {
+    size_t slot = hash_string(pattern) % GLOB_CACHE_SIZE;
+    struct glob *glob = glob_cache[slot];
+    if (glob && !strcmp(glob->pattern, pattern)) {
+        return glob;
+    }
+    if (glob) {
+        glob_free(glob);
+    }
+    glob = glob_parse(pattern);
+    glob_cache[slot] = glob;
+    return glob;
+}
+
+/******************************************************************************
+Compile a glob pattern without the cache (see glob_compile). Used by builtin
+pipeline stages, which run on threads of their own and so must not share the 
+cache. The caller frees the result with glob_free.
+******************************************************************************/
+struct glob *glob_parse(char *pattern) {
+    struct glob *glob = calloc(1, sizeof(struct glob));
+    glob->pattern = strdup(pattern);
+    glob->parts = malloc((strlen(pattern) + 1) * sizeof(struct glob_part));
+    glob->literal = malloc(strlen(pattern) + 1);
+    glob->first_char = -1;
+    char *literal = glob->literal;
+    char *c = pattern;
+    while (*c) {
+        struct glob_part *part = &glob->parts[glob->part_count];
+        memset(part, 0, sizeof(struct glob_part));
+        if (*c == '*') {
+            part->type = GLOB_STAR;
+            glob->has_star = true;
+            // consecutive stars are the same as one
+            c += strspn(c, "*");
+        } else if (*c == '?') {
+            part->type = GLOB_ANY;
+            c++;
+        } else if ((*c == '[') && glob_class_end(c)) {
+            char *end = glob_class_end(c);
+            part->type = GLOB_CLASS;
+            bool negate = (c[1] == '!') || (c[1] == '^');
+            char *member = c + (negate ? 2 : 1);
+            // a ] right after [ is a member
+            do {
+                unsigned char low = *member;
+                unsigned char high = low;
+                if ((member[1] == '-') && (member + 2 < end)) {
+                    high = member[2];
+                    member += 2;
+                }
+                for (unsigned int m = low; m <= high; m++) {
+                    part->members[m / 8] |= 1 << (m % 8);
+                }
+                member++;
+            } while (member < end);
+            if (negate) {
+                for (int m = 0; m < 32; m++) {
+                    part->members[m] = ~part->members[m];
+                }
+            }
+            c = end + 1;
+        } else {
+            // run of literal characters
+            part->type = GLOB_LITERAL;
+            part->text = literal;
+            while (*c && !strchr("*?", *c) && !((*c == '[') && glob_class_end(c))) {
+                if ((*c == '\\') && c[1]) {
+                    c++;
+                }
+                *literal++ = *c++;
+            }
+            part->len = literal - part->text;
+            if (glob->part_count == 0) {
+                glob->first_char = (unsigned char)part->text[0];
+            }
+        }
+        glob->min_len += (part->type == GLOB_STAR) ? 0 
+                         : (part->type == GLOB_LITERAL) ? part->len : 1;
+        glob->part_count++;
+    }
+    glob->max_len = glob->has_star ? SIZE_MAX : glob->min_len;
+    return glob;
+}
+
+/******************************************************************************
+Returns a pointer to the ] closing the [...] class starting at c, or NULL if
+it is not closed (then the [ is a literal character).
+******************************************************************************/
+char *glob_class_end(char *c) {
+    char *member = c + 1;
+    if ((*member == '!') || (*member == '^')) {
+        member++;
+    }
+    if (*member == ']') {
+        member++;
+    }
+    return strchr(member, ']');
+}
+
+/******************************************************************************
+Returns true if the first len characters of str match the whole glob.
+Patterns are matched left to right; when a part does not match, the text 
+matched by the last * grows by one character and matching resumes after that
+*. Since the other parts have a fixed length, this finds a match if there is
+one without trying every combination of stars. When a literal follows the *,
+the star grows straight to the next place the literal occurs (memmem).
+******************************************************************************/
+bool glob_match(struct glob *glob, char *str, size_t len) {
+    if ((len < glob->min_len) || (len > glob->max_len)) {
+        return false;
+    }
+    int part = 0;
+    size_t pos = 0;
+    int star_part = -1;
+    size_t star_pos = 0;
+    while (pos < len) {
+        if (part < glob->part_count) {
+            struct glob_part *p = &glob->parts[part];
+            if (p->type == GLOB_STAR) {
+                star_part = part++;
+                star_pos = pos;
+                if (!glob_star_skip(glob, star_part, str, len, &star_pos)) {
+                    return false;
+                }
+                pos = star_pos;
+                continue;
+            }
+            unsigned char c = str[pos];
+            if (((p->type == GLOB_ANY))
+                    || ((p->type == GLOB_CLASS) && (p->members[c / 8] & (1 << (c % 8))))
+                    || ((p->type == GLOB_LITERAL) && (p->len <= len - pos) 
+                        && !memcmp(str + pos, p->text, p->len))) {
+                pos += (p->type == GLOB_LITERAL) ? p->len : 1;
+                part++;
+                continue;
+            }
+        }
+        if (star_part == -1) {
+            return false;
+        }
+        part = star_part + 1;
+        star_pos++;
+        if (!glob_star_skip(glob, star_part, str, len, &star_pos)) {
+            return false;
+        }
+        pos = star_pos;
+    }
+    while ((part < glob->part_count) && (glob->parts[part].type == GLOB_STAR)) {
+        part++;
+    }
+    return part == glob->part_count;
+}
+
+/******************************************************************************
+Move pos, the end of the text matched by the * at star_part, to the next place
+where the literal following the * occurs, if a literal follows it.
+Returns: false if the literal does not occur after pos (then nothing matches)
+******************************************************************************/
+bool glob_star_skip(struct glob *glob, int star_part, char *str, size_t len, 
+                    size_t *pos) 
+{
+    if ((star_part + 1 == glob->part_count) 
+            || (glob->parts[star_part + 1].type != GLOB_LITERAL)) {
+        return true;
+    }
+    struct glob_part *next = &glob->parts[star_part + 1];
+    char *found = (*pos <= len) ? memmem(str + *pos, len - *pos, next->text, next->len) 
+                                : NULL;
+    if (!found) {
+        return false;
+    }
+    *pos = found - str;
+    return true;
+}
+
+/******************************************************************************
+Free a compiled glob pattern.
+******************************************************************************/
+void glob_free(struct glob *glob) {
+    free(glob->pattern);
+    free(glob->parts);
+    free(glob->literal);
+    free(glob);
+}
+
+/******************************************************************************
+Returns a pointer to the } that matches the { at str, or NULL if there is none.
+******************************************************************************/
+char *matching_brace(char *str) {
+    int depth = 0;
+    for (char *c = str; *c; c++) {
+        if (*c == '{') {
+            depth++;
+        } else if ((*c == '}') && (--depth == 0)) {
+            return c;
+        }
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Append a copy of value to an allocated array of values.
+******************************************************************************/
+void add_value(char ***values, int *value_count, char *value) {
+    // allocate in blocks of 16 values
+    if (*value_count % 16 == 0) {
+        *values = realloc(*values, (*value_count + 16) * sizeof(char *));
+    }
+    (*values)[(*value_count)++] = strdup(value);
+}
+
+/******************************************************************************
+If the command line is made up only of assignment words, parse them into 
+command_line->assignments. Values are expanded now, as the other words of a 
+command line are: NAME=VALUE gives one value without splitting, and each
+VALUE of NAME=(VALUE...) can give several (for example "${other[@]}").
+An element written [KEY]=VALUE sets that index or key.
+Returns: true if this was an assignment line
+******************************************************************************/
+bool parse_assignments(char *command_line_str, struct command_line *command_line) {
+    char *cursor = command_line_str;
+    char *word;
+    // check every word first, the words of a list do not need to be 
+    // assignments
+    while ((word = next_word(&cursor))) {
+        size_t name_len = assignment_name_length(word);
+        char *value = word + name_len;
+        if (name_len == 0) {
+            free(word);
+            return false;
+        }
+        if (value[0] == '(') {
+            // skip to the word ending the list
+            while (!strchr(value, ')')) {
+                free(word);
+                value = word = next_word(&cursor);
+                if (!word) {
+                    return false;
+                }
+            }
+        }
+        free(word);
+    }
+    if (cursor == command_line_str) {
+        return false;
+    }
+    cursor = command_line_str;
+    while ((word = next_word(&cursor))) {
+        command_line->assignments = realloc(command_line->assignments,
+            (command_line->assignment_count + 1) * sizeof(struct assignment));
+        struct assignment *assignment = 
+            &command_line->assignments[command_line->assignment_count++];
+        memset(assignment, 0, sizeof(struct assignment));
+        size_t name_len = assignment_name_length(word);
+        char *value = word + name_len;
+        assignment->append = (value[-2] == '+');
+        char *subscript = strchr(word, '[');
+        if (subscript && (subscript < value)) {
+            assignment->name = strndup(word, subscript - word);
+            assignment->subscript = strndup(subscript + 1, 
+                strchr(subscript, ']') - subscript - 1);
+            char *expanded = expand_string(assignment->subscript);
+            free(assignment->subscript);
+            assignment->subscript = expanded;
+        } else {
+            assignment->name = strndup(word, name_len - (assignment->append ? 2 : 1));
+        }
+        if (value[0] != '(') {
+            add_value(&assignment->values, &assignment->value_count, "");
+            free(assignment->values[0]);
+            assignment->values[0] = expand_string(value);
+            free(word);
+            continue;
+        }
+        // NAME=(VALUE...) may continue over several words
+        assignment->is_list = true;
+        char *element = strdup(value + 1);
+        free(word);
+        while (true) {
+            char *close = strrchr(element, ')');
+            if (close) {
+                *close = '\0';
+            }
+            if (element[0]) {
+                add_list_element(assignment, element);
+            }
+            free(element);
+            if (close) {
+                break;
+            }
+            element = next_word(&cursor);
+        }
+    }
+    return true;
+}
+
+/******************************************************************************
+Expand one element of an assignment list into assignment's values (and keys,
+NULL where the element has no [KEY]= part).
+******************************************************************************/
+void add_list_element(struct assignment *assignment, char *element) {
+    char *key = NULL;
+    char *value = element;
+    char *close = strstr(element, "]=");
+    if ((element[0] == '[') && close) {
+        key = strndup(element + 1, close - element - 1);
+        value = close + 2;
+    }
+    char *fields[512];
+    int field_count;
+    if (key) {
+        fields[0] = expand_string(value);
+        field_count = 1;
+    } else {
+        field_count = expand_word(value, fields, 0, true);
+    }
+    for (int i = 0; i < field_count; i++) {
+        int count = assignment->value_count;
+        add_value(&assignment->values, &assignment->value_count, fields[i]);
+        free(fields[i]);
+        // keys are kept in step with values
+        if (count % 16 == 0) {
+            assignment->keys = realloc(assignment->keys, (count + 16) * sizeof(char *));
+        }
+        assignment->keys[count] = NULL;
+        if (key && (i == 0)) {
+            assignment->keys[count] = expand_string(key);
+        }
+    }
+    free(key);
+}
+
+/******************************************************************************
+Returns the length of the NAME=, NAME+=, NAME[SUBSCRIPT]= or NAME[SUBSCRIPT]+=
+at the start of word, or 0 if word is not an assignment.
+******************************************************************************/
+size_t assignment_name_length(char *word) {
+    size_t len = var_name_length(word);
+    if (len == 0) {
+        return 0;
+    }
+    if (word[len] == '[') {
+        char *close = strchr(word + len, ']');
+        if (!close) {
+            return 0;
+        }
+        len = close - word + 1;
+    }
+    if (word[len] == '+') {
+        len++;
+    }
+    return (word[len] == '=') ? len + 1 : 0;
+}
+
+/******************************************************************************
+Initialize a new command_line struct, this cleared several read memory warnings
+The warnings were with the printf and free memory functions since the 
+parse_command line function does not assign a value to all of the structure
+members.
+******************************************************************************/
+void initialize_struct(struct command_line *command_line_parsed) {
+    command_line_parsed->command = NULL;
+    command_line_parsed->args = NULL;
+    command_line_parsed->args_count = 0;
+    command_line_parsed->input_file = NULL;
+    command_line_parsed->output_file = NULL;
+    command_line_parsed->run_in_background = 0;
+    command_line_parsed->stream_fd = -1;
+    command_line_parsed->next = NULL;
+    command_line_parsed->assignments = NULL;
+    command_line_parsed->assignment_count = 0;
+    command_line_parsed->listen_fds = NULL;
+    command_line_parsed->listen_fd_count = 0;
+    command_line_parsed->listen_names = NULL;
+}
+
+
+/******************************************************************************
+Handle the command from the comand line. 
+Assignment lines set shell variables.
+Background commands still being launched by the spawner pool are waited for
+before a built in command or pipeline runs, so jobs and kill see them.
+Pipelines are passed to run_pipeline.
+Built in commands are looked up in the builtins table and run by run_builtin.
+All other commands are sent to fork_child function to process.
+Before forking, add NULl to end of args list
+******************************************************************************/
+void handle_command_line(struct command_line *command_line, int *status,
+                         struct job_table *jobs) 
+{
+    if (command_line->assignment_count) {
+        run_assignments(command_line);
+        return;
+    }
+    if (!command_line->command[0] && (command_line->args_count == 1) 
+            && !command_line->next) {
+        // the words of the command all expanded to nothing
+        return;
+    }
+    struct builtin *builtin = find_builtin(command_line->command);
+    if (spawn_pool.in_flight && (builtin || command_line->next)) {
+        // built in commands see every job launched before them
+        wait_spawns(jobs, NULL, 0);
+    }
+    if (command_line->next) {
+        // two or more commands connected with '|'
+        run_pipeline(command_line, status, jobs);
+    }
+    else if (builtin) {
+        run_builtin(builtin, command_line, status, jobs);
+    }
+    else {
+        // add NULL to args list
+        command_line->args[command_line->args_count] = NULL;
+        command_line->args_count += 1;
+        // print_command_line(command_line);
+        fork_child(command_line, status, jobs);
+    }
+}
+
+/******************************************************************************
+Look up a command in the builtins table.
+Returns: the builtin, or NULL if command is not built in
+******************************************************************************/
+struct builtin *find_builtin(char *command) {
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (!strcmp(command, builtins[i].name)) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Run a built in command in the shell process. Input and output redirection
+files are opened for the builtin (in place of stdin/stdout) and closed after.
+******************************************************************************/
+void run_builtin(struct builtin *builtin, struct command_line *command_line,
+                 int *status, struct job_table *jobs)
+{
+    FILE *in = stdin;
+    FILE *out = stdout;
+    if (command_line->input_file && !builtin->shell_redirects) {
+        in = fopen(command_line->input_file, "re");
+        if (!in) {
+            printf("cannot open %s for input\n", command_line->input_file);
+            fflush(stdout);
+            *status = 1;
+            return;
+        }
+    }
+    if (command_line->output_file && !builtin->shell_redirects) {
+        out = fopen(command_line->output_file, "we");
+        if (!out) {
+            printf("cannot open %s for output\n", command_line->output_file);
+            fflush(stdout);
+            *status = 1;
+            if (in != stdin) {
+                fclose(in);
+            }
+            return;
+        }
+    }
+    int result = builtin->run(command_line, in, out, status, jobs);
+    if (builtin->sets_status) {
+        *status = result;
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (out != stdout) {
+        fclose(out);
+    } else {
+        fflush(stdout);
+    }
+}
+
+/******************************************************************************
+"cd [DIR]" built in command. With no DIR, change to the HOME directory.
+******************************************************************************/
+int cd_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs)
+{
+    if (command_line->args_count == 1) {
+        // change directory to Home environment variable if "cd" is
+        // the only arg in args_list
+        change_dir(getenv("HOME"));
+    } else {
+        // change directory to path specified after "cd" command
+        change_dir(command_line->args[1]);
+    }
+    return 0;
+}
+
+/******************************************************************************
+"status" built in command.
+******************************************************************************/
+int status_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs)
+{
+    display_status(status, out);
+    return 0;
+}
+
+/******************************************************************************
+"at TIME command" built in command - run command once at TIME.
+******************************************************************************/
+int at_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs)
+{
+    time_t deadline;
+    if ((command_line->args_count < 3) 
+            || !parse_at_time(command_line->args[1], &deadline)) {
+        fprintf(stderr, "usage: at +N[smhd] | HH:MM[:SS] | @EPOCH command\n");
+        return 1;
+    }
+    schedule_command(command_line, 2, deadline, 0, false, out);
+    return 0;
+}
+
+/******************************************************************************
+"every [-q|-s] INTERVAL command" built in command - run command periodically.
+******************************************************************************/
+int every_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs)
+{
+    long interval;
+    int arg = 1;
+    bool queue_overlaps = false;
+    if ((command_line->args_count > 1) 
+            && (!strcmp(command_line->args[1], "-q") 
+                || !strcmp(command_line->args[1], "-s"))) {
+        queue_overlaps = !strcmp(command_line->args[1], "-q");
+        arg++;
+    }
+    if ((command_line->args_count < arg + 2) 
+            || !parse_duration(command_line->args[arg], &interval)
+            || (interval <= 0)) {
+        fprintf(stderr, "usage: every [-q|-s] N[smhd] command\n");
+        return 1;
+    }
+    schedule_command(command_line, arg + 1, time(NULL) + interval,
+                     interval, queue_overlaps, out);
+    return 0;
+}
+
+/******************************************************************************
+"echo [-neE] [ARG...]" built in command. Prints the args separated by spaces
+and followed by a newline, the same way as coreutils echo:
+    -n  do not print the trailing newline
+    -e  interpret backslash escapes (\n, \t, \\, \0NNN, \xHH, \c, ...)
+    -E  do not interpret backslash escapes (default)
+******************************************************************************/
+int echo_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    if (stage_records_out) {
+        // echo into memory, then pass each line on as a record
+        return records_from_text(echo_command, command_line, in, status, jobs,
+                                 false);
+    }
+    bool newline = true;
+    bool escapes = false;
+    int i = 1;
+    // leading args made up only of n, e and E are options
+    for (; i < command_line->args_count; i++) {
+        char *arg = command_line->args[i];
+        if ((arg[0] != '-') || (arg[1] == '\0') 
+                || (strspn(arg + 1, "neE") != strlen(arg + 1))) {
+            break;
+        }
+        for (char *c = arg + 1; *c; c++) {
+            if (*c == 'n') {
+                newline = false;
+            } else {
+                escapes = (*c == 'e');
+            }
+        }
+    }
+    for (int first = i; i < command_line->args_count; i++) {
+        if (i > first) {
+            fputc(' ', out);
+        }
+        if (!escapes) {
+            fputs(command_line->args[i], out);
+            continue;
+        }
+        for (char *c = command_line->args[i]; *c; c++) {
+            if ((*c != '\\') || (c[1] == '\0')) {
+                fputc(*c, out);
+                continue;
+            }
+            c++;
+            int value = 0;
+            int digits;
+            switch (*c) {
+                case 'a': fputc('\a', out); break;
+                case 'b': fputc('\b', out); break;
+                case 'c': return 0;     // \c: stop printing
+                case 'e': fputc(033, out); break;
+                case 'f': fputc('\f', out); break;
+                case 'n': fputc('\n', out); break;
+                case 'r': fputc('\r', out); break;
+                case 't': fputc('\t', out); break;
+                case 'v': fputc('\v', out); break;
+                case '\\': fputc('\\', out); break;
+                case '0':
+                    for (digits = 0; (digits < 3) && (c[1] >= '0') && (c[1] <= '7'); digits++) {
+                        value = value * 8 + (*++c - '0');
+                    }
+                    fputc(value, out);
+                    break;
+                case 'x':
+                    if (!isxdigit((unsigned char)c[1])) {
+                        fputs("\\x", out);
+                        break;
+                    }
+                    for (digits = 0; (digits < 2) && isxdigit((unsigned char)c[1]); digits++) {
+                        c++;
+                        value = value * 16 + (isdigit((unsigned char)*c) ? *c - '0' 
+                                              : tolower((unsigned char)*c) - 'a' + 10);
+                    }
+                    fputc(value, out);
+                    break;
+                default:
+                    fputc('\\', out);
+                    fputc(*c, out);
+                    break;
+            }
+        }
+    }
+    if (newline) {
+        fputc('\n', out);
+    }
+    return 0;
+}
+
+/******************************************************************************
+"read [-r] [-d DELIM] [-a ARRAY] [-u FD] [NAME...]" built in command. Reads 
+one record (up to DELIM, a newline by default) from the input, or from file
+descriptor FD (opened with exec 3< FILE, say), and splits it into fields
+on the characters of IFS (space, tab and newline if IFS is not set):
+- each NAME gets one field, the last NAME gets the rest of the record
+- with -a, ARRAY is set to all of the fields
+- with no NAME, REPLY is set to the whole record
+Without -r a backslash quotes the next character, so it is not a field
+separator, and a backslash before DELIM continues the record onto the next
+line. Returns 1 at end of file (variables still get any partial record).
+Reading from the shell's own input consumes the lines after the read command,
+the same way bash does for scripts fed on stdin.
+******************************************************************************/
+int read_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    bool raw = false;
+    int delim = '\n';
+    char *array_name = NULL;
+    int input_fd = -1;
+    int i = 1;
+    for (; i < command_line->args_count; i++) {
+        char *arg = command_line->args[i];
+        if (!strcmp(arg, "-r")) {
+            raw = true;
+        } else if (!strcmp(arg, "-u") && (i + 1 < command_line->args_count)) {
+            char *end;
+            input_fd = strtol(command_line->args[++i], &end, 10);
+            // the shell's own fds are close-on-exec, the ones exec opens aren't
+            int fd_flags = (*end || (input_fd < 0)) ? -1 : fcntl(input_fd, F_GETFD);
+            if ((fd_flags == -1) || ((input_fd > 2) && (fd_flags & FD_CLOEXEC))) {
+                fprintf(stderr, "read: %s: invalid file descriptor\n", 
+                        command_line->args[i]);
+                return 1;
+            }
+        } else if (!strcmp(arg, "-d") && (i + 1 < command_line->args_count)) {
+            delim = (unsigned char)command_line->args[++i][0];
+        } else if (!strcmp(arg, "-a") && (i + 1 < command_line->args_count)) {
+            array_name = command_line->args[++i];
+        } else {
+            break;
+        }
+    }
+    char **names = command_line->args + i;
+    int name_count = command_line->args_count - i;
+    if (array_name && !var_name_length(array_name)) {
+        fprintf(stderr, "read: %s: not a valid identifier\n", array_name);
+        return 1;
+    }
+    for (i = 0; i < name_count; i++) {
+        if (var_name_length(names[i]) != strlen(names[i])) {
+            fprintf(stderr, "read: %s: not a valid identifier\n", names[i]);
+            return 1;
+        }
+    }
+    // the shell reads its own commands from fd 0 with read_record, nothing 
+    // of stdin is buffered in stdio; other input files were just opened
+    int fd = (in == stdin) ? STDIN_FILENO : fileno(in);
+    if (input_fd != -1) {
+        fd = input_fd;
+    }
+    char *record = NULL;
+    size_t capacity = 0;
+    ssize_t len;
+    if (fd == -1) {
+        // an in-memory stream from another pipeline stage
+        len = getdelim(&record, &capacity, delim, in);
+    } else {
+        len = read_record(fd, delim, &record, &capacity);
+    }
+    if (len < 0) {
+        len = 0;
+    }
+    bool found_delim = (len > 0) && (record[len - 1] == delim);
+    // quoted[j] is true for characters escaped with a backslash
+    char *text = malloc(len + 1);
+    bool *quoted = malloc(len + 1);
+    size_t text_len = 0;
+    ssize_t j = 0;
+    while (j < len) {
+        if (!raw && (record[j] == '\\') && (j + 1 < len)) {
+            if ((j + 2 == len) && found_delim) {
+                // backslash before the delimiter: continue onto next record
+                ssize_t more = (fd == -1) ? getdelim(&record, &capacity, delim, in)
+                                          : read_record(fd, delim, &record, &capacity);
+                // read_record replaces the buffer, keep what is left
+                if (more <= 0) {
+                    found_delim = false;
+                    break;
+                }
+                found_delim = (record[more - 1] == delim);
+                text = realloc(text, text_len + more + 1);
+                quoted = realloc(quoted, text_len + more + 1);
+                len = more;
+                j = 0;
+                continue;
+            }
+            text[text_len] = record[j + 1];
+            quoted[text_len++] = true;
+            j += 2;
+            continue;
+        }
+        if ((j == len - 1) && found_delim) {
+            break;
+        }
+        if (!raw && (record[j] == '\\')) {
+            // lone backslash at end of file is dropped
+            j++;
+            continue;
+        }
+        text[text_len] = record[j];
+        quoted[text_len++] = false;
+        j++;
+    }
+    text[text_len] = '\0';
+    free(record);
+    if (!array_name && (name_count == 0)) {
+        set_var("REPLY", text);
+    } else {
+        split_fields(text, quoted, text_len, array_name, names, name_count);
+    }
+    free(text);
+    free(quoted);
+    return (len > 0) && found_delim ? 0 : 1;
+}
+
+/******************************************************************************
+Split text into fields for read and assign them. Fields are separated by runs
+of IFS whitespace, or by one other IFS character (with any whitespace around
+it). Leading and trailing IFS whitespace is ignored. Characters marked in
+quoted never separate fields.
+******************************************************************************/
+void split_fields(char *text, bool *quoted, size_t len, char *array_name,
+                  char **names, int name_count)
+{
+    char *ifs = get_var("IFS");
+    if (!ifs) {
+        ifs = " \t\n";
+    }
+    size_t pos = 0;
+    int field_count = 0;
+    int field_capacity = 8;
+    char **fields = malloc(field_capacity * sizeof(char *));
+    // skip leading IFS whitespace
+    while ((pos < len) && !quoted[pos] && strchr(ifs, text[pos]) 
+               && isspace((unsigned char)text[pos])) {
+        pos++;
+    }
+    while (pos < len) {
+        // the last name gets the rest of the text, without trailing IFS
+        // whitespace
+        if (!array_name && (field_count == name_count - 1)) {
+            size_t end = len;
+            while ((end > pos) && !quoted[end - 1] && text[end - 1] 
+                       && strchr(ifs, text[end - 1]) 
+                       && isspace((unsigned char)text[end - 1])) {
+                end--;
+            }
+            fields[field_count++] = strndup(text + pos, end - pos);
+            break;
+        }
+        size_t start = pos;
+        while ((pos < len) && (quoted[pos] || !text[pos] || !strchr(ifs, text[pos]))) {
+            pos++;
+        }
+        if (field_count == field_capacity) {
+            field_capacity *= 2;
+            fields = realloc(fields, field_capacity * sizeof(char *));
+        }
+        fields[field_count++] = strndup(text + start, pos - start);
+        // skip the separator: whitespace, then at most one other IFS 
+        // character, then whitespace again
+        bool separator = false;
+        while ((pos < len) && !quoted[pos] && text[pos] && strchr(ifs, text[pos])) {
+            if (!isspace((unsigned char)text[pos])) {
+                if (separator) {
+                    break;
+                }
+                separator = true;
+            }
+            pos++;
+        }
+    }
+    if (array_name) {
+        set_var_array(array_name, fields, field_count);
+        return;
+    }
+    for (int i = 0; i < name_count; i++) {
+        set_var(names[i], (i < field_count) ? fields[i] : "");
+    }
+    for (int i = 0; i < field_count; i++) {
+        free(fields[i]);
+    }
+    free(fields);
+}
+
+/******************************************************************************
+Read from fd up to and including the next delim character, into *record 
+(grown as needed, NUL terminated). Never consumes anything past delim, so the
+rest of the input is left for whoever reads fd next (a child process, or the
+next read):
+- regular files are read a block at a time, and the file offset is moved back
+  to just after delim with lseek
+- a terminal delivers at most one line per read, so it is read a block at a
+  time when delim is a newline
+- anything else (pipes, sockets) cannot be moved back and is read one byte at
+  a time
+Returns the number of bytes read (0 at end of file), or -1 on error.
+******************************************************************************/
+ssize_t read_record(int fd, int delim, char **record, size_t *capacity) {
+    struct stat fd_stat;
+    if (fstat(fd, &fd_stat) == -1) {
+        return -1;
+    }
+    bool seekable = S_ISREG(fd_stat.st_mode);
+    bool line_device = (delim == '\n') && S_ISCHR(fd_stat.st_mode) && isatty(fd);
+    size_t block = (seekable || line_device) ? 4096 : 1;
+    size_t len = 0;
+    while (true) {
+        if (*capacity < len + block + 1) {
+            *capacity = (len + block + 1) * 2;
+            *record = realloc(*record, *capacity);
+        }
+        ssize_t count = read(fd, *record + len, block);
+        if ((count == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (count == -1) {
+            (*record)[len] = '\0';
+            return len ? (ssize_t)len : -1;
+        }
+        if (count == 0) {
+            break;
+        }
+        char *found = memchr(*record + len, delim, count);
+        if (found) {
+            size_t used = found - (*record + len) + 1;
+            if (seekable && (used < (size_t)count)) {
+                lseek(fd, (off_t)used - count, SEEK_CUR);
+            }
+            len += used;
+            break;
+        }
+        len += count;
+        // long records: read bigger blocks
+        if (seekable && (block < 65536)) {
+            block *= 2;
+        }
+    }
+    (*record)[len] = '\0';
+    return len;
+}
+
+/******************************************************************************
+"declare [-a|-A|-p] NAME..." built in command. -a makes each NAME an indexed
+array and -A an associative array (existing values are kept; an array cannot
+be changed to the other kind). With no option NAME is created as a variable
+with no value if it does not exist. -p prints each NAME (all variables if 
+there are none) in the form they can be assigned back from.
+******************************************************************************/
+int declare_command(struct command_line *command_line, FILE *in, FILE *out,
+                    int *status, struct job_table *jobs)
+{
+    char option = '\0';
+    int i = 1;
+    int result = 0;
+    if ((i < command_line->args_count) && (command_line->args[i][0] == '-')) {
+        option = command_line->args[i++][1];
+    }
+    if ((option == 'p') && (i == command_line->args_count)) {
+        for (size_t j = 0; j < shell_vars.capacity; j++) {
+            if (shell_vars.entries[j].name) {
+                print_declaration(&shell_vars.entries[j], out);
+            }
+        }
+        return 0;
+    }
+    for (; i < command_line->args_count; i++) {
+        char *name = command_line->args[i];
+        if (var_name_length(name) != strlen(name)) {
+            fprintf(stderr, "declare: %s: not a valid identifier\n", name);
+            result = 1;
+            continue;
+        }
+        if (option == 'p') {
+            struct shell_var *var = var_lookup(name);
+            if (var->name) {
+                print_declaration(var, out);
+            } else {
+                fprintf(stderr, "declare: %s: not found\n", name);
+                result = 1;
+            }
+            continue;
+        }
+        struct shell_var *var = var_create(name);
+        if ((option == 'a') && (var->type == VAR_ASSOC)) {
+            fprintf(stderr, "declare: %s: cannot convert associative to indexed array\n", name);
+            result = 1;
+        } else if (option == 'a') {
+            var_make_indexed(var);
+        } else if ((option == 'A') && (var->type == VAR_INDEXED)) {
+            fprintf(stderr, "declare: %s: cannot convert indexed to associative array\n", name);
+            result = 1;
+        } else if ((option == 'A') && (var->type == VAR_SCALAR)) {
+            char *value = var->value;
+            var->value = NULL;
+            var->type = VAR_ASSOC;
+            if (value) {
+                assoc_set(var, "0", value, false);
+                free(value);
+            }
+        }
+    }
+    return result;
+}
+
+/******************************************************************************
+Print a variable for declare -p, e.g. declare -a list=([0]="a" [1]="b").
+******************************************************************************/
+void print_declaration(struct shell_var *var, FILE *out) {
+    if (var->type == VAR_SCALAR) {
+        fprintf(out, "declare -- %s", var->name);
+        if (var->value) {
+            fprintf(out, "=\"%s\"", var->value);
+        }
+        fprintf(out, "\n");
+        return;
+    }
+    char **keys = NULL;
+    char **values = NULL;
+    int key_count = 0;
+    int value_count = 0;
+    var_all_values(var, true, &keys, &key_count);
+    var_all_values(var, false, &values, &value_count);
+    fprintf(out, "declare -%c %s=(", (var->type == VAR_ASSOC) ? 'A' : 'a', var->name);
+    for (int i = 0; i < key_count; i++) {
+        fprintf(out, "%s[%s]=\"%s\"", i ? " " : "", keys[i], values[i]);
+        free(keys[i]);
+        free(values[i]);
+    }
+    fprintf(out, ")\n");
+    free(keys);
+    free(values);
+}
+
+/******************************************************************************
+"mapfile [-t] [-d DELIM] [ARRAY]" (or readarray) built in command. Reads all
+of the input into the indexed array ARRAY (MAPFILE by default), one element
+per line (or per DELIM-terminated record). -t removes the delimiter from each
+element.
+The input is read in one large read (a few for pipes) into one block, which
+is split in place: with -t each delimiter is replaced by the end of string 
+and the elements point into the block, which the array keeps.
+******************************************************************************/
+int mapfile_command(struct command_line *command_line, FILE *in, FILE *out,
+                    int *status, struct job_table *jobs)
+{
+    bool trim = false;
+    int delim = '\n';
+    char *name = "MAPFILE";
+    for (int i = 1; i < command_line->args_count; i++) {
+        char *arg = command_line->args[i];
+        if (!strcmp(arg, "-t")) {
+            trim = true;
+        } else if (!strcmp(arg, "-d") && (i + 1 < command_line->args_count)) {
+            delim = (unsigned char)command_line->args[++i][0];
+        } else {
+            name = arg;
+        }
+    }
+    if (var_name_length(name) != strlen(name)) {
+        fprintf(stderr, "%s: %s: not a valid identifier\n", command_line->command, name);
+        return 1;
+    }
+    size_t len;
+    char *data = read_all(in, &len);
+    if (!data) {
+        fprintf(stderr, "%s: %s\n", command_line->command, strerror(errno));
+        return 1;
+    }
+    // count the records, the last one may have no delimiter
+    int count = 0;
+    for (char *c = data; (c = memchr(c, delim, data + len - c)); c++) {
+        count++;
+    }
+    if ((len > 0) && (data[len - 1] != delim)) {
+        count++;
+    }
+    char **elements = malloc((count ? count : 1) * sizeof(char *));
+    char *storage = data;
+    if (!trim) {
+        // each element keeps its delimiter and needs its own end of string
+        storage = malloc(len + count + 1);
+    }
+    char *record = data;
+    char *dest = storage;
+    for (int i = 0; i < count; i++) {
+        char *end = memchr(record, delim, data + len - record);
+        size_t record_len = end ? (size_t)(end - record) : (size_t)(data + len - record);
+        if (trim) {
+            record[record_len] = '\0';
+            elements[i] = record;
+        } else {
+            size_t keep = end ? record_len + 1 : record_len;
+            memcpy(dest, record, keep);
+            dest[keep] = '\0';
+            elements[i] = dest;
+            dest += keep + 1;
+        }
+        record += record_len + 1;
+    }
+    if (!trim) {
+        free(data);
+        len = dest - storage;
+    }
+    set_var_array(name, elements, count);
+    struct shell_var *var = var_lookup(name);
+    var->storage = storage;
+    var->storage_len = len + 1;
+    return 0;
+}
+
+/******************************************************************************
+Read everything left in the input into one allocated block. A regular file is
+read with one read of its remaining size; other input is read in blocks that
+double in size. The block has room for an end of string after the data.
+Returns: the block (its length in *len), or NULL on error
+******************************************************************************/
+char *read_all(FILE *in, size_t *len) {
+    // the shell reads its own commands from fd 0 with read_record, nothing of
+    // stdin is buffered in stdio; other input files were just opened
+    int fd = (in == stdin) ? STDIN_FILENO : fileno(in);
+    struct stat fd_stat;
+    size_t capacity = 65536;
+    if ((fd != -1) && (fstat(fd, &fd_stat) == 0) && S_ISREG(fd_stat.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if ((offset != -1) && (fd_stat.st_size > offset)) {
+            capacity = fd_stat.st_size - offset + 1;
+        }
+    }
+    char *data = malloc(capacity + 1);
+    *len = 0;
+    while (true) {
+        if (*len == capacity) {
+            capacity *= 2;
+            data = realloc(data, capacity + 1);
+        }
+        ssize_t count;
+        if (fd == -1) {
+            count = fread(data + *len, 1, capacity - *len, in);
+        } else {
+            count = read(fd, data + *len, capacity - *len);
+        }
+        if ((count == -1) && (errno == EINTR)) {
+            continue;
+        }
+        if (count == -1) {
+            free(data);
+            return NULL;
+        }
+        if (count == 0) {
+            break;
+        }
+        *len += count;
+    }
+    data[*len] = '\0';
+    return data;
+}
+
+
+/******************************************************************************
+"[[ EXPRESSION ]]" conditional. Returns 0 if EXPRESSION is true, 1 if it is
+false or not valid (status only keeps exit values 0 and 1, see 
+display_status). EXPRESSION is made of:
+    -e FILE, -f FILE, -d FILE, -s FILE  exists, is a regular file, is a 
+                                directory, is not empty
+    -r FILE, -w FILE, -x FILE   is readable, writable, executable
+    FILE1 -nt FILE2, FILE1 -ot FILE2    is newer/older (modification time)
+    -z STRING, -n STRING, STRING    is empty, is not empty
+    STRING == PATTERN, STRING != PATTERN    matches the glob PATTERN (= is ==)
+    STRING =~ REGEX             matches the extended regular expression; the
+                                match and its groups are saved in BASH_REMATCH
+    STRING1 < STRING2, STRING1 > STRING2    sorts before/after
+    N1 -eq N2 (-ne -lt -le -gt -ge)     integer comparison
+    ( EXPR ), ! EXPR, EXPR && EXPR, EXPR || EXPR
+&& and || only evaluate their right side when needed. Each FILE is stat()ed 
+at most once per expression (the results are memoized in cond->stats), and 
+compiled regular expressions are kept in regex_cache across commands.
+******************************************************************************/
+int conditional_command(struct command_line *command_line, FILE *in, FILE *out,
+                        int *status, struct job_table *jobs)
+{
+    struct conditional cond = {0};
+    cond.args = command_line->args + 1;
+    cond.count = command_line->args_count - 2;
+    if ((cond.count < 0) 
+            || strcmp(command_line->args[command_line->args_count - 1], "]]")) {
+        fprintf(stderr, "[[: missing `]]'\n");
+        return 1;
+    }
+    bool result = (cond.count > 0) && cond_or(&cond, true);
+    if (!cond.error && (cond.pos < cond.count)) {
+        fprintf(stderr, "[[: syntax error near `%s'\n", cond.args[cond.pos]);
+        cond.error = true;
+    }
+    for (int i = 0; i < cond.stat_count; i++) {
+        free(cond.stats[i].path);
+    }
+    free(cond.stats);
+    return (result && !cond.error) ? 0 : 1;
+}
+
+/******************************************************************************
+EXPR || EXPR ... The right side is parsed but not evaluated once the result 
+is known, same for the functions below.
+******************************************************************************/
+bool cond_or(struct conditional *cond, bool evaluate) {
+    bool result = cond_and(cond, evaluate);
+    while (!cond->error && (cond->pos < cond->count) 
+               && !strcmp(cond->args[cond->pos], "||")) {
+        cond->pos++;
+        result = cond_and(cond, evaluate && !result) || result;
+    }
+    return result;
+}
+
+/******************************************************************************
+EXPR && EXPR ...
+******************************************************************************/
+bool cond_and(struct conditional *cond, bool evaluate) {
+    bool result = cond_not(cond, evaluate);
+    while (!cond->error && (cond->pos < cond->count) 
+               && !strcmp(cond->args[cond->pos], "&&")) {
+        cond->pos++;
+        result = cond_not(cond, evaluate && result) && result;
+    }
+    return result;
+}
+
+/******************************************************************************
+! EXPR, ( EXPR ), or a test (cond_test).
+******************************************************************************/
+bool cond_not(struct conditional *cond, bool evaluate) {
+    if (cond->pos >= cond->count) {
+        fprintf(stderr, "[[: unexpected end of expression\n");
+        cond->error = true;
+        return false;
+    }
+    char *word = cond->args[cond->pos];
+    if (!strcmp(word, "!")) {
+        cond->pos++;
+        return !cond_not(cond, evaluate);
+    }
+    if (!strcmp(word, "(")) {
+        cond->pos++;
+        bool result = cond_or(cond, evaluate);
+        if (!cond->error && ((cond->pos >= cond->count) 
+                                 || strcmp(cond->args[cond->pos], ")"))) {
+            fprintf(stderr, "[[: missing `)'\n");
+            cond->error = true;
+        }
+        cond->pos++;
+        return result;
+    }
+    return cond_test(cond, evaluate);
+}
+
+/******************************************************************************
+A unary test (-f FILE, -z STRING, ...), a binary test (A == B, ...) or a 
+single STRING.
+******************************************************************************/
+bool cond_test(struct conditional *cond, bool evaluate) {
+    char **args = cond->args + cond->pos;
+    int left = cond->count - cond->pos;
+    if ((left >= 2) && (args[0][0] == '-') && args[0][1] && !args[0][2]
+            && strchr("efdsrwxzn", args[0][1])
+            && !((left >= 3) && is_binary_operator(args[1]))) {
+        cond->pos += 2;
+        if (!evaluate) {
+            return false;
+        }
+        char op = args[0][1];
+        if ((op == 'z') || (op == 'n')) {
+            return (args[1][0] == '\0') == (op == 'z');
+        }
+        if ((op == 'r') || (op == 'w') || (op == 'x')) {
+            int mode = (op == 'r') ? R_OK : (op == 'w') ? W_OK : X_OK;
+            return access(args[1], mode) == 0;
+        }
+        struct stat *file_stat = cond_stat(cond, args[1]);
+        return file_stat && ((op == 'e') 
+                             || ((op == 'f') && S_ISREG(file_stat->st_mode))
+                             || ((op == 'd') && S_ISDIR(file_stat->st_mode))
+                             || ((op == 's') && (file_stat->st_size > 0)));
+    }
+    if ((left >= 3) && is_binary_operator(args[1])) {
+        cond->pos += 3;
+        if (!evaluate) {
+            return false;
+        }
+        return cond_binary(cond, args[0], args[1], args[2]);
+    }
+    cond->pos++;
+    return args[0][0] != '\0';
+}
+
+/******************************************************************************
+Returns true if word is one of the binary operators of [[ ]].
+******************************************************************************/
+bool is_binary_operator(char *word) {
+    char *operators[] = {"==", "=", "!=", "=~", "<", ">", "-nt", "-ot", 
+                         "-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+        if (!strcmp(word, operators[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/******************************************************************************
+Evaluate LEFT OP RIGHT for a binary operator of [[ ]].
+******************************************************************************/
+bool cond_binary(struct conditional *cond, char *left, char *op, char *right) {
+    if (!strcmp(op, "==") || !strcmp(op, "=") || !strcmp(op, "!=")) {
+        struct glob *glob = glob_compile(right);
+        return glob_match(glob, left, strlen(left)) == (op[0] != '!');
+    }
+    if (!strcmp(op, "=~")) {
+        return cond_regex_match(cond, left, right);
+    }
+    if ((op[0] == '<') || (op[0] == '>')) {
+        int order = strcmp(left, right);
+        return (op[0] == '<') ? (order < 0) : (order > 0);
+    }
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot")) {
+        if (op[1] == 'o') {
+            // A -ot B is B -nt A
+            char *swap = left;
+            left = right;
+            right = swap;
+        }
+        struct stat *newer = cond_stat(cond, left);
+        struct stat *older = cond_stat(cond, right);
+        if (!newer || !older) {
+            // an existing file is newer than one that does not exist
+            return newer && !older;
+        }
+        return (newer->st_mtim.tv_sec > older->st_mtim.tv_sec)
+                   || ((newer->st_mtim.tv_sec == older->st_mtim.tv_sec)
+                       && (newer->st_mtim.tv_nsec > older->st_mtim.tv_nsec));
+    }
+    // integer comparison
+    char *left_end, *right_end;
+    long a = strtol(left, &left_end, 10);
+    long b = strtol(right, &right_end, 10);
+    if (*left_end || *right_end) {
+        fprintf(stderr, "[[: %s: integer expected\n", *left_end ? left : right);
+        cond->error = true;
+        return false;
+    }
+    switch (op[1] + op[2]) {
+        case 'e' + 'q': return a == b;
+        case 'n' + 'e': return a != b;
+        case 'l' + 't': return a < b;
+        case 'l' + 'e': return a <= b;
+        case 'g' + 't': return a > b;
+        default: return a >= b;
+    }
+}
+
+/******************************************************************************
+stat() path, or reuse the result if this expression already did.
+Returns: the file's stat, or NULL if it does not exist (or stat failed)
+******************************************************************************/
+struct stat *cond_stat(struct conditional *cond, char *path) {
+    struct stat_memo *memo;
+    for (int i = 0; i < cond->stat_count; i++) {
+        memo = &cond->stats[i];
+        if (!strcmp(memo->path, path)) {
+            return memo->exists ? &memo->file_stat : NULL;
+        }
+    }
+    if (cond->stat_count == cond->stat_capacity) {
+        cond->stat_capacity = cond->stat_capacity ? cond->stat_capacity * 2 : 4;
+        cond->stats = realloc(cond->stats, cond->stat_capacity * sizeof(struct stat_memo));
+    }
+    memo = &cond->stats[cond->stat_count++];
+    memo->path = strdup(path);
+    memo->exists = (stat(path, &memo->file_stat) == 0);
+    return memo->exists ? &memo->file_stat : NULL;
+}
+
+/******************************************************************************
+STRING =~ REGEX: match an extended regular expression anywhere in str. On a
+match BASH_REMATCH is set to the matched text followed by the text of each
+group (empty for a group that did not take part).
+******************************************************************************/
+bool cond_regex_match(struct conditional *cond, char *str, char *pattern) {
+    regex_t *regex = regex_compile(pattern);
+    if (!regex) {
+        cond->error = true;
+        return false;
+    }
+    size_t group_count = regex->re_nsub + 1;
+    regmatch_t *matches = malloc(group_count * sizeof(regmatch_t));
+    bool matched = (regexec(regex, str, group_count, matches, 0) == 0);
+    if (matched) {
+        char **elements = malloc(group_count * sizeof(char *));
+        for (size_t i = 0; i < group_count; i++) {
+            if (matches[i].rm_so == -1) {
+                elements[i] = strdup("");
+            } else {
+                elements[i] = strndup(str + matches[i].rm_so, 
+                                      matches[i].rm_eo - matches[i].rm_so);
+            }
+        }
+        set_var_array("BASH_REMATCH", elements, group_count);
+    }
+    free(matches);
+    return matched;
+}
+
+/******************************************************************************
+Compile an extended regular expression, or return the copy compiled for the
+same pattern before. Like glob_cache, regex_cache is direct-mapped by the 
+hash of the pattern and an entry is replaced when another pattern needs its
+slot.
+Returns: the compiled expression, owned by the cache, or NULL if the pattern
+is not valid (after printing why)
+******************************************************************************/
+regex_t *regex_compile(char *pattern) {
+    size_t slot = hash_string(pattern) % REGEX_CACHE_SIZE;
+    struct regex_cache_entry *entry = &regex_cache[slot];
+    if (entry->pattern && !strcmp(entry->pattern, pattern)) {
+        return &entry->regex;
+    }
+    if (entry->pattern) {
+        regfree(&entry->regex);
+        free(entry->pattern);
+        entry->pattern = NULL;
+    }
+    int error = regcomp(&entry->regex, pattern, REG_EXTENDED);
+    if (error) {
+        char message[256];
+        regerror(error, &entry->regex, message, sizeof(message));
+        fprintf(stderr, "[[: %s: %s\n", pattern, message);
+        return NULL;
+    }
+    entry->pattern = strdup(pattern);
+    return &entry->regex;
+}
+
+/******************************************************************************
+"z [-l] [FRAGMENT...]" built in command - jump to the most frecent directory
+whose path contains every FRAGMENT, in order (case is ignored if nothing 
+matches exactly). Every directory the shell changes into is recorded in the
+z database (see z_record_visit). With -l, or with no FRAGMENT, the matching
+directories are listed with their scores instead, best last.
+******************************************************************************/
+int z_command(struct command_line *command_line, FILE *in, FILE *out,
+              int *status, struct job_table *jobs)
+{
+    int first = 1;
+    bool list = (command_line->args_count > 1) 
+                    && !strcmp(command_line->args[1], "-l");
+    if (list) {
+        first++;
+    }
+    char **fragments = command_line->args + first;
+    int fragment_count = command_line->args_count - first;
+    list = list || (fragment_count == 0);
+    struct z_db *db = z_db_open();
+    if (!db) {
+        fprintf(stderr, "z: cannot open %s\n", z_db_path());
+        return 1;
+    }
+    // copy out the matches under a shared lock, other shells may be
+    // updating the database
+    mapped_db_lock(&z_db_file, LOCK_SH);
+    time_t now = time(NULL);
+    struct z_match *matches = malloc(Z_MAX_ENTRIES * sizeof(struct z_match));
+    int match_count = 0;
+    uint32_t count = (db->count < Z_MAX_ENTRIES) ? db->count : Z_MAX_ENTRIES;
+    for (int pass = 0; (pass < 2) && (match_count == 0); pass++) {
+        for (uint32_t i = 0; i < count; i++) {
+            struct z_entry *entry = &db->entries[i];
+            // the file may have been damaged, don't trust its strings: match
+            // a terminated copy (the shared mapping is only read here)
+            char *path = matches[match_count].path;
+            memcpy(path, entry->path, Z_PATH_MAX - 1);
+            path[Z_PATH_MAX - 1] = '\0';
+            if (z_path_matches(path, fragments, fragment_count, pass == 1)) {
+                matches[match_count].score = z_frecency(entry, now);
+                match_count++;
+            }
+        }
+    }
+    mapped_db_lock(&z_db_file, LOCK_UN);
+    qsort(matches, match_count, sizeof(struct z_match), compare_z_matches);
+    int result = 0;
+    if (list) {
+        for (int i = 0; i < match_count; i++) {
+            fprintf(out, "%-10.1f %s\n", matches[i].score, matches[i].path);
+        }
+        fflush(out);
+    } else {
+        // best match that still exists
+        struct stat dir_stat;
+        int i = match_count - 1;
+        while ((i >= 0) && ((stat(matches[i].path, &dir_stat) == -1) 
+                            || !S_ISDIR(dir_stat.st_mode))) {
+            i--;
+        }
+        if (i >= 0) {
+            change_dir(matches[i].path);
+        } else {
+            fprintf(stderr, "z: no match\n");
+            result = 1;
+        }
+    }
+    free(matches);
+    return result;
+}
+
+/******************************************************************************
+Returns true if path contains each of the fragments, in order.
+******************************************************************************/
+bool z_path_matches(char *path, char **fragments, int fragment_count, 
+                    bool ignore_case) 
+{
+    char *position = path;
+    for (int i = 0; i < fragment_count; i++) {
+        position = ignore_case ? strcasestr(position, fragments[i]) 
+                               : strstr(position, fragments[i]);
+        if (!position) {
+            return false;
+        }
+        position += strlen(fragments[i]);
+    }
+    return true;
+}
+
+/******************************************************************************
+Frecency of a directory: its visit rank, weighted by how recently it was 
+last visited (x4 within the hour, x2 within the day, /2 within the week, /4
+after that).
+******************************************************************************/
+double z_frecency(struct z_entry *entry, time_t now) {
+    time_t age = now - entry->last_visit;
+    if (age < 3600) {
+        return entry->rank * 4;
+    } else if (age < 86400) {
+        return entry->rank * 2;
+    } else if (age < 604800) {
+        return entry->rank / 2;
+    }
+    return entry->rank / 4;
+}
+
+/******************************************************************************
+qsort comparison for z matches, lowest score first.
+******************************************************************************/
+int compare_z_matches(const void *a, const void *b) {
+    double score_a = ((struct z_match *)a)->score;
+    double score_b = ((struct z_match *)b)->score;
+    return (score_a > score_b) - (score_a < score_b);
+}
+
+/******************************************************************************
+Record a visit to the directory path in the z database: add one to its rank
+and update its visit time. When the ranks add up to more than Z_MAX_TOTAL
+all of them age (are multiplied by 0.9) and entries that drop below 1 are 
+removed; when the table is full the entry with the lowest frecency is 
+replaced. Updates are done under an exclusive lock on the database file, so
+any number of shells can share it. Paths too long for an entry are skipped.
+******************************************************************************/
+void z_record_visit(char *path) {
+    if (strlen(path) >= Z_PATH_MAX) {
+        return;
+    }
+    struct z_db *db = z_db_open();
+    if (!db) {
+        return;
+    }
+    mapped_db_lock(&z_db_file, LOCK_EX);
+    time_t now = time(NULL);
+    if (db->count > Z_MAX_ENTRIES) {
+        db->count = Z_MAX_ENTRIES;
+    }
+    struct z_entry *entry = NULL;
+    for (uint32_t i = 0; (i < db->count) && !entry; i++) {
+        if (!strncmp(db->entries[i].path, path, Z_PATH_MAX)) {
+            entry = &db->entries[i];
+        }
+    }
+    if (!entry && (db->count < Z_MAX_ENTRIES)) {
+        entry = &db->entries[db->count++];
+        memset(entry, 0, sizeof(struct z_entry));
+        strcpy(entry->path, path);
+    } else if (!entry) {
+        // full, replace the least useful entry
+        entry = &db->entries[0];
+        for (uint32_t i = 1; i < db->count; i++) {
+            if (z_frecency(&db->entries[i], now) < z_frecency(entry, now)) {
+                entry = &db->entries[i];
+            }
+        }
+        db->total_rank -= entry->rank;
+        memset(entry, 0, sizeof(struct z_entry));
+        strcpy(entry->path, path);
+    }
+    entry->rank += 1;
+    entry->last_visit = now;
+    db->total_rank += 1;
+    if (db->total_rank > Z_MAX_TOTAL) {
+        // age every entry, dropping the ones that are no longer used
+        uint32_t kept = 0;
+        db->total_rank = 0;
+        for (uint32_t i = 0; i < db->count; i++) {
+            db->entries[i].rank *= 0.9;
+            if (db->entries[i].rank >= 1) {
+                db->total_rank += db->entries[i].rank;
+                db->entries[kept++] = db->entries[i];
+            }
+        }
+        db->count = kept;
+    }
+    mapped_db_lock(&z_db_file, LOCK_UN);
+}
+
+/******************************************************************************
+Returns the path of the z database: $SMALLSH_Z_DB, or ~/.smallsh_z.
+******************************************************************************/
+char *z_db_path() {
+    static char path[4096];
+    char *env_path = getenv("SMALLSH_Z_DB");
+    if (env_path) {
+        return env_path;
+    }
+    char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.smallsh_z", home ? home : ".");
+    return path;
+}
+
+/******************************************************************************
+Map the z database the first time it is needed (it stays mapped until the 
+shell exits). A new or unrecognized file is initialized empty.
+Returns: the database, or NULL if it cannot be opened
+******************************************************************************/
+struct z_db *z_db_open() {
+    if (z_db_file.data) {
+        return z_db_file.data;
+    }
+    if (z_db_file.failed || !mapped_db_open(&z_db_file, z_db_path(), 
+                                            sizeof(struct z_db), Z_DB_MAGIC)) {
+        return NULL;
+    }
+    return z_db_file.data;
+}
+
+/******************************************************************************
+Open (creating if needed) a database file of a fixed size and map it shared,
+so every process using the file sees the same data. The file starts with a
+32 bit magic number; if it is not there (a new file, or one of another 
+format or size) the file is zeroed and the magic number written, under an 
+exclusive lock. Callers lock around their own reads and updates with 
+mapped_db_lock. A failure is remembered in db->failed so it is not retried
+on every use.
+Returns: false if the file cannot be opened or mapped
+******************************************************************************/
+bool mapped_db_open(struct mapped_db *db, char *path, size_t size, uint32_t magic) {
+    db->failed = true;
+    db->fd = move_shell_fd(open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600));
+    if (db->fd == -1) {
+        return false;
+    }
+    mapped_db_lock(db, LOCK_EX);
+    struct stat file_stat;
+    uint32_t file_magic = 0;
+    bool valid = (fstat(db->fd, &file_stat) == 0) 
+                 && ((size_t)file_stat.st_size == size)
+                 && (pread(db->fd, &file_magic, 4, 0) == 4) && (file_magic == magic);
+    if (!valid && ((ftruncate(db->fd, 0) == -1) || (ftruncate(db->fd, size) == -1))) {
+        mapped_db_lock(db, LOCK_UN);
+        close(db->fd);
+        return false;
+    }
+    db->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, db->fd, 0);
+    if (db->data == MAP_FAILED) {
+        db->data = NULL;
+        mapped_db_lock(db, LOCK_UN);
+        close(db->fd);
+        return false;
+    }
+    if (!valid) {
+        *(uint32_t *)db->data = magic;
+    }
+    mapped_db_lock(db, LOCK_UN);
+    db->size = size;
+    db->failed = false;
+    return true;
+}
+
+/******************************************************************************
+flock() a mapped database: LOCK_SH to read, LOCK_EX to update, LOCK_UN when
+done. Waits for the lock, retrying if a signal interrupts the wait.
+******************************************************************************/
+void mapped_db_lock(struct mapped_db *db, int operation) {
+    while ((flock(db->fd, operation) == -1) && (errno == EINTR));
+}
+
+/******************************************************************************
+Unmap and close a mapped database.
+******************************************************************************/
+void mapped_db_close(struct mapped_db *db) {
+    if (db->data) {
+        munmap(db->data, db->size);
+        close(db->fd);
+    }
+    memset(db, 0, sizeof(struct mapped_db));
+}
+
+/******************************************************************************
+"stats [top] [--slowest|--regressed]" built in command - show the kinds of 
+command lines in the stats database (see stats_record), one line each with 
+the number of runs, the mean and percentile durations and the runs that 
+failed. By default the ones the most time went to come first; --slowest 
+orders them by p95, and --regressed shows the ones whose latest runs (a 
+moving average) take at least 25% longer than their mean, the most slowed 
+down first.
+******************************************************************************/
+int stats_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs)
+{
+    int arg = 1;
+    if ((arg < command_line->args_count) && !strcmp(command_line->args[arg], "top")) {
+        arg++;
+    }
+    char *order = (arg < command_line->args_count) ? command_line->args[arg++] : "";
+    if ((arg < command_line->args_count) 
+            || (order[0] && strcmp(order, "--slowest") && strcmp(order, "--regressed"))) {
+        fprintf(stderr, "usage: stats [top] [--slowest|--regressed]\n");
+        return 1;
+    }
+    struct stats_db *db = stats_db_open();
+    if (!db) {
+        fprintf(stderr, "stats: cannot open %s\n", stats_db_path());
+        return 1;
+    }
+    // copy out the entries with their sort keys under a shared lock, other 
+    // shells may be updating the database
+    mapped_db_lock(&stats_db_file, LOCK_SH);
+    uint32_t count = (db->count < STATS_MAX_ENTRIES) ? db->count : STATS_MAX_ENTRIES;
+    struct stats_entry *entries = malloc((count + 1) * sizeof(struct stats_entry));
+    double *keys = malloc((count + 1) * sizeof(double));
+    uint32_t row_count = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        struct stats_entry *entry = &db->entries[i];
+        if (entry->count == 0) {
+            continue;
+        }
+        double key = entry->count * entry->mean_ms;
+        if (!strcmp(order, "--slowest")) {
+            key = stats_percentile(entry, 0.95);
+        } else if (!strcmp(order, "--regressed")) {
+            key = entry->recent_ms / (entry->mean_ms ? entry->mean_ms : 1);
+            if ((entry->count < STATS_MIN_RUNS) || (key < 1.25)) {
+                continue;
+            }
+        }
+        entries[row_count] = *entry;
+        keys[row_count] = key;
+        row_count++;
+    }
+    mapped_db_lock(&stats_db_file, LOCK_UN);
+    // sort indexes by key, largest first
+    int *rows = malloc((row_count + 1) * sizeof(int));
+    for (uint32_t i = 0; i < row_count; i++) {
+        rows[i] = i;
+    }
+    stats_sort_keys = keys;
+    qsort(rows, row_count, sizeof(int), compare_stats_rows);
+    bool regressed = !strcmp(order, "--regressed");
+    fprintf(out, "%-40s %6s %9s %9s %9s %9s %6s%s\n", "COMMAND", "RUNS", "MEAN ms", 
+            "P50 ms", "P95 ms", "P99 ms", "FAILED", regressed ? "  RECENT ms" : "");
+    for (uint32_t i = 0; (i < row_count) && (i < STATS_TOP_ROWS); i++) {
+        struct stats_entry *entry = &entries[rows[i]];
+        entry->example[STATS_EXAMPLE_MAX - 1] = '\0';
+        fprintf(out, "%-40.40s %6u %9.1f %9.1f %9.1f %9.1f %6u", entry->example, 
+                entry->count, entry->mean_ms, stats_percentile(entry, 0.5), 
+                stats_percentile(entry, 0.95), stats_percentile(entry, 0.99), 
+                entry->exits[1] + entry->exits[2]);
+        if (regressed) {
+            fprintf(out, "  %9.1f", entry->recent_ms);
+        }
+        fprintf(out, "\n");
+    }
+    fflush(out);
+    free(rows);
+    free(keys);
+    free(entries);
+    return 0;
+}
+
+/******************************************************************************
+qsort comparison for the rows of stats, by stats_sort_keys, largest first.
+******************************************************************************/
+int compare_stats_rows(const void *a, const void *b) {
+    double key_a = stats_sort_keys[*(int *)a];
+    double key_b = stats_sort_keys[*(int *)b];
+    return (key_a < key_b) - (key_a > key_b);
+}
+
+/******************************************************************************
+Add a finished command line to the stats database: count its run, duration
+and exit status under its kind (see stats_key), replacing the kind run the 
+longest ago when the table is full. Lines that only set variables and 
+background commands (whose time is only their launch) are not counted.
+With set -o slowwarn, a warning is printed when a kind that has run at least
+STATS_MIN_RUNS times takes longer than its p99.
+******************************************************************************/
+void stats_record(struct command_line *command_line, long long duration_us, 
+                  int status) 
+{
+    if (command_line->assignment_count || !command_line->command[0] 
+            || command_line->run_in_background) {
+        return;
+    }
+    struct stats_db *db = stats_db_open();
+    if (!db) {
+        return;
+    }
+    char name[STATS_NAME_MAX];
+    char example[STATS_EXAMPLE_MAX];
+    uint32_t shape;
+    stats_key(command_line, name, &shape, example);
+    double duration_ms = duration_us / 1000.0;
+    mapped_db_lock(&stats_db_file, LOCK_EX);
+    struct stats_entry *entry = stats_find(db, name, shape);
+    double usual_p99 = 0;
+    if (entry->count >= STATS_MIN_RUNS) {
+        usual_p99 = stats_percentile(entry, 0.99);
+    }
+    strcpy(entry->example, example);
+    entry->count++;
+    entry->mean_ms += (duration_ms - entry->mean_ms) / entry->count;
+    entry->recent_ms = (entry->count == 1) ? duration_ms 
+                       : entry->recent_ms * 0.8 + duration_ms * 0.2;
+    entry->last_run = time(NULL);
+    entry->exits[(status == 0) ? 0 : (status == 1) ? 1 : 2]++;
+    entry->buckets[stats_bucket(duration_us)]++;
+    mapped_db_lock(&stats_db_file, LOCK_UN);
+    if (shell_options[OPT_SLOWWARN] && usual_p99 && (duration_ms > usual_p99)) {
+        fprintf(stderr, "stats: %s took %.1fms, its p99 is %.1fms\n", example, 
+                duration_ms, usual_p99);
+        fflush(stderr);
+    }
+}
+
+/******************************************************************************
+Find the kind of a command line: name is the command names of its stages 
+(without their directories) joined by "|", and shape a hash of what its 
+arguments look like, so "sleep 1" and "sleep 20" are one kind but "ls" and 
+"ls -l" are two. An option is kept as it is (up to an '='), a number counts 
+as N, a word with a '/' as P and any other word as W; redirections and '&' 
+are part of the shape too. example is the command line as text, cut to fit.
+******************************************************************************/
+void stats_key(struct command_line *command_line, char *name, uint32_t *shape,
+               char *example) 
+{
+    char *name_text = NULL;
+    char *shape_text = NULL;
+    char *example_text = NULL;
+    size_t name_len = 0;
+    size_t shape_len = 0;
+    size_t example_len = 0;
+    FILE *names = open_memstream(&name_text, &name_len);
+    FILE *shapes = open_memstream(&shape_text, &shape_len);
+    FILE *examples = open_memstream(&example_text, &example_len);
+    for (struct command_line *stage = command_line; stage; stage = stage->next) {
+        char *base = strrchr(stage->command, '/');
+        fprintf(names, "%s%s", (stage == command_line) ? "" : "|", 
+                base ? base + 1 : stage->command);
+        char *text = join_command_args(stage, 0);
+        fprintf(examples, "%s%s", (stage == command_line) ? "" : " | ", text);
+        free(text);
+        fputc('|', shapes);
+        for (int i = 1; (i < stage->args_count) && stage->args[i]; i++) {
+            char *arg = stage->args[i];
+            if (arg[0] == '-') {
+                fprintf(shapes, " %.*s", (int)strcspn(arg, "="), arg);
+            } else if (arg[strspn(arg, "0123456789.")] == '\0') {
+                fputs(" N", shapes);
+            } else {
+                fputs(strchr(arg, '/') ? " P" : " W", shapes);
+            }
+        }
+        fprintf(shapes, "%s%s", stage->input_file ? " <" : "", 
+                stage->output_file ? " >" : "");
+    }
+    fclose(names);
+    fclose(shapes);
+    fclose(examples);
+    snprintf(name, STATS_NAME_MAX, "%s", name_text);
+    snprintf(example, STATS_EXAMPLE_MAX, "%s", example_text);
+    *shape = hash_string(shape_text);
+    free(name_text);
+    free(shape_text);
+    free(example_text);
+}
+
+/******************************************************************************
+Return the entry of a kind of command line in the stats database, adding it 
+(or replacing the entry run the longest ago if the table is full) if it is 
+not there. Called with the database locked.
+******************************************************************************/
+struct stats_entry *stats_find(struct stats_db *db, char *name, uint32_t shape) {
+    if (db->count > STATS_MAX_ENTRIES) {
+        db->count = STATS_MAX_ENTRIES;
+    }
+    struct stats_entry *oldest = NULL;
+    for (uint32_t i = 0; i < db->count; i++) {
+        struct stats_entry *entry = &db->entries[i];
+        if ((entry->shape == shape) && !strncmp(entry->name, name, STATS_NAME_MAX)) {
+            return entry;
+        }
+        if (!oldest || (entry->last_run < oldest->last_run)) {
+            oldest = entry;
+        }
+    }
+    struct stats_entry *entry = (db->count < STATS_MAX_ENTRIES) 
+                                ? &db->entries[db->count++] : oldest;
+    memset(entry, 0, sizeof(struct stats_entry));
+    strcpy(entry->name, name);
+    entry->shape = shape;
+    return entry;
+}
+
+/******************************************************************************
+Bucket of a duration: 4 buckets between each power of two microseconds, 
+picked by the two bits after the highest set bit.
+******************************************************************************/
+int stats_bucket(long long duration_us) {
+    unsigned long long value = (duration_us > 0) ? duration_us : 1;
+    int exponent = 63 - __builtin_clzll(value);
+    int quarter = (exponent >= 2) ? (value >> (exponent - 2)) & 3 
+                                  : (value << (2 - exponent)) & 3;
+    int bucket = exponent * 4 + quarter;
+    return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+/******************************************************************************
+Estimate a percentile (fraction 0.5 for p50) of an entry's durations in 
+milliseconds: the middle of the bucket the run at that rank falls in.
+******************************************************************************/
+double stats_percentile(struct stats_entry *entry, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * entry->count + 0.999999);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; i++) {
+        seen += entry->buckets[i];
+        if (seen && (seen >= rank)) {
+            double low = (double)(1ULL << (i / 4)) * (1 + (i % 4) / 4.0);
+            double high = (double)(1ULL << (i / 4)) * (1 + (i % 4 + 1) / 4.0);
+            return (low + high) / 2 / 1000;
+        }
+    }
+    return 0;
+}
+
+/******************************************************************************
+Returns the path of the stats database: $SMALLSH_STATS_DB, or ~/.smallsh_stats.
+******************************************************************************/
+char *stats_db_path() {
+    static char path[4096];
+    char *env_path = getenv("SMALLSH_STATS_DB");
+    if (env_path) {
+        return env_path;
+    }
+    char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.smallsh_stats", home ? home : ".");
+    return path;
+}
+
+/******************************************************************************
+Map the stats database the first time it is needed, as z_db_open does.
+Returns: the database, or NULL if it cannot be opened
+******************************************************************************/
+struct stats_db *stats_db_open() {
+    if (stats_db_file.data) {
+        return stats_db_file.data;
+    }
+    if (stats_db_file.failed || !mapped_db_open(&stats_db_file, stats_db_path(), 
+                                                sizeof(struct stats_db), 
+                                                STATS_DB_MAGIC)) {
+        return NULL;
+    }
+    return stats_db_file.data;
+}
+
+/******************************************************************************
+"listen [ADDR...] -- command [args]" built in command - run command with 
+listening sockets passed to it the way systemd socket activation does: as 
+fds 3, 4, ... with LISTEN_FDS, LISTEN_PID and LISTEN_FDNAMES set. ADDR is 
+    PORT            TCP on 127.0.0.1
+    HOST:PORT       TCP on HOST ([::1]:PORT for IPv6)
+    unix:PATH       unix socket (also any ADDR containing a /)
+The shell creates each socket the first time its ADDR is used and keeps it
+open, so when the command is restarted with the same ADDR it gets the same 
+socket: connections made while no worker is running wait in the listen
+queue instead of being refused. Redirections and & apply to the command.
+"listen" with no ADDR lists the open sockets; "listen -c ADDR" closes one.
+******************************************************************************/
+int listen_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs)
+{
+    char **args = command_line->args;
+    int args_count = command_line->args_count;
+    if (args_count == 1) {
+        for (int i = 0; i < listen_socket_count; i++) {
+            fprintf(out, "%-4d %s\n", listen_sockets[i].fd, listen_sockets[i].address);
+        }
+        fflush(out);
+        return 0;
+    }
+    if (!strcmp(args[1], "-c") && (args_count == 3)) {
+        if (!close_listen_socket(args[2])) {
+            fprintf(stderr, "listen: %s is not open\n", args[2]);
+        }
+        return 0;
+    }
+    int separator = 1;
+    while ((separator < args_count) && strcmp(args[separator], "--")) {
+        separator++;
+    }
+    if ((separator == 1) || (separator >= args_count - 1)) {
+        fprintf(stderr, "usage: listen ADDR... -- command [args]\n");
+        return 0;
+    }
+    int fd_count = separator - 1;
+    int *fds = malloc(fd_count * sizeof(int));
+    char *names = NULL;
+    size_t names_len = 0;
+    FILE *names_stream = open_memstream(&names, &names_len);
+    for (int i = 0; i < fd_count; i++) {
+        fds[i] = get_listen_socket(args[i + 1]);
+        if (fds[i] == -1) {
+            fclose(names_stream);
+            free(names);
+            free(fds);
+            *status = 1;
+            return 0;
+        }
+        // names may not contain ':', which separates them
+        fputs(i ? ":" : "", names_stream);
+        for (char *c = args[i + 1]; *c; c++) {
+            fputc((*c == ':') ? '_' : *c, names_stream);
+        }
+    }
+    fclose(names_stream);
+    // run the command as if it had been typed on its own
+    char *command_str = join_command_args(command_line, separator + 1);
+    struct command_line *command = parse_command_line(command_str);
+    free(command_str);
+    command->run_in_background = command_line->run_in_background;
+    if (command_line->input_file) {
+        command->input_file = strdup(command_line->input_file);
+    }
+    if (command_line->output_file) {
+        command->output_file = strdup(command_line->output_file);
+    }
+    command->listen_fds = fds;
+    command->listen_fd_count = fd_count;
+    command->listen_names = names;
+    handle_command_line(command, status, jobs);
+    free_memory(command);
+    return 0;
+}
+
+/******************************************************************************
+Return the listening socket for address, creating, binding and listening on
+it the first time (see listen_command for the address forms). The socket is
+close-on-exec; exec_child passes it on explicitly.
+Returns: fd, or -1 after printing an error
+******************************************************************************/
+int get_listen_socket(char *address) {
+    for (int i = 0; i < listen_socket_count; i++) {
+        if (!strcmp(listen_sockets[i].address, address)) {
+            return listen_sockets[i].fd;
+        }
+    }
+    int fd = -1;
+    char *path = NULL;
+    if (!strncmp(address, "unix:", 5) || strchr(address, '/')) {
+        path = address + (strncmp(address, "unix:", 5) ? 0 : 5);
+        struct sockaddr_un unix_address = {.sun_family = AF_UNIX};
+        struct stat path_stat;
+        if (strlen(path) >= sizeof(unix_address.sun_path)) {
+            fprintf(stderr, "listen: %s: path too long\n", path);
+            return -1;
+        }
+        strcpy(unix_address.sun_path, path);
+        // a socket file left behind by an earlier run would make bind fail
+        if ((stat(path, &path_stat) == 0) && S_ISSOCK(path_stat.st_mode)) {
+            unlink(path);
+        }
+        fd = move_shell_fd(socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0));
+        if ((fd != -1) && ((bind(fd, (struct sockaddr *)&unix_address, 
+                                 sizeof(unix_address)) == -1)
+                           || (listen(fd, SOMAXCONN) == -1))) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        // PORT, HOST:PORT or [HOST]:PORT
+        char *colon = strrchr(address, ':');
+        char *host = colon ? strndup(address, colon - address) : strdup("127.0.0.1");
+        char *port = colon ? colon + 1 : address;
+        if ((host[0] == '[') && (host[strlen(host) - 1] == ']')) {
+            memmove(host, host + 1, strlen(host) - 2);
+            host[strlen(host) - 2] = '\0';
+        }
+        struct addrinfo hints = {.ai_family = AF_UNSPEC, 
+                                 .ai_socktype = SOCK_STREAM,
+                                 .ai_flags = AI_PASSIVE | AI_NUMERICSERV};
+        struct addrinfo *results;
+        int error = getaddrinfo(host[0] ? host : NULL, port, &hints, &results);
+        free(host);
+        if (error) {
+            fprintf(stderr, "listen: %s: %s\n", address, gai_strerror(error));
+            return -1;
+        }
+        for (struct addrinfo *result = results; result && (fd == -1); 
+                 result = result->ai_next) {
+            fd = move_shell_fd(socket(result->ai_family, 
+                                      result->ai_socktype | SOCK_CLOEXEC, 
+                                      result->ai_protocol));
+            int on = 1;
+            if ((fd != -1) 
+                    && ((setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, 
+                                    sizeof(on)) == -1)
+                        || (bind(fd, result->ai_addr, result->ai_addrlen) == -1)
+                        || (listen(fd, SOMAXCONN) == -1))) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(results);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "listen: %s: %s\n", address, strerror(errno));
+        return -1;
+    }
+    listen_sockets = realloc(listen_sockets, 
+                             (listen_socket_count + 1) * sizeof(struct listen_socket));
+    listen_sockets[listen_socket_count].address = strdup(address);
+    listen_sockets[listen_socket_count].path = path ? strdup(path) : NULL;
+    listen_sockets[listen_socket_count].fd = fd;
+    listen_socket_count++;
+    return fd;
+}
+
+/******************************************************************************
+Close the listening socket for address (every socket if address is NULL),
+removing the socket file of a unix socket.
+Returns: false if there is no socket for address
+******************************************************************************/
+bool close_listen_socket(char *address) {
+    for (int i = 0; i < listen_socket_count; i++) {
+        struct listen_socket *entry = &listen_sockets[i];
+        if (!address || !strcmp(entry->address, address)) {
+            close(entry->fd);
+            if (entry->path) {
+                unlink(entry->path);
+            }
+            free(entry->address);
+            free(entry->path);
+            listen_sockets[i--] = listen_sockets[--listen_socket_count];
+            if (address) {
+                return true;
+            }
+        }
+    }
+    if (!address) {
+        free(listen_sockets);
+        listen_sockets = NULL;
+    }
+    return !address;
+}
+
+/******************************************************************************
+In a child about to exec: move the command's listening sockets to fds 3, 4,
+... (clearing close-on-exec) and describe them in LISTEN_FDS, LISTEN_PID and
+LISTEN_FDNAMES. The sockets are first copied above the target range so none
+of them is overwritten before it has been moved.
+******************************************************************************/
+void pass_listen_fds(struct command_line *command_line) {
+    int count = command_line->listen_fd_count;
+    int *high_fds = malloc(count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        high_fds[i] = fcntl(command_line->listen_fds[i], F_DUPFD_CLOEXEC, 3 + count);
+    }
+    for (int i = 0; i < count; i++) {
+        if ((high_fds[i] == -1) || (dup2(high_fds[i], 3 + i) == -1)) {
+            printf("error passing listening sockets\n");
+            fflush(stdout);
+            exit(1);
+        }
+    }
+    free(high_fds);
+    char number[32];
+    sprintf(number, "%d", count);
+    setenv("LISTEN_FDS", number, 1);
+    sprintf(number, "%d", getpid());
+    setenv("LISTEN_PID", number, 1);
+    setenv("LISTEN_FDNAMES", command_line->listen_names, 1);
+}
+
+/******************************************************************************
+"supervise [--max-restarts N] [--backoff N[smhd][:MAX]] command" built in 
+command. Runs command as a background job (even without '&') and restarts it 
+whenever it fails: exits with a non-zero value or is killed by a signal other
+than SIGTERM, SIGINT or SIGHUP (those are taken as a request to stop).
+Restarts wait for the backoff, which starts at --backoff (default 1s) and 
+doubles after every restart up to MAX (default 60s), so a job that keeps 
+crashing is restarted less and less often. A run that lasts at least MAX 
+resets the backoff. After --max-restarts restarts (default 5) the job is left
+stopped. "jobs" shows the restart count and uptime of supervised jobs.
+******************************************************************************/
+int supervise_command(struct command_line *command_line, FILE *in, FILE *out,
+                      int *status, struct job_table *jobs)
+{
+    long max_restarts = SUPERVISE_MAX_RESTARTS;
+    long backoff = SUPERVISE_BACKOFF;
+    long backoff_max = SUPERVISE_BACKOFF_MAX;
+    bool have_max = false;
+    bool ok = true;
+    int arg = 1;
+    while (ok && (arg < command_line->args_count) 
+               && !strncmp(command_line->args[arg], "--", 2)) {
+        char *option = command_line->args[arg++];
+        if (option[2] == '\0') {
+            // "--" ends the options
+            break;
+        }
+        char *value = (arg < command_line->args_count) 
+                          ? command_line->args[arg++] : NULL;
+        if (value && !strcmp(option, "--max-restarts")) {
+            char *end;
+            max_restarts = strtol(value, &end, 10);
+            ok = (end != value) && (*end == '\0') && (max_restarts >= 0)
+                     && (max_restarts <= INT_MAX);
+        } else if (value && !strcmp(option, "--backoff")) {
+            char *max = strchr(value, ':');
+            if (max) {
+                *max++ = '\0';
+            }
+            ok = parse_duration(value, &backoff) 
+                     && (!max || parse_duration(max, &backoff_max));
+            have_max = (max != NULL);
+        } else {
+            ok = false;
+        }
+    }
+    if (!have_max && (backoff > backoff_max)) {
+        backoff_max = backoff;
+    }
+    if (!ok || (arg >= command_line->args_count) || (backoff > backoff_max)) {
+        fprintf(stderr, "usage: supervise [--max-restarts N] "
+                     "[--backoff N[smhd][:MAX]] command\n");
+        return 1;
+    }
+    char *command_line_str = join_command_args(command_line, arg);
+    struct command_line *supervised = parse_command_line(command_line_str);
+    int previous_count = jobs->count;
+    supervised->run_in_background = true;
+    handle_command_line(supervised, status, jobs);
+    if (jobs->count > previous_count) {
+        struct supervisor *policy = calloc(1, sizeof(struct supervisor));
+        policy->max_restarts = max_restarts;
+        policy->backoff = backoff;
+        policy->backoff_initial = backoff;
+        policy->backoff_max = backoff_max;
+        policy->started = time(NULL);
+        policy->pidfd = supervise_watch(jobs->procs[jobs->count - 1].pid);
+        jobs->procs[jobs->count - 1].supervisor = policy;
+    } else {
+        fprintf(stderr, "supervise: %s: not started as a background job\n", 
+                command_line->args[arg]);
+    }
+    free_memory(supervised);
+    free(command_line_str);
+    return 0;
+}
+
+/******************************************************************************
+Called by check_background_procs when the supervised job at index in the job
+table has exited. If it failed and has restarts left, its restart is added to
+the scheduler heap (so the scheduler timer wakes the shell up for it) and the
+backoff is doubled.
+Returns true if the job will be restarted, so its entry must be kept.
+******************************************************************************/
+bool supervise_job_done(struct job_table *jobs, int index, int child_status) {
+    struct background_proc *proc = &jobs->procs[index];
+    struct supervisor *policy = proc->supervisor;
+    supervise_unwatch(policy);
+    if (WIFEXITED(child_status) && (WEXITSTATUS(child_status) == 0)) {
+        return false;
+    }
+    if (WIFSIGNALED(child_status) && ((WTERMSIG(child_status) == SIGTERM)
+                                      || (WTERMSIG(child_status) == SIGINT)
+                                      || (WTERMSIG(child_status) == SIGHUP)
+                                      || policy->killed)) {
+        return false;
+    }
+    if (policy->restart_count >= policy->max_restarts) {
+        printf("supervise: job [%d] failed after %d restarts, giving up\n",
+               proc->job_id, policy->restart_count);
+        fflush(stdout);
+        return false;
+    }
+    time_t now = time(NULL);
+    if (now - policy->started >= policy->backoff_max) {
+        // it ran long enough that this is not a crash loop
+        policy->backoff = policy->backoff_initial;
+    }
+    struct scheduled_command *entry = calloc(1, sizeof(struct scheduled_command));
+    entry->deadline = now + policy->backoff;
+    entry->restart_job_id = proc->job_id;
+    sched_heap_push(entry);
+    sched_rearm_timer();
+    policy->restart_at = entry->deadline;
+    printf("supervise: restarting job [%d] in %lds\n", proc->job_id, 
+           policy->backoff);
+    fflush(stdout);
+    policy->backoff = (policy->backoff * 2 < policy->backoff_max) 
+                          ? policy->backoff * 2 : policy->backoff_max;
+    return true;
+}
+
+/******************************************************************************
+Restart the supervised job with number job_id, which is waiting in the job 
+table with a pid of 0. The new process is moved into the job's entry so the
+job keeps its number. If it can't be started the job is removed.
+******************************************************************************/
+void restart_supervised_job(int job_id, int *status, struct job_table *jobs) {
+    int i;
+    for (i = 0; (i < jobs->count) && (jobs->procs[i].job_id != job_id); i++) {
+    }
+    if ((i == jobs->count) || (jobs->procs[i].pid != 0)) {
+        return;
+    }
+    char *command_line_str = strdup(jobs->procs[i].command_str);
+    struct command_line *command_line = parse_command_line(command_line_str);
+    int previous_count = jobs->count;
+    command_line->run_in_background = true;
+    handle_command_line(command_line, status, jobs);
+    if (jobs->count > previous_count) {
+        struct background_proc *restarted = &jobs->procs[jobs->count - 1];
+        jobs->procs[i].pid = restarted->pid;
+        jobs->procs[i].pgid = restarted->pgid;
+        jobs->procs[i].supervisor->restart_count++;
+        jobs->procs[i].supervisor->started = time(NULL);
+        jobs->procs[i].supervisor->pidfd = supervise_watch(restarted->pid);
+        for (int j = 0; j < output_stream_count; j++) {
+            if (output_streams[j]->pid == restarted->pid) {
+                output_streams[j]->job_id = job_id;
+            }
+        }
+        // give back the job number the new process was given
+        jobs->next_job_id--;
+        remove_background_proc(jobs, jobs->count - 1);
+    } else {
+        remove_background_proc(jobs, i);
+    }
+    free_memory(command_line);
+    free(command_line_str);
+}
+
+/******************************************************************************
+Watch a supervised job's process with a pidfd, so wait_for_input wakes up 
+when it exits and a crash is restarted without waiting for the next command
+line. The epoll set is created the first time it is needed.
+https://man7.org/linux/man-pages/man2/pidfd_open.2.html
+Returns: the pidfd, or -1 if it can't be watched (it is then noticed between
+         command lines)
+******************************************************************************/
+int supervise_watch(pid_t pid) {
+    if (supervise_epoll_fd == -1) {
+        supervise_epoll_fd = move_shell_fd(epoll_create1(EPOLL_CLOEXEC));
+        if (supervise_epoll_fd == -1) {
+            return -1;
+        }
+    }
+    int pidfd = move_shell_fd(syscall(SYS_pidfd_open, pid, 0));
+    if (pidfd == -1) {
+        return -1;
+    }
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = pidfd};
+    if (epoll_ctl(supervise_epoll_fd, EPOLL_CTL_ADD, pidfd, &event) == -1) {
+        close(pidfd);
+        return -1;
+    }
+    supervise_watch_count++;
+    return pidfd;
+}
+
+/******************************************************************************
+Stop watching a supervised job's process (closing the pidfd removes it from
+the epoll set).
+******************************************************************************/
+void supervise_unwatch(struct supervisor *policy) {
+    if (policy->pidfd != -1) {
+        close(policy->pidfd);
+        policy->pidfd = -1;
+        supervise_watch_count--;
+    }
+}
+
+/******************************************************************************
+Free a job's restart policy (NULL if the job is not supervised).
+******************************************************************************/
+void free_supervisor(struct supervisor *policy) {
+    if (policy) {
+        supervise_unwatch(policy);
+        free(policy);
+    }
+}
+
+/******************************************************************************
+Write a number of seconds as 42s, 5m07s or 3h25m to stream.
+******************************************************************************/
+void write_seconds(long seconds, FILE *stream) {
+    if (seconds < 60) {
+        fprintf(stream, "%lds", seconds);
+    } else if (seconds < 60 * 60) {
+        fprintf(stream, "%ldm%02lds", seconds / 60, seconds % 60);
+    } else {
+        fprintf(stream, "%ldh%02ldm", seconds / 3600, seconds / 60 % 60);
+    }
+}
+
+/******************************************************************************
+"wc [-lwmc] [FILE...]" built in command. Counts lines, words and bytes like 
+coreutils wc in the C locale (-m counts bytes as well), with the same output
+format, so "wc < log" does not have to fork and exec.
+A regular file is mapped with mmap() and counted in place; anything else (a
+pipe, or a pipeline stage) is read in large blocks. Counting uses AVX2 or SSE2
+when the CPU has them (see wc_count). With set -o records, wc takes records 
+from the previous stage and passes its counts on as records.
+******************************************************************************/
+int wc_command(struct command_line *command_line, FILE *in, FILE *out,
+               int *status, struct job_table *jobs)
+{
+    if (stage_records_out) {
+        // a single count goes on as an integer record
+        return records_from_text(wc_command, command_line, in, status, jobs,
+                                 true);
+    }
+    bool lines = false, words = false, chars = false, bytes = false;
+    int arg = 1;
+    for (; arg < command_line->args_count; arg++) {
+        char *option = command_line->args[arg];
+        if ((option[0] != '-') || (option[1] == '\0')) {
+            break;
+        }
+        if (!strcmp(option, "--")) {
+            arg++;
+            break;
+        }
+        if (!strcmp(option, "--lines") || !strcmp(option, "--words") 
+                || !strcmp(option, "--chars") || !strcmp(option, "--bytes")) {
+            lines |= (option[2] == 'l');
+            words |= (option[2] == 'w');
+            chars |= (option[2] == 'c') && (option[3] == 'h');
+            bytes |= (option[2] == 'b');
+            continue;
+        }
+        for (char *c = option + 1; *c; c++) {
+            if (!strchr("lwmc", *c) || (option[1] == '-')) {
+                fprintf(stderr, "wc: invalid option -- '%c'\n"
+                        "Try 'wc --help' for more information.\n", *c);
+                return 1;
+            }
+            lines |= (*c == 'l');
+            words |= (*c == 'w');
+            chars |= (*c == 'm');
+            bytes |= (*c == 'c');
+        }
+    }
+    if (!lines && !words && !chars && !bytes) {
+        lines = words = bytes = true;
+    }
+    int file_count = command_line->args_count - arg;
+    int input_count = file_count ? file_count : 1;
+    FILE **inputs = calloc(input_count, sizeof(FILE *));
+    // the counts are as wide as the total size of the regular files, at least
+    // 7 if an input is not a regular file, and not padded at all for one 
+    // count of one input (coreutils compute_number_width)
+    int width = 1;
+    if ((input_count > 1) || (lines + words + chars + bytes > 1)) {
+        int minimum_width = 1;
+        unsigned long long regular_total = 0;
+        for (int i = 0; i < input_count; i++) {
+            char *name = file_count ? command_line->args[arg + i] : "-";
+            inputs[i] = strcmp(name, "-") ? fopen(name, "re") : in;
+            struct stat input_stat;
+            if (!inputs[i]) {
+                // records from the previous stage are counted like a pipe
+                minimum_width = (strcmp(name, "-") || !stage_records_in) ? minimum_width : 7;
+                continue;
+            }
+            if ((fileno(inputs[i]) == -1) 
+                    || (fstat(fileno(inputs[i]), &input_stat) == -1)
+                    || !S_ISREG(input_stat.st_mode)) {
+                minimum_width = 7;
+            } else {
+                regular_total += input_stat.st_size;
+            }
+        }
+        for (; regular_total >= 10; regular_total /= 10) {
+            width++;
+        }
+        width = (width < minimum_width) ? minimum_width : width;
+    }
+    struct wc_counts total = {0};
+    int result = 0;
+    for (int i = 0; i < input_count; i++) {
+        char *name = file_count ? command_line->args[arg + i] : "-";
+        struct wc_counts counts = {0};
+        counts.lines_only = !words;
+        if (!strcmp(name, "-") && stage_records_in) {
+            wc_count_records(stage_records_in, &counts);
+        } else {
+            if (!inputs[i]) {
+                inputs[i] = strcmp(name, "-") ? fopen(name, "re") : in;
+            }
+            if (!inputs[i]) {
+                fflush(out);
+                fprintf(stderr, "wc: %s: %s\n", name, strerror(errno));
+                result = 1;
+                continue;
+            }
+            if (!wc_count_file(inputs[i], &counts)) {
+                fflush(out);
+                fprintf(stderr, "wc: %s: %s\n", name, strerror(errno));
+                result = 1;
+            }
+            if (inputs[i] != in) {
+                fclose(inputs[i]);
+            }
+        }
+        wc_print(&counts, lines, words, chars, bytes, width, 
+                 file_count ? name : NULL, out);
+        total.lines += counts.lines;
+        total.words += counts.words;
+        total.bytes += counts.bytes;
+    }
+    if (file_count > 1) {
+        wc_print(&total, lines, words, chars, bytes, width, "total", out);
+    }
+    free(inputs);
+    return result;
+}
+
+/******************************************************************************
+Print one line of wc output: the selected counts in coreutils order, and the
+file name if there is one.
+******************************************************************************/
+void wc_print(struct wc_counts *counts, bool lines, bool words, bool chars,
+              bool bytes, int width, char *name, FILE *out)
+{
+    unsigned long long values[4] = {counts->lines, counts->words, 
+                                    counts->bytes, counts->bytes};
+    bool selected[4] = {lines, words, chars, bytes};
+    bool first = true;
+    for (int i = 0; i < 4; i++) {
+        if (selected[i]) {
+            fprintf(out, first ? "%*llu" : " %*llu", width, values[i]);
+            first = false;
+        }
+    }
+    if (name) {
+        fprintf(out, " %s", name);
+    }
+    fprintf(out, "\n");
+}
+
+/******************************************************************************
+Count an input for wc from its current position to the end. A regular file is
+mapped, and the file offset moved to the end as if wc had read it; other 
+files are read 1 MiB at a time. Streams with no file descriptor (a builtin pipeline 
+stage reading from another builtin) are read with fread.
+Returns: false on a read error
+******************************************************************************/
+bool wc_count_file(FILE *in, struct wc_counts *counts) {
+    int fd = fileno(in);
+    struct stat in_stat;
+    if ((fd != -1) && (fstat(fd, &in_stat) == 0) && S_ISREG(in_stat.st_mode)) {
+        off_t offset = lseek(fd, 0, SEEK_CUR);
+        if ((offset != -1) && (offset < in_stat.st_size)) {
+            unsigned char *data = mmap(NULL, in_stat.st_size, PROT_READ, 
+                                       MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, in_stat.st_size, MADV_SEQUENTIAL);
+                wc_count(data + offset, in_stat.st_size - offset, counts);
+                munmap(data, in_stat.st_size);
+                // read anything added to the file since fstat as well
+                lseek(fd, in_stat.st_size, SEEK_SET);
+            }
+        }
+    }
+    size_t size = 1 << 20;
+    unsigned char *buffer = malloc(size);
+    ssize_t len;
+    while ((len = (fd != -1) ? read(fd, buffer, size) 
+                             : (ssize_t)fread(buffer, 1, size, in)) > 0) {
+        wc_count(buffer, len, counts);
+    }
+    free(buffer);
+    return (len == 0) && !((fd == -1) && ferror(in));
+}
+
+/******************************************************************************
+Count the records from the previous pipeline stage for wc as if each had been
+written as a line of text. Without -w only the lengths are needed.
+******************************************************************************/
+void wc_count_records(struct record_queue *queue, struct wc_counts *counts) {
+    struct record_batch *batch;
+    while ((batch = record_queue_get(queue))) {
+        for (size_t i = 0; i < batch->count; i++) {
+            struct record *record = &batch->records[i];
+            if (counts->lines_only) {
+                counts->lines++;
+                counts->bytes += record->len + 1;
+                continue;
+            }
+            wc_count((unsigned char *)batch->data + record->offset, record->len, 
+                     counts);
+            wc_count((unsigned char *)"\n", 1, counts);
+        }
+        record_batch_free(batch);
+    }
+}
+
+/******************************************************************************
+Add the lines, words and bytes of data to counts. Like coreutils in the C 
+locale, a word is a run of bytes between white space (space, \t, \n, \v, \f,
+\r) that has at least one printable character; other bytes (control 
+characters, bytes of UTF-8 sequences) neither start nor end a word. 
+counts->in_word carries the state from one block to the next.
+The kernels work on 32 (AVX2) or 16 (SSE2) bytes at a time: newlines, white
+space and printable characters are each found with compares, giving a bit 
+mask, and a word starts at every printable byte that follows white space. A
+block holding a byte that is neither is left to the scalar loop.
+******************************************************************************/
+void wc_count(unsigned char *data, size_t len, struct wc_counts *counts) {
+    static size_t (*kernel)(unsigned char *, size_t, struct wc_counts *) = NULL;
+    if (!kernel) {
+        kernel = wc_count_scalar;
+#ifdef __x86_64__
+        kernel = wc_count_sse2;
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            kernel = wc_count_avx2;
+        }
+#endif
+    }
+    counts->bytes += len;
+    size_t done = kernel(data, len, counts);
+    wc_count_scalar(data + done, len - done, counts);
+}
+
+/******************************************************************************
+Scalar wc kernel, for the bytes the vector kernels leave over.
+Returns: number of bytes counted (all of them)
+******************************************************************************/
+size_t wc_count_scalar(unsigned char *data, size_t len, struct wc_counts *counts) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = data[i];
+        if ((c == ' ') || ((c >= '\t') && (c <= '\r'))) {
+            counts->lines += (c == '\n');
+            counts->in_word = false;
+        } else if ((c > ' ') && (c < 0x7f)) {
+            counts->words += !counts->in_word;
+            counts->in_word = true;
+        }
+    }
+    return len;
+}
+
+#ifdef __x86_64__
+/******************************************************************************
+SSE2 wc kernel (every x86-64 CPU has SSE2). Unsigned range checks are done 
+as min(x - low, high - low) == x - low.
+Returns: number of bytes counted, a multiple of 16
+******************************************************************************/
+size_t wc_count_sse2(unsigned char *data, size_t len, struct wc_counts *counts) {
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i space_range = _mm_set1_epi8('\r' - '\t');
+    const __m128i printable = _mm_set1_epi8('!');
+    const __m128i printable_range = _mm_set1_epi8('~' - '!');
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128((__m128i *)(data + i));
+        if (counts->lines_only) {
+            counts->lines += __builtin_popcount(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+            continue;
+        }
+        __m128i controls = _mm_sub_epi8(block, tab);
+        __m128i visible = _mm_sub_epi8(block, printable);
+        uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+        uint32_t spaces = _mm_movemask_epi8(_mm_or_si128(
+            _mm_cmpeq_epi8(block, space),
+            _mm_cmpeq_epi8(_mm_min_epu8(controls, space_range), controls)));
+        uint32_t printables = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_min_epu8(visible, printable_range), visible));
+        if ((spaces | printables) != 0xffff) {
+            wc_count_scalar(data + i, 16, counts);
+            continue;
+        }
+        counts->lines += __builtin_popcount(newlines);
+        counts->words += __builtin_popcount(printables 
+                                            & ~((printables << 1) | counts->in_word));
+        counts->in_word = (printables >> 15) & 1;
+    }
+    return i;
+}
+
+/******************************************************************************
+AVX2 wc kernel, the same as wc_count_sse2 on 32 bytes at a time.
+Returns: number of bytes counted, a multiple of 32
+******************************************************************************/
+__attribute__((target("avx2")))
+size_t wc_count_avx2(unsigned char *data, size_t len, struct wc_counts *counts) {
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i space_range = _mm256_set1_epi8('\r' - '\t');
+    const __m256i printable = _mm256_set1_epi8('!');
+    const __m256i printable_range = _mm256_set1_epi8('~' - '!');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i block = _mm256_loadu_si256((__m256i *)(data + i));
+        if (counts->lines_only) {
+            counts->lines += __builtin_popcount(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+            continue;
+        }
+        __m256i controls = _mm256_sub_epi8(block, tab);
+        __m256i visible = _mm256_sub_epi8(block, printable);
+        uint32_t newlines = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+        uint32_t spaces = _mm256_movemask_epi8(_mm256_or_si256(
+            _mm256_cmpeq_epi8(block, space),
+            _mm256_cmpeq_epi8(_mm256_min_epu8(controls, space_range), controls)));
+        uint32_t printables = _mm256_movemask_epi8(
+            _mm256_cmpeq_epi8(_mm256_min_epu8(visible, printable_range), visible));
+        if ((spaces | printables) != 0xffffffff) {
+            wc_count_scalar(data + i, 32, counts);
+            continue;
+        }
+        counts->lines += __builtin_popcount(newlines);
+        counts->words += __builtin_popcount(printables 
+                                            & ~((printables << 1) | counts->in_word));
+        counts->in_word = printables >> 31;
+    }
+    return i;
+}
+#endif
+
+/******************************************************************************
+"filter [-v] PATTERN" built in command: passes on the lines of its input that
+match the glob PATTERN as a whole (see glob_match), or with -v the lines that
+do not. "filter -OP N", with OP one of eq, ne, lt, le, gt or ge, passes on the
+lines that are a decimal integer comparing that way with N. Between record 
+builtins (set -o records) each batch is filtered in place and handed on by 
+pointer, without copying any text, and an integer record (such as a count 
+from wc) is compared by its number without reading its text again.
+Returns: 0 if any line was passed on, 1 if none was (or for a usage error)
+******************************************************************************/
+int filter_command(struct command_line *command_line, FILE *in, FILE *out,
+                   int *status, struct job_table *jobs)
+{
+    static char *compare_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    int op = -1;
+    long long limit = 0;
+    if (command_line->args_count == 3) {
+        for (int i = 0; i < 6; i++) {
+            if (!strcmp(command_line->args[1], compare_ops[i])) {
+                op = i;
+            }
+        }
+        char *number = command_line->args[2];
+        if ((op != -1) && !record_is_number(number, strlen(number), &limit)) {
+            op = -2;
+        }
+    }
+    bool invert = (op == -1) && (command_line->args_count > 1) 
+                  && !strcmp(command_line->args[1], "-v");
+    if ((op == -2) || ((op == -1) && (command_line->args_count != 2 + invert))) {
+        fprintf(stderr, "usage: filter [-v] PATTERN\n"
+                        "       filter -eq|-ne|-lt|-le|-gt|-ge N\n");
+        return 1;
+    }
+    struct glob *glob = (op == -1) ? glob_parse(command_line->args[1 + invert]) 
+                                   : NULL;
+    struct record_reader input;
+    record_reader_open(&input, stage_records_in, in);
+    bool passed = false;
+    struct record_batch *batch;
+    while ((batch = record_read_batch(&input))) {
+        size_t kept = 0;
+        for (size_t i = 0; i < batch->count; i++) {
+            struct record *record = &batch->records[i];
+            char *text = batch->data + record->offset;
+            bool match;
+            if (op == -1) {
+                match = glob_match(glob, text, record->len) != invert;
+            } else {
+                long long number = record->number;
+                match = (record->kind == RECORD_INT) 
+                        || record_is_number(text, record->len, &number);
+                switch (op) {
+                case 0: match = match && (number == limit); break;
+                case 1: match = match && (number != limit); break;
+                case 2: match = match && (number < limit); break;
+                case 3: match = match && (number <= limit); break;
+                case 4: match = match && (number > limit); break;
+                case 5: match = match && (number >= limit); break;
+                }
+            }
+            if (match) {
+                batch->records[kept++] = *record;
+            }
+        }
+        batch->count = kept;
+        if (kept == 0) {
+            record_batch_free(batch);
+            continue;
+        }
+        passed = true;
+        if (!record_write_batch(stage_records_out, out, batch)) {
+            break;
+        }
+    }
+    record_reader_close(&input);
+    if (glob) {
+        glob_free(glob);
+    }
+    return passed ? 0 : 1;
+}
+
+/******************************************************************************
+"take N" built in command: passes on the first N lines of its input, then 
+stops reading so the stages before it stop as well.
+Returns: 0, or 1 for a usage error
+******************************************************************************/
+int take_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    char *end = NULL;
+    long long remaining = (command_line->args_count == 2) 
+                          ? strtoll(command_line->args[1], &end, 10) : -1;
+    if ((remaining < 0) || (end == command_line->args[1]) || *end) {
+        fprintf(stderr, "usage: take N\n");
+        return 1;
+    }
+    struct record_reader input;
+    record_reader_open(&input, stage_records_in, in);
+    struct record_batch *batch;
+    while ((remaining > 0) && (batch = record_read_batch(&input))) {
+        if (batch->count > (unsigned long long)remaining) {
+            batch->count = remaining;
+        }
+        remaining -= batch->count;
+        if (!record_write_batch(stage_records_out, out, batch)) {
+            break;
+        }
+    }
+    record_reader_close(&input);
+    return 0;
+}
+
+/******************************************************************************
+"kill [-s SIG | -SIG] TARGET..." built in command. A TARGET is a job (%N, %% 
+for the newest, %NAME for every job running the command NAME), --all for 
+every job, --tag T for the jobs started while JOBTAG was T, or a PID. SIG is a
+name (TERM or SIGTERM) or number, TERM by default.
+All targets are looked up first and then signalled in one pass over the job
+table, so signalling thousands of jobs takes no fork and one system call per
+job. Every background job is a process group of its own (a background 
+pipeline is one group), and the whole group is signalled with kill(-pgid), so
+children the job started get the signal as well. A PID that is not a job is 
+signalled on its own.
+A supervised job waiting to be restarted has no process: signalling it 
+cancels the restart and removes it. SIGKILL stops supervision as well.
+Returns: 0 if every target was signalled, else 1
+******************************************************************************/
+int kill_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    int signo = SIGTERM;
+    int arg = 1;
+    char *option = (arg < command_line->args_count) ? command_line->args[arg] : "";
+    if (!strcmp(option, "-s") && (arg + 1 < command_line->args_count)) {
+        signo = parse_signal(command_line->args[arg + 1]);
+        option = command_line->args[arg + 1];
+        arg += 2;
+    } else if ((option[0] == '-') && (option[1] != '-') && (option[1] != '\0')) {
+        signo = parse_signal(option + 1);
+        arg++;
+    }
+    if (signo == -1) {
+        fprintf(stderr, "kill: %s: invalid signal specification\n", option);
+        return 1;
+    }
+    if (arg < command_line->args_count && !strcmp(command_line->args[arg], "--")) {
+        arg++;
+    }
+    if (arg == command_line->args_count) {
+        fprintf(stderr, "usage: kill [-s SIG | -SIG] %%JOB|PID|--all|--tag T...\n");
+        return 1;
+    }
+    int result = 0;
+    bool *selected = calloc(jobs->count + 1, sizeof(bool));
+    pid_t *pids = malloc(command_line->args_count * sizeof(pid_t));
+    int pid_count = 0;
+    for (; arg < command_line->args_count; arg++) {
+        char *target = command_line->args[arg];
+        if (!strcmp(target, "--tag") && (arg + 1 < command_line->args_count)) {
+            char *tag = command_line->args[++arg];
+            for (int i = 0; i < jobs->count; i++) {
+                selected[i] |= jobs->procs[i].tag && !strcmp(jobs->procs[i].tag, tag);
+            }
+        } else if (!strcmp(target, "--all")) {
+            memset(selected, true, jobs->count * sizeof(bool));
+        } else if (target[0] == '%') {
+            if (!select_jobs(target + 1, jobs, selected)) {
+                fprintf(stderr, "kill: %s: no such job\n", target);
+                result = 1;
+            }
+        } else if (isdigit((unsigned char)target[0]) 
+                       && (strspn(target, "0123456789") == strlen(target))) {
+            pid_t pid = atoi(target);
+            int i;
+            for (i = 0; (i < jobs->count) && (jobs->procs[i].pid != pid); i++) {
+            }
+            if (i < jobs->count) {
+                selected[i] = true;
+            } else {
+                pids[pid_count++] = pid;
+            }
+        } else {
+            fprintf(stderr, "kill: %s: arguments must be process or job IDs\n", target);
+            result = 1;
+        }
+    }
+    // signal each process group once, however many of its jobs were chosen
+    pid_t *groups = malloc((jobs->count + 1) * sizeof(pid_t));
+    int group_count = 0;
+    for (int i = 0; i < jobs->count; i++) {
+        struct background_proc *proc = &jobs->procs[i];
+        if (!selected[i]) {
+            continue;
+        }
+        if (proc->pid == 0) {
+            if (signo != 0) {
+                cancel_supervised_restart(jobs, i);
+                memmove(&selected[i], &selected[i + 1], (jobs->count - i) * sizeof(bool));
+                i--;
+            }
+            continue;
+        }
+        if (proc->supervisor && (signo == SIGKILL)) {
+            proc->supervisor->killed = true;
+        }
+        int g;
+        for (g = 0; (g < group_count) && (groups[g] != proc->pgid); g++) {
+        }
+        if (g < group_count) {
+            continue;
+        }
+        groups[group_count++] = proc->pgid;
+        // a job whose process group could not be set up is signalled alone
+        if ((kill(-proc->pgid, signo) == -1) && (kill(proc->pid, signo) == -1)) {
+            fprintf(stderr, "kill: (%d) - %s\n", proc->pid, strerror(errno));
+            result = 1;
+        }
+    }
+    for (int i = 0; i < pid_count; i++) {
+        if (kill(pids[i], signo) == -1) {
+            fprintf(stderr, "kill: (%d) - %s\n", pids[i], strerror(errno));
+            result = 1;
+        }
+    }
+    free(groups);
+    free(pids);
+    free(selected);
+    return result;
+}
+
+/******************************************************************************
+Returns the number of the signal called name (KILL, SIGKILL or 9; case does
+not matter), or -1 if there is no such signal.
+******************************************************************************/
+int parse_signal(char *name) {
+    if (isdigit((unsigned char)name[0])) {
+        char *end;
+        long number = strtol(name, &end, 10);
+        return (*end || (number >= NSIG)) ? -1 : number;
+    }
+    if (!strncasecmp(name, "SIG", 3)) {
+        name += 3;
+    }
+    for (int signo = 1; signo < NSIG; signo++) {
+        const char *abbrev = sigabbrev_np(signo);
+        if (abbrev && !strcasecmp(name, abbrev)) {
+            return signo;
+        }
+    }
+    return -1;
+}
+
+/******************************************************************************
+Mark the jobs named by a job spec (without its %): a job number, % or + for 
+the newest job, or a command name, which picks every job running it.
+Returns: the number of jobs it matched
+******************************************************************************/
+int select_jobs(char *spec, struct job_table *jobs, bool *selected) {
+    int matched = 0;
+    if (!strcmp(spec, "%") || !strcmp(spec, "+")) {
+        if (jobs->count > 0) {
+            selected[jobs->count - 1] = true;
+            matched++;
+        }
+        return matched;
+    }
+    bool number = spec[0] && (strspn(spec, "0123456789") == strlen(spec));
+    size_t len = strlen(spec);
+    for (int i = 0; i < jobs->count; i++) {
+        char *command = jobs->procs[i].command_str;
+        if (number ? (jobs->procs[i].job_id == atoi(spec))
+                   : (!strncmp(command, spec, len) 
+                      && ((command[len] == ' ') || (command[len] == '\0')))) {
+            selected[i] = true;
+            matched++;
+        }
+    }
+    return matched;
+}
+
+/******************************************************************************
+Stop a supervised job that is waiting to be restarted: its entry in the 
+scheduler heap and in the job table are removed.
+******************************************************************************/
+void cancel_supervised_restart(struct job_table *jobs, int index) {
+    for (int i = 0; i < sched_count; i++) {
+        if (sched_heap[i]->restart_job_id == jobs->procs[index].job_id) {
+            struct scheduled_command *entry = sched_heap_remove(i);
+            free(entry->command_str);
+            free(entry);
+            sched_rearm_timer();
+            break;
+        }
+    }
+    printf("supervise: job [%d] stopped\n", jobs->procs[index].job_id);
+    fflush(stdout);
+    remove_background_proc(jobs, index);
+}
+
+/******************************************************************************
+"pipestat" built in command: shows the pipes of the last pipeline run with 
+set -o pipestat (see run_pipe_relay). For each pipe: the bytes that went 
+through it and the rate, how much of the time its writer was blocked because
+the reader had not kept up, and how much of the time the reader was left 
+waiting for the writer.
+The bottleneck is the stage that most kept its neighbors waiting: the stage
+before it blocked on a full pipe and the stage after it waiting for input.
+That is the stage to speed up or parallelize. Pipes between two builtins 
+(in-process queues) are not measured.
+******************************************************************************/
+int pipestat_command(struct command_line *command_line, FILE *in, FILE *out,
+                     int *status, struct job_table *jobs)
+{
+    if (pipe_relay_count == 0) {
+        fprintf(stderr, "pipestat: no pipeline has been measured (set -o pipestat)\n");
+        return 1;
+    }
+    fprintf(out, "%-32s %12s %9s %15s %15s\n", "PIPE", "BYTES", "MB/s", 
+            "WRITER BLOCKED", "READER WAITING");
+    int stage_count = pipe_relays[pipe_relay_count - 1].writer_stage + 2;
+    double *score = calloc(stage_count, sizeof(double));
+    int *sides = calloc(stage_count, sizeof(int));
+    for (int i = 0; i < pipe_relay_count; i++) {
+        struct pipe_relay *relay = &pipe_relays[i];
+        double elapsed = relay->elapsed_ns ? relay->elapsed_ns : 1;
+        double blocked = relay->full_ns / elapsed;
+        double waiting = relay->empty_ns / elapsed;
+        char *edge = NULL;
+        size_t edge_len = 0;
+        FILE *stream = open_memstream(&edge, &edge_len);
+        fprintf(stream, "%d %s | %s", relay->writer_stage + 1, relay->writer, 
+                relay->reader);
+        fclose(stream);
+        fprintf(out, "%-32s %12llu %9.1f %14.0f%% %14.0f%%\n", edge, relay->bytes,
+                relay->bytes / elapsed * 1000, blocked * 100, waiting * 100);
+        free(edge);
+        // the reader held up the writer, the writer held up the reader
+        score[relay->writer_stage + 1] += blocked;
+        sides[relay->writer_stage + 1]++;
+        score[relay->writer_stage] += waiting;
+        sides[relay->writer_stage]++;
+    }
+    int bottleneck = -1;
+    for (int i = 0; i < stage_count; i++) {
+        if (sides[i] && ((bottleneck == -1) 
+                         || (score[i] / sides[i] > score[bottleneck] / sides[bottleneck]))) {
+            bottleneck = i;
+        }
+    }
+    if ((bottleneck != -1) && (score[bottleneck] / sides[bottleneck] >= 0.5)) {
+        char *name = NULL;
+        for (int i = 0; (i < pipe_relay_count) && !name; i++) {
+            if (pipe_relays[i].writer_stage == bottleneck) {
+                name = pipe_relays[i].writer;
+            } else if (pipe_relays[i].writer_stage + 1 == bottleneck) {
+                name = pipe_relays[i].reader;
+            }
+        }
+        fprintf(out, "bottleneck: stage %d (%s), its neighbors waited %.0f%% of "
+                "the time\n", bottleneck + 1, name, score[bottleneck] / sides[bottleneck] * 100);
+    } else {
+        fprintf(out, "no stage kept its neighbors waiting most of the time\n");
+    }
+    free(score);
+    free(sides);
+    return 0;
+}
+
+/******************************************************************************
+"exec [REDIRECTION...] [command [args]]" built in command.
+With a command, the shell is replaced by it (same PID, so whatever started 
+the shell now waits for the command, and signals go to it directly). The
+redirections are made first and apply to the command. Background jobs are 
+left running, or sent SIGTERM first if EXEC_JOBS is "kill"; scheduled and 
+supervised commands end with the shell. If the command cannot be run the 
+shell carries on, with status 1.
+Without a command, the redirections are made to the shell itself and stay for
+all later commands: "exec > log" sends all later output to log. A 
+REDIRECTION is [N]<FILE, [N]>FILE, [N]>>FILE (append), [N]<>FILE (read and 
+write), N>&M or N<&M (make N a copy of M) and N>&- (close N), with the FILE 
+or M in the same word or the next; N is 0 for < and 1 for > by default. 
+"< FILE" and "> FILE" (with spaces) are made before the others, so 
+"exec > log 2>&1" sends both stdout and stderr to log. File descriptors 
+above 2 that the shell uses itself (all close-on-exec) can't be replaced.
+******************************************************************************/
+int exec_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    if (command_line->input_file 
+            && !exec_file_redirect(STDIN_FILENO, command_line->input_file, 
+                                   O_RDONLY)) {
+        return 1;
+    }
+    if (command_line->output_file 
+            && !exec_file_redirect(STDOUT_FILENO, command_line->output_file, 
+                                   O_WRONLY | O_CREAT | O_TRUNC)) {
+        return 1;
+    }
+    int arg = 1;
+    while (arg < command_line->args_count) {
+        char *word = command_line->args[arg];
+        char *op = word + strspn(word, "0123456789");
+        if ((*op != '<') && (*op != '>')) {
+            break;
+        }
+        int used = exec_redirect(command_line->args + arg, 
+                                 command_line->args_count - arg);
+        if (used == 0) {
+            return 1;
+        }
+        arg += used;
+    }
+    if (arg == command_line->args_count) {
+        return 0;
+    }
+    char *policy = get_var("EXEC_JOBS");
+    if (policy && !strcmp(policy, "kill")) {
+        for (int i = 0; i < jobs->count; i++) {
+            if ((jobs->procs[i].pid != 0) && (kill(-jobs->procs[i].pgid, SIGTERM) == -1)) {
+                kill(jobs->procs[i].pid, SIGTERM);
+            }
+        }
+    }
+    // args of a builtin are not NULL terminated, there is room for it
+    command_line->args[command_line->args_count] = NULL;
+    fflush(NULL);
+    // the command runs in the foreground, as the shell did
+    restore_SIGINT();
+    execvp(command_line->args[arg], command_line->args + arg);
+    int error = errno;
+    ignore_SIGINT();
+    fprintf(stderr, "exec: %s: %s\n", command_line->args[arg], strerror(error));
+    return 1;
+}
+
+/******************************************************************************
+Make one redirection of exec (see exec_command) to the shell. args are the 
+remaining args of exec, starting with the redirection.
+Returns: the number of args used (2 if the file is in the next one), or 0 if
+the redirection is not valid or can't be made (after printing why)
+******************************************************************************/
+int exec_redirect(char **args, int count) {
+    char *word = args[0];
+    char *op = word + strspn(word, "0123456789");
+    int fd = (op > word) ? atoi(word) : ((*op == '<') ? STDIN_FILENO : STDOUT_FILENO);
+    // < > >> <> <& >&
+    int op_len = ((op[1] == '>') || (op[1] == '&')) ? 2 : 1;
+    char *target = op + op_len;
+    int used = 1;
+    if (!*target && (count > 1)) {
+        target = args[1];
+        used = 2;
+    }
+    if (!*target || (*target == '<') || (op - word > 4)) {
+        fprintf(stderr, "exec: %s: bad redirection\n", word);
+        return 0;
+    }
+    int fd_flags = fcntl(fd, F_GETFD);
+    if ((fd > 2) && (fd_flags != -1) && (fd_flags & FD_CLOEXEC)) {
+        fprintf(stderr, "exec: %d: file descriptor is used by the shell\n", fd);
+        return 0;
+    }
+    if (op[1] == '&') {
+        // N>&M, N<&M or N>&-
+        fflush(stdout);
+        fflush(stderr);
+        if (!strcmp(target, "-")) {
+            close(fd);
+            return used;
+        }
+        char *end;
+        int source = strtol(target, &end, 10);
+        if (*end || (fcntl(source, F_GETFD) == -1)) {
+            fprintf(stderr, "exec: %s: bad file descriptor\n", target);
+            return 0;
+        }
+        if ((source != fd) && (dup2(source, fd) == -1)) {
+            fprintf(stderr, "exec: %s: %s\n", word, strerror(errno));
+            return 0;
+        }
+        return used;
+    }
+    int flags = O_RDONLY;
+    if (op[0] == '>') {
+        flags = O_WRONLY | O_CREAT | ((op[1] == '>') ? O_APPEND : O_TRUNC);
+    } else if (op[1] == '>') {
+        flags = O_RDWR | O_CREAT;
+    }
+    return exec_file_redirect(fd, target, flags) ? used : 0;
+}
+
+/******************************************************************************
+Open path with flags as file descriptor fd of the shell, in place of what fd
+was. It is not close-on-exec, so commands run later inherit it.
+Returns: false if path can't be opened (after printing why)
+******************************************************************************/
+bool exec_file_redirect(int fd, char *path, int flags) {
+    int file_fd = open(path, flags, 0666);
+    if (file_fd == -1) {
+        fprintf(stderr, "exec: cannot open %s: %s\n", path, strerror(errno));
+        return false;
+    }
+    if (file_fd != fd) {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(file_fd, fd);
+        close(file_fd);
+    }
+    return true;
+}
+
+/******************************************************************************
+Move a file descriptor the shell keeps open to SHELL_FD_MIN or above, so it is
+not in the way of exec 3< FILE and the like. The new descriptor is 
+close-on-exec.
+Returns: the new descriptor, or fd itself if it is -1 or can't be moved
+******************************************************************************/
+int move_shell_fd(int fd) {
+    if ((fd == -1) || (fd >= SHELL_FD_MIN)) {
+        return fd;
+    }
+    int moved = fcntl(fd, F_DUPFD_CLOEXEC, SHELL_FD_MIN);
+    if (moved == -1) {
+        return fd;
+    }
+    close(fd);
+    return moved;
+}
+
+/******************************************************************************
+Displays either the exit status or the terminating signal of the last
+ran foreground command to out. 
+If status is 0 or 1, print exit status message.
+If status is > 1, print terminating signal message.
+******************************************************************************/
+void display_status(int *status, FILE *out) {
+    if ((*status == 0) || (*status == 1)) {
+        fprintf(out, "exit value %d\n", *status);
+        fflush(out);
+    } else {
+        fprintf(out, "terminated by signal %d\n", *status);
+        fflush(out);
+    }
+}
+
+/******************************************************************************
+Change cwd to path specified, and record the new directory for z.
+Free memory allocated from getcwd call after changing directory.
+******************************************************************************/
+void change_dir(char *envpath) {
+    int change_dir_num = chdir(envpath);
+    // On chdir success, zero is returned.  On error, -1 is returned
+    if (change_dir_num == -1) {
+        printf("Error changing directories.\n");
+        fflush(stdout);
+        return;
+    }
+    char *cwd = get_cwd();
+    // printf("cwd after change dir: %s\n", cwd);
+    if (cwd) {
+        z_record_visit(cwd);
+    }
+    free(cwd);
+}
+
+/******************************************************************************
+Get and return the current working directory.
+https://man7.org/linux/man-pages/man3/getcwd.3.html
+    "glibc's getcwd() allocates the buffer dynamically using malloc(3) if buf
+     is NULL.  In this case, the allocated buffer has the length size unless
+     size is zero, when buf is allocated as big as necessary.  The caller 
+     should free(3) the returned buffer.
+******************************************************************************/
+char *get_cwd() {
+    char *cwd;
+    char *buffer = NULL;
+    size_t len = 0;
+    cwd = getcwd(buffer, len);
+    return cwd;
+}
+
+/******************************************************************************
+Iterate through the job table and use waitpid on each process PID. 
+Display message if process is complete with process exit status. 
+Remove process from the table if it is complete, unless it is a supervised job
+that will be restarted.
+Basic structure of WIFEXITED code modified from course exploration Process API
+ - Monitoring Child Processes
+******************************************************************************/
+void check_background_procs(struct job_table *jobs, int *status) {
+    int i;
+    int pid_check;
+    int child_status;
+    for (i = 0; i < jobs->count; i++) {
+        if (jobs->procs[i].pid == 0) {
+            // supervised job waiting for its restart, waitpid(0) would reap
+            // any child
+            continue;
+        }
+        pid_check = waitpid(jobs->procs[i].pid, &child_status, WNOHANG);
+        // printf("child_status: %d, pid_check: %d\n", child_status, pid_check);
+        // if waitpid returnes the child pid, the child process is complete and
+        // can be removed from the job table
+        if (pid_check == jobs->procs[i].pid) {
+            // display background PID status and exit value or signal termination
+            if(WIFEXITED(child_status)) {
+                printf("background pid %d is done: exit value %d\n", pid_check, WEXITSTATUS(child_status));
+                fflush(stdout);
+            } else {
+                printf("background pid %d is done: terminated by signal %d\n", pid_check, WTERMSIG(child_status));
+                fflush(stdout);
+            }
+            if (jobs->procs[i].supervisor 
+                    && supervise_job_done(jobs, i, child_status)) {
+                // kept in the table until it is restarted
+                jobs->procs[i].pid = 0;
+            } else {
+                // remove process from job table
+                remove_background_proc(jobs, i);
+                // roll back i by one if a value was removed 
+                i -= 1;
+            }
+            // let the scheduler know in case a queued run was waiting on it
+            sched_job_done(pid_check, status, jobs);
+        }
+    }
+}
+
+/******************************************************************************
+Add a background process to the job table, growing the table if it is full.
+The job gets the next job number; numbering starts over at 1 whenever the 
+table is empty.
+Paramaters: ptr to job table, PID, command line string (table takes ownership)
+******************************************************************************/
+void add_background_proc(struct job_table *jobs, pid_t pid, char *command_str) {
+    if (jobs->count == jobs->capacity) {
+        jobs->capacity = jobs->capacity ? jobs->capacity * 2 : 100;
+        jobs->procs = realloc(jobs->procs, jobs->capacity * sizeof(*jobs->procs));
+    }
+    if (jobs->count == 0) {
+        jobs->next_job_id = 1;
+    }
+    struct background_proc *proc = &jobs->procs[jobs->count++];
+    proc->pid = pid;
+    proc->pgid = pid;
+    proc->job_id = jobs->next_job_id++;
+    proc->command_str = command_str;
+    char *tag = get_var("JOBTAG");
+    proc->tag = (tag && *tag) ? strdup(tag) : NULL;
+    proc->supervisor = NULL;
+}
+
+/******************************************************************************
+Removes the process at the specified index from the job table.
+Paramaters: ptr to job table, index of process to be removed
+******************************************************************************/
+void remove_background_proc(struct job_table *jobs, int index) {
+    int i;
+    free(jobs->procs[index].command_str);
+    free(jobs->procs[index].tag);
+    free_supervisor(jobs->procs[index].supervisor);
+    for (i = index; i < jobs->count - 1; i++) {
+        jobs->procs[i] = jobs->procs[i + 1];
+    }
+    jobs->count -= 1;
+}
+
+/******************************************************************************
+Fork a child process.
+Foreground commands are checked first with prespawn_check so that a child is
+not created just to report a missing input file or command.
+With SPAWN_THREADS set, the command is launched by the spawner pool instead
+(see spawn_command).
+First add forked child to background_proc array if process to run in background
+In child 
+    - call exec_child to set up signals and redirection and run the command
 In parent
     - print statement if running in background
     - wait for process if running in foreground only and then check exit 
@@ -403,273 +5837,3865 @@ Program.
 Basic structure of WIFEXITED code modified from course exploration Monitoring 
 Child Processes
 ******************************************************************************/
-void fork_child(struct command_line *command_line, int *status, 
-                int *background_procs, int *bg_proc_count) 
+void fork_child(struct command_line *command_line, int *status, 
+                struct job_table *jobs) 
+{
+    int child_status;
+    // Don't fork a foreground command that is certain to fail
+    if (!command_line->run_in_background && !prespawn_check(command_line, status)) {
+        return;
+    }
+    // With bgstream on, background output goes to a pipe read by the shell
+    int stream_pipe[2] = {-1, -1};
+    if (command_line->run_in_background && shell_options[OPT_BGSTREAM]) {
+        if (pipe2(stream_pipe, O_CLOEXEC) == 0) {
+            fcntl(stream_pipe[0], F_SETFL, O_NONBLOCK);
+            command_line->stream_fd = stream_pipe[1];
+        }
+    }
+    // listening sockets are passed on by exec_child in a forked child
+    if (!command_line->listen_fd_count && spawn_pool_ready()) {
+        spawn_command(command_line, stream_pipe[0], status, jobs);
+        return;
+    }
+    // A background child closes exec_pipe when it execs (or exits), so the 
+    // shell can wait until the job is really running its command: a kill or
+    // pkill on the next line must not find it still a copy of the shell
+    int exec_pipe[2] = {-1, -1};
+    if (command_line->run_in_background) {
+        pipe2(exec_pipe, O_CLOEXEC);
+    }
+    pid_t spawn_pid = fork();
+
+    // If process to run in background (foreground-only mode has already
+    // cleared the flag), add child PID to the job table
+    if (command_line->run_in_background && (spawn_pid > 0)) {
+        // each background job is a process group of its own, so kill can
+        // signal everything it started (set by both sides to avoid a race)
+        setpgid(spawn_pid, spawn_pid);
+        add_background_proc(jobs, spawn_pid, join_command_args(command_line, 0));
+        if (stream_pipe[0] != -1) {
+            close(stream_pipe[1]);
+            add_output_stream(jobs->procs[jobs->count - 1].job_id, spawn_pid,
+                              stream_pipe[0]);
+        }
+    }
+    switch(spawn_pid) {
+        case -1:
+            perror("fork()\n");
+            exit(1);
+            break;
+        case 0: ;
+            // child process
+            // printf("testing child process pid = %d\n", getpid());
+            if (command_line->run_in_background) {
+                setpgid(0, 0);
+                close(exec_pipe[0]);
+            }
+            exec_child(command_line, -1, -1, status);
+            break;
+        default:
+            // Parent process
+            if (command_line->run_in_background) {
+                // run child in background, do not wait for child to terminate
+                if (exec_pipe[0] != -1) {
+                    char byte;
+                    close(exec_pipe[1]);
+                    while ((read(exec_pipe[0], &byte, 1) == -1) && (errno == EINTR)) {
+                    }
+                    close(exec_pipe[0]);
+                }
+                printf("background PID is %d\n", spawn_pid);
+                fflush(stdout);
+            } else {
+                // run child in foreground, wait for child to terminate
+                // printf("run proces in foreground child pid: %d\n", spawn_pid);
+                spawn_pid = waitpid(spawn_pid, &child_status, 0);
+                // printf("spawn_pid after waitpid: %d; child_status: %d\n", spawn_pid, child_status);
+                set_foreground_status(child_status, status);
+            }
+            break;
+    }
+}
+
+/******************************************************************************
+Launch a command with the spawner pool, for fork_child. A background command
+typed at the prompt is only submitted: the shell goes on to the next line 
+while a spawner launches it, and run_background_work adds it to the job table
+and prints its PID. Any other command is waited for: a foreground command 
+until it exits, and a background one (from supervise, at, every, ...) until 
+it is in the job table, since the caller looks for it there.
+******************************************************************************/
+void spawn_command(struct command_line *command_line, int stream_read_fd, 
+                   int *status, struct job_table *jobs)
+{
+    struct spawn_request *request = spawn_request_create(command_line, -1, -1);
+    request->stream_read_fd = stream_read_fd;
+    request->detached = command_line->run_in_background 
+                        && (command_line == prompt_command_line);
+    submit_spawn(request);
+    if (request->detached) {
+        return;
+    }
+    wait_spawns(jobs, &request, 1);
+    if (request->background) {
+        finish_background_spawn(jobs, request);
+    } else {
+        if (request->pid == -1) {
+            errno = request->error;
+            perror("fork()\n");
+            exit(1);
+        }
+        int child_status;
+        waitpid(request->pid, &child_status, 0);
+        set_foreground_status(child_status, status);
+    }
+    free_spawn_request(request);
+}
+
+/******************************************************************************
+Make a spawn request for a command, with copies of everything the child needs.
+in_fd and out_fd are the pipes to its pipeline neighbors, or -1. The fds stay
+open; the shell closes them after the launch as it does after a fork.
+******************************************************************************/
+struct spawn_request *spawn_request_create(struct command_line *command_line, 
+                                           int in_fd, int out_fd) 
+{
+    struct spawn_request *request = calloc(1, sizeof(struct spawn_request));
+    request->command = strdup(command_line->command);
+    // args_count includes the NULL added for execvp
+    request->args = calloc(command_line->args_count, sizeof(char *));
+    for (int i = 0; i < command_line->args_count - 1; i++) {
+        request->args[i] = strdup(command_line->args[i]);
+    }
+    if (command_line->input_file) {
+        request->input_file = strdup(command_line->input_file);
+    }
+    if (command_line->output_file) {
+        request->output_file = strdup(command_line->output_file);
+    }
+    request->in_fd = in_fd;
+    request->out_fd = out_fd;
+    request->stream_fd = command_line->stream_fd;
+    request->stream_read_fd = -1;
+    request->background = command_line->run_in_background;
+    if (request->background) {
+        request->command_str = join_command_args(command_line, 0);
+        char *tag = get_var("JOBTAG");
+        request->tag = (tag && *tag) ? strdup(tag) : NULL;
+    }
+    return request;
+}
+
+void free_spawn_request(struct spawn_request *request) {
+    free(request->command);
+    for (int i = 0; request->args[i]; i++) {
+        free(request->args[i]);
+    }
+    free(request->args);
+    free(request->input_file);
+    free(request->output_file);
+    free(request->command_str);
+    free(request->tag);
+    free(request);
+}
+
+/******************************************************************************
+Add a launched background command to the job table, as fork_child does after
+a fork, and print its PID. The child has already put itself in a process 
+group of its own.
+******************************************************************************/
+void finish_background_spawn(struct job_table *jobs, 
+                             struct spawn_request *request) 
+{
+    if (request->stream_fd != -1) {
+        close(request->stream_fd);
+    }
+    if (request->pid == -1) {
+        errno = request->error;
+        perror("fork()\n");
+        exit(1);
+    }
+    add_background_proc(jobs, request->pid, request->command_str);
+    request->command_str = NULL;
+    struct background_proc *proc = &jobs->procs[jobs->count - 1];
+    free(proc->tag);
+    proc->tag = request->tag;
+    request->tag = NULL;
+    if (request->stream_read_fd != -1) {
+        add_output_stream(proc->job_id, request->pid, request->stream_read_fd);
+    }
+    printf("background PID is %d\n", request->pid);
+    fflush(stdout);
+}
+
+/******************************************************************************
+Start or resize the spawner pool to the number of threads in SPAWN_THREADS 
+(0 or unset: no pool, commands are forked by the shell thread).
+Returns true if commands should be handed to the pool. A child forked from 
+the shell (a --parallel line, a background builtin stage) doesn't have the 
+threads, so it starts a pool of its own.
+******************************************************************************/
+bool spawn_pool_ready() {
+    char *value = get_var("SPAWN_THREADS");
+    long thread_count = value ? strtol(value, NULL, 10) : 0;
+    if (thread_count < 0) {
+        thread_count = 0;
+    } else if (thread_count > SPAWN_MAX_THREADS) {
+        thread_count = SPAWN_MAX_THREADS;
+    }
+    if (spawn_pool.thread_count && (spawn_pool.pid != getpid())) {
+        free(spawn_pool.threads);
+        memset(&spawn_pool, 0, sizeof(spawn_pool));
+    }
+    if (thread_count != spawn_pool.thread_count) {
+        spawn_pool_stop();
+        spawn_pool_start(thread_count);
+    }
+    return spawn_pool.thread_count > 0;
+}
+
+/******************************************************************************
+Start the spawner threads with all signals blocked (the main thread handles 
+signals). Each child is given the shell's own signal mask back before it 
+execs.
+******************************************************************************/
+void spawn_pool_start(int thread_count) {
+    if (thread_count == 0) {
+        return;
+    }
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &spawn_pool.mask);
+    spawn_pool.threads = calloc(thread_count, sizeof(pthread_t));
+    spawn_pool.pid = getpid();
+    for (int i = 0; i < thread_count; i++) {
+        pthread_create(&spawn_pool.threads[i], NULL, run_spawner, NULL);
+    }
+    spawn_pool.thread_count = thread_count;
+    pthread_sigmask(SIG_SETMASK, &spawn_pool.mask, NULL);
+}
+
+/******************************************************************************
+Stop the spawner threads. They launch every request already submitted first;
+the ones that are done are still collected by the shell as usual.
+******************************************************************************/
+void spawn_pool_stop() {
+    if (spawn_pool.thread_count == 0) {
+        return;
+    }
+    __atomic_store_n(&spawn_pool.stopping, true, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&spawn_pool.submit_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&spawn_pool.submit_seq, INT_MAX);
+    for (int i = 0; i < spawn_pool.thread_count; i++) {
+        pthread_join(spawn_pool.threads[i], NULL);
+    }
+    free(spawn_pool.threads);
+    spawn_pool.threads = NULL;
+    spawn_pool.thread_count = 0;
+    spawn_pool.stopping = false;
+}
+
+/******************************************************************************
+Spawner thread: take requests off the ring and launch them, then push each one
+on the completion stack and wake the shell. The child is made with clone 
+(CLONE_VM | CLONE_VFORK), as posix_spawn does: it runs on this thread's child
+stack in the shell's memory, so no page tables are copied, and only this 
+thread waits until it has exec'd. Other spawners launch at the same time.
+******************************************************************************/
+void *run_spawner(void *arg) {
+    char *stack = malloc(SPAWN_STACK_SIZE);
+    while (true) {
+        int seq = __atomic_load_n(&spawn_pool.submit_seq, __ATOMIC_ACQUIRE);
+        struct spawn_request *request = spawn_queue_take();
+        if (!request) {
+            if (__atomic_load_n(&spawn_pool.stopping, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            futex_wait(&spawn_pool.submit_seq, seq);
+            continue;
+        }
+        request->pid = clone(spawn_child, stack + SPAWN_STACK_SIZE, 
+                             CLONE_VM | CLONE_VFORK | SIGCHLD, request);
+        if (request->pid == -1) {
+            request->error = errno;
+        }
+        struct spawn_request *head = __atomic_load_n(&spawn_pool.completed, 
+                                                     __ATOMIC_RELAXED);
+        do {
+            request->next = head;
+        } while (!__atomic_compare_exchange_n(&spawn_pool.completed, &head, request,
+                                              true, __ATOMIC_RELEASE, 
+                                              __ATOMIC_RELAXED));
+        __atomic_add_fetch(&spawn_pool.completion_seq, 1, __ATOMIC_RELEASE);
+        futex_wake(&spawn_pool.completion_seq, 1);
+    }
+    free(stack);
+    return NULL;
+}
+
+/******************************************************************************
+Claim the request at the head of the ring, or return NULL if it is empty. The
+slot is read before head is claimed, and the shell does not reuse a slot until
+head has moved past it.
+******************************************************************************/
+struct spawn_request *spawn_queue_take() {
+    size_t head = __atomic_load_n(&spawn_pool.head, __ATOMIC_ACQUIRE);
+    while (true) {
+        size_t tail = __atomic_load_n(&spawn_pool.tail, __ATOMIC_ACQUIRE);
+        if (head == tail) {
+            return NULL;
+        }
+        struct spawn_request *request = __atomic_load_n(
+            &spawn_pool.queue[head % SPAWN_QUEUE_SIZE], __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&spawn_pool.head, &head, head + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return request;
+        }
+    }
+}
+
+/******************************************************************************
+Runs in the child made by run_spawner, until it execs. It does what 
+exec_child does, but shares the shell's memory, so it only makes system calls
+(no stdio or malloc) and leaves with _exit. Signals stay blocked until the 
+shell's handler for SIGTSTP has been replaced.
+******************************************************************************/
+int spawn_child(void *arg) {
+    struct spawn_request *request = arg;
+    struct sigaction action = {{0}};
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGTSTP, &action, NULL);
+    if (request->background) {
+        // each background job is a process group of its own
+        setpgid(0, 0);
+    } else {
+        action.sa_handler = SIG_DFL;
+        sigaction(SIGINT, &action, NULL);
+    }
+    int in_fd = request->in_fd;
+    int out_fd = request->out_fd;
+    if (request->input_file) {
+        in_fd = open(request->input_file, O_RDONLY);
+        if (in_fd == -1) {
+            spawn_child_error(STDOUT_FILENO, "cannot open ", request->input_file, 
+                              " for input");
+            _exit(1);
+        }
+    } else if (request->background) {
+        in_fd = open("/dev/null", O_RDONLY);
+    }
+    if (request->output_file) {
+        out_fd = open(request->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (out_fd == -1) {
+            spawn_child_error(STDOUT_FILENO, "cannot open ", request->output_file, 
+                              " for output");
+            _exit(1);
+        }
+    } else if (request->stream_fd != -1) {
+        out_fd = request->stream_fd;
+    } else if (request->background) {
+        out_fd = open("/dev/null", O_WRONLY);
+    }
+    if (((in_fd != -1) && (dup2(in_fd, STDIN_FILENO) == -1))
+            || ((out_fd != -1) && (dup2(out_fd, STDOUT_FILENO) == -1))
+            || ((request->stream_fd != -1) 
+                && (dup2(request->stream_fd, STDERR_FILENO) == -1))) {
+        spawn_child_error(STDOUT_FILENO, "error connecting pipeline", "", "");
+        _exit(1);
+    }
+    sigprocmask(SIG_SETMASK, &spawn_pool.mask, NULL);
+    execvp(request->command, request->args);
+    spawn_child_error(STDERR_FILENO, request->args[0], ": ", strerror(errno));
+    _exit(1);
+}
+
+/******************************************************************************
+Write an error message of up to three parts and a newline, for spawn_child.
+******************************************************************************/
+void spawn_child_error(int fd, char *first, char *second, char *third) {
+    char *parts[4] = {first, second, third, "\n"};
+    for (int i = 0; i < 4; i++) {
+        if (write(fd, parts[i], strlen(parts[i])) == -1) {
+            return;
+        }
+    }
+}
+
+/******************************************************************************
+Hand a request to the spawners. Only the shell thread submits, so tail is 
+only written here; if the ring is full, wait for a spawner to take one.
+******************************************************************************/
+void submit_spawn(struct spawn_request *request) {
+    size_t tail = spawn_pool.tail;
+    int attempts = 0;
+    while (tail - __atomic_load_n(&spawn_pool.head, __ATOMIC_ACQUIRE) 
+           == SPAWN_QUEUE_SIZE) {
+        byte_queue_wait(&attempts);
+    }
+    __atomic_store_n(&spawn_pool.queue[tail % SPAWN_QUEUE_SIZE], request, 
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&spawn_pool.tail, tail + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&spawn_pool.submit_seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&spawn_pool.submit_seq, 1);
+    spawn_pool.in_flight++;
+}
+
+/******************************************************************************
+Take every launched request off the completion stack, in the order they were
+launched. Detached background commands are added to the job table and freed;
+the others are marked collected for the code waiting for them.
+******************************************************************************/
+void collect_spawns(struct job_table *jobs) {
+    struct spawn_request *stack = __atomic_exchange_n(&spawn_pool.completed, NULL,
+                                                      __ATOMIC_ACQUIRE);
+    struct spawn_request *launched = NULL;
+    while (stack) {
+        struct spawn_request *next = stack->next;
+        stack->next = launched;
+        launched = stack;
+        stack = next;
+    }
+    while (launched) {
+        struct spawn_request *next = launched->next;
+        spawn_pool.in_flight--;
+        if (launched->detached) {
+            finish_background_spawn(jobs, launched);
+            free_spawn_request(launched);
+        } else {
+            launched->collected = true;
+        }
+        launched = next;
+    }
+}
+
+/******************************************************************************
+Wait until the count requests given have been launched and collected (NULL 
+entries are skipped), or with requests NULL, until nothing is in flight.
+******************************************************************************/
+void wait_spawns(struct job_table *jobs, struct spawn_request **requests, 
+                 int count) 
+{
+    while (true) {
+        int seq = __atomic_load_n(&spawn_pool.completion_seq, __ATOMIC_ACQUIRE);
+        collect_spawns(jobs);
+        bool done = requests ? true : (spawn_pool.in_flight == 0);
+        for (int i = 0; done && (i < count); i++) {
+            done = !requests[i] || requests[i]->collected;
+        }
+        if (done) {
+            return;
+        }
+        futex_wait(&spawn_pool.completion_seq, seq);
+    }
+}
+
+void futex_wait(int *address, int value) {
+    syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void futex_wake(int *address, int count) {
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+/******************************************************************************
+Runs in a forked child:
+    - restore SIGINT for foreground processes, ignore SIGTSTP for both 
+      foreground and background processes
+    - call redirect input/output functions
+    - for pipeline stages, connect stdin/stdout to the neighboring stages
+      (in_fd/out_fd, -1 if none) unless they are redirected to a file
+    - use execvp to run command with args
+Does not return.
+******************************************************************************/
+void exec_child(struct command_line *command_line, int in_fd, int out_fd, 
+                int *status) 
+{
+    // If process is to run in foreground, restore SIGINT
+    if (!command_line->run_in_background) {
+        restore_SIGINT();
+    }
+    // Child processes ignore SIGTSTP
+    ignore_SIGTSTP();
+    // Setup input and output redirection
+    input_redirect(command_line, status);
+    output_redirect(command_line, status);
+    if (command_line->listen_fd_count) {
+        pass_listen_fds(command_line);
+    }
+    if (((in_fd != -1) && !command_line->input_file && (dup2(in_fd, 0) == -1))
+            || ((out_fd != -1) && !command_line->output_file 
+                && (dup2(out_fd, 1) == -1))) {
+        printf("error connecting pipeline\n");
+        fflush(stdout);
+        exit(1);
+    }
+    // printf("Child %d running %s command\n", getpid(), command_line->command);
+    // command is args[0], or its full path in a compiled script
+    execvp(command_line->command, command_line->args);
+    // perror and exit are only reached if execvp fails
+    // perror("execvp");
+    perror(command_line->args[0]);
+    exit(1);
+}
+
+/******************************************************************************
+Check exit status of a foreground process that has been waited for.
+Basic structure of WIFEXITED code modified from course exploration Monitoring 
+Child Processes
+******************************************************************************/
+void set_foreground_status(int child_status, int *status) {
+    if(WIFEXITED(child_status)) {
+        // printf("pid %d is done: exit value %d\n", spawn_pid, WEXITSTATUS(child_status));
+        *status = WEXITSTATUS(child_status);
+    } else {
+        printf("terminated by signal %d\n", WTERMSIG(child_status));
+        fflush(stdout);
+        *status = WTERMSIG(child_status);
+    }
+}
+
+/******************************************************************************
+Run a pipeline of two or more commands connected with '|'.
+External commands are forked as usual. In a foreground pipeline, builtin
+stages do not get a process of their own: each one runs on a worker thread in
+the shell. Neighboring builtin stages are connected with an in-process byte
+queue (no system calls per write); every other connection is a pipe. With 
+set -o records, a builtin that writes records followed by one that reads them
+are connected with a record queue instead, and no text is made between them.
+With set -o pipestat, each pipe of a foreground pipeline is split in two, with
+a relay thread in between that counts the bytes and the time each side waits
+(see run_pipe_relay); the results are kept for the pipestat builtin.
+All external stages are forked before any worker thread is started, so no
+fork happens while other threads are running. With SPAWN_THREADS set, the 
+external stages of a foreground pipeline are all handed to the spawner pool
+at once and launched at the same time instead.
+In a background pipeline the shell carries on right away, so builtin stages
+are forked into children like external commands. Its stages share one process
+group, led by the first stage.
+The status is set from the last stage.
+******************************************************************************/
+void run_pipeline(struct command_line *pipeline, int *status, struct job_table *jobs) {
+    bool background = pipeline->run_in_background;
+    int stage_count = 0;
+    int i;
+    for (struct command_line *stage = pipeline; stage; stage = stage->next) {
+        stage_count++;
+    }
+    struct pipeline_stage *stages = calloc(stage_count, sizeof(struct pipeline_stage));
+    bool monitor = shell_options[OPT_PIPESTAT] && !background;
+    struct pipe_relay *relays = monitor ? calloc(stage_count, sizeof(struct pipe_relay)) 
+                                        : NULL;
+    int relay_count = 0;
+    struct command_line *command_line = pipeline;
+    for (i = 0; i < stage_count; i++, command_line = command_line->next) {
+        stages[i].command_line = command_line;
+        stages[i].builtin = find_builtin(command_line->command);
+        stages[i].in_fd = -1;
+        stages[i].out_fd = -1;
+        stages[i].threaded = stages[i].builtin && !background;
+        stages[i].last = (i == stage_count - 1);
+        stages[i].status = status;
+        stages[i].jobs = jobs;
+        command_line->run_in_background = background;
+        if (!stages[i].builtin) {
+            // add NULL to args list for execvp
+            command_line->args[command_line->args_count] = NULL;
+            command_line->args_count += 1;
+        }
+    }
+    // connect each stage to the next one
+    for (i = 0; i < stage_count - 1; i++) {
+        if (shell_options[OPT_RECORDS] && stages[i].threaded 
+                && stages[i + 1].threaded && stages[i].builtin->records_out 
+                && stages[i + 1].builtin->records_in 
+                && !stages[i].command_line->output_file 
+                && !stages[i + 1].command_line->input_file) {
+            struct record_queue *queue = record_queue_create();
+            stages[i].records_out = queue;
+            stages[i + 1].records_in = queue;
+        } else if (stages[i].threaded && stages[i + 1].threaded) {
+            struct byte_queue *queue = byte_queue_create(65536);
+            stages[i].out = byte_queue_open(queue, true);
+            stages[i + 1].in = byte_queue_open(queue, false);
+        } else {
+            int pipe_fds[2];
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1) {
+                perror("pipe");
+                pipe_fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                pipe_fds[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+            int relay_fds[2];
+            if (monitor && (pipe2(relay_fds, O_CLOEXEC) == 0)) {
+                struct pipe_relay *relay = &relays[relay_count++];
+                relay->writer = strdup(stages[i].command_line->command);
+                relay->reader = strdup(stages[i + 1].command_line->command);
+                relay->writer_stage = i;
+                relay->in_fd = pipe_fds[0];
+                relay->out_fd = relay_fds[1];
+                pipe_fds[0] = relay_fds[0];
+            }
+            stages[i].out_fd = pipe_fds[1];
+            stages[i + 1].in_fd = pipe_fds[0];
+        }
+    }
+    // fork the stages that need a process of their own
+    struct spawn_request **requests = NULL;
+    if (!background && spawn_pool_ready()) {
+        requests = calloc(stage_count, sizeof(struct spawn_request *));
+    }
+    for (i = 0; i < stage_count; i++) {
+        if (stages[i].threaded) {
+            continue;
+        }
+        if (requests) {
+            requests[i] = spawn_request_create(stages[i].command_line, 
+                                               stages[i].in_fd, stages[i].out_fd);
+            submit_spawn(requests[i]);
+            continue;
+        }
+        stages[i].pid = fork();
+        if (stages[i].pid == -1) {
+            perror("fork()\n");
+            exit(1);
+        }
+        if (stages[i].pid == 0) {
+            if (background) {
+                // the pipeline is one process group, led by the first stage
+                setpgid(0, i ? stages[0].pid : 0);
+            }
+            if (stages[i].builtin) {
+                run_forked_builtin_stage(&stages[i]);
+            }
+            exec_child(stages[i].command_line, stages[i].in_fd, stages[i].out_fd, 
+                       status);
+        }
+        if (background) {
+            setpgid(stages[i].pid, stages[0].pid);
+            add_background_proc(jobs, stages[i].pid, 
+                                join_command_args(stages[i].command_line, 0));
+            jobs->procs[jobs->count - 1].pgid = stages[0].pid;
+        }
+        // the pipe ends now belong to the child
+        if (stages[i].in_fd != -1) {
+            close(stages[i].in_fd);
+        }
+        if (stages[i].out_fd != -1) {
+            close(stages[i].out_fd);
+        }
+    }
+    if (requests) {
+        wait_spawns(jobs, requests, stage_count);
+        for (i = 0; i < stage_count; i++) {
+            if (!requests[i]) {
+                continue;
+            }
+            if (requests[i]->pid == -1) {
+                errno = requests[i]->error;
+                perror("fork()\n");
+                exit(1);
+            }
+            stages[i].pid = requests[i]->pid;
+            if (stages[i].in_fd != -1) {
+                close(stages[i].in_fd);
+            }
+            if (stages[i].out_fd != -1) {
+                close(stages[i].out_fd);
+            }
+            free_spawn_request(requests[i]);
+        }
+        free(requests);
+    }
+    if (background) {
+        printf("background PID is %d\n", stages[stage_count - 1].pid);
+        fflush(stdout);
+        free(stages);
+        return;
+    }
+    // start the builtin stages with all signals blocked (the main thread
+    // handles signals, and SIGPIPE must not kill the shell)
+    sigset_t all_signals, old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+    for (i = 0; i < stage_count; i++) {
+        if (stages[i].threaded) {
+            open_builtin_stage_files(&stages[i], i == 0, i == stage_count - 1);
+            pthread_create(&stages[i].thread, NULL, run_builtin_stage, &stages[i]);
+        }
+    }
+    for (i = 0; i < relay_count; i++) {
+        pthread_create(&relays[i].thread, NULL, run_pipe_relay, &relays[i]);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+    // wait for every stage, the last one sets the status
+    for (i = 0; i < stage_count; i++) {
+        if (stages[i].threaded) {
+            pthread_join(stages[i].thread, NULL);
+            if (i == stage_count - 1) {
+                *status = stages[i].exit_status;
+            }
+        } else {
+            int child_status;
+            waitpid(stages[i].pid, &child_status, 0);
+            if (i == stage_count - 1) {
+                set_foreground_status(child_status, status);
+            }
+        }
+    }
+    for (i = 0; i < relay_count; i++) {
+        pthread_join(relays[i].thread, NULL);
+    }
+    if (monitor) {
+        // replaced only now, so a pipestat stage could show the last ones
+        free_pipe_relays(pipe_relays, pipe_relay_count);
+        pipe_relays = relays;
+        pipe_relay_count = relay_count;
+    }
+    free(stages);
+}
+
+/******************************************************************************
+Set up the FILE streams a threaded builtin stage reads and writes. Redirection
+files take priority, then the pipes to neighboring stages (byte queue streams
+are already set up by run_pipeline). The first stage reads the shell's stdin
+and the last stage writes to the shell's stdout if nothing else is given. An
+end connected to a record queue has no stream (NULL).
+******************************************************************************/
+void open_builtin_stage_files(struct pipeline_stage *stage, bool first, bool last) {
+    struct command_line *command_line = stage->command_line;
+    if (command_line->input_file) {
+        if (stage->in) {
+            fclose(stage->in);
+        }
+        if (stage->in_fd != -1) {
+            close(stage->in_fd);
+        }
+        stage->in = fopen(command_line->input_file, "re");
+        if (!stage->in) {
+            printf("cannot open %s for input\n", command_line->input_file);
+            fflush(stdout);
+            stage->in = fopen("/dev/null", "re");
+        }
+    } else if (stage->in_fd != -1) {
+        stage->in = fdopen(stage->in_fd, "r");
+    } else if (first) {
+        stage->in = stdin;
+    }
+    if (command_line->output_file) {
+        if (stage->out) {
+            fclose(stage->out);
+        }
+        if (stage->out_fd != -1) {
+            close(stage->out_fd);
+        }
+        stage->out = fopen(command_line->output_file, "we");
+        if (!stage->out) {
+            printf("cannot open %s for output\n", command_line->output_file);
+            fflush(stdout);
+            stage->out = fopen("/dev/null", "we");
+        }
+    } else if (stage->out_fd != -1) {
+        stage->out = fdopen(stage->out_fd, "w");
+    } else if (last) {
+        stage->out = stdout;
+    }
+}
+
+/******************************************************************************
+Worker thread for a builtin pipeline stage. Runs the builtin, then closes its
+output (stream or record queue) so the next stage sees end of input. Builtins that change shell state
+are skipped (as if they had run in a subshell), except that the last stage may
+set shell variables (read, mapfile): the main thread is only waiting for the
+stages, so nothing else uses the variables meanwhile. Any SIGPIPE raised by writing
+to a stage that has already exited is discarded.
+******************************************************************************/
+void *run_builtin_stage(void *arg) {
+    struct pipeline_stage *stage = arg;
+    pipeline_stage_thread = true;
+    stage_records_in = stage->records_in;
+    stage_records_out = stage->records_out;
+    if (stage->builtin->pipeline_safe || (stage->builtin->pipeline_last && stage->last)) {
+        stage->exit_status = stage->builtin->run(stage->command_line, stage->in, 
+                                                 stage->out, stage->status, 
+                                                 stage->jobs);
+    }
+    if (stage->out == stdout) {
+        fflush(stdout);
+    } else if (stage->out) {
+        fclose(stage->out);
+    }
+    if (stage->in && (stage->in != stdin)) {
+        fclose(stage->in);
+    }
+    if (stage->records_out) {
+        record_queue_close(stage->records_out, true);
+    }
+    if (stage->records_in) {
+        record_queue_close(stage->records_in, false);
+    }
+    sigset_t pipe_signal;
+    struct timespec no_wait = {0, 0};
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    while (sigtimedwait(&pipe_signal, NULL, &no_wait) > 0) {
+    }
+    return NULL;
+}
+
+/******************************************************************************
+Runs in a forked child: a builtin stage of a background pipeline. Connects
+stdin/stdout to the neighboring stages, runs the builtin and exits with its
+status. Does not return.
+******************************************************************************/
+void run_forked_builtin_stage(struct pipeline_stage *stage) {
+    ignore_SIGTSTP();
+    input_redirect(stage->command_line, stage->status);
+    output_redirect(stage->command_line, stage->status);
+    if (((stage->in_fd != -1) && !stage->command_line->input_file 
+                && (dup2(stage->in_fd, 0) == -1))
+            || ((stage->out_fd != -1) && !stage->command_line->output_file 
+                && (dup2(stage->out_fd, 1) == -1))) {
+        printf("error connecting pipeline\n");
+        fflush(stdout);
+        _exit(1);
+    }
+    int result = 0;
+    if (stage->builtin->pipeline_safe) {
+        result = stage->builtin->run(stage->command_line, stdin, stdout, 
+                                     stage->status, stage->jobs);
+    }
+    fflush(stdout);
+    _exit(result);
+}
+
+/******************************************************************************
+Create a single-producer single-consumer byte queue used to connect two 
+threaded builtin stages. capacity must be a power of two.
+The writer only advances tail and the reader only advances head, so neither
+side needs a lock; each publishes its position with a release store and reads
+the other side's with an acquire load.
+******************************************************************************/
+struct byte_queue *byte_queue_create(size_t capacity) {
+    struct byte_queue *queue = calloc(1, sizeof(struct byte_queue));
+    queue->data = malloc(capacity);
+    queue->capacity = capacity;
+    queue->open_ends = 2;
+    return queue;
+}
+
+/******************************************************************************
+Open one end of a byte queue as a FILE stream (with fopencookie) so builtins
+can use stdio on it exactly as they would on a pipe.
+******************************************************************************/
+FILE *byte_queue_open(struct byte_queue *queue, bool writer) {
+    cookie_io_functions_t functions = {0};
+    if (writer) {
+        functions.write = byte_queue_write;
+        functions.close = byte_queue_close_writer;
+        return fopencookie(queue, "w", functions);
+    }
+    functions.read = byte_queue_read;
+    functions.close = byte_queue_close_reader;
+    return fopencookie(queue, "r", functions);
+}
+
+/******************************************************************************
+Wait for the other end of a byte queue: spin briefly, then yield the CPU, 
+then sleep for short periods if the other side is still not keeping up.
+******************************************************************************/
+void byte_queue_wait(int *attempts) {
+    (*attempts)++;
+    if (*attempts < 64) {
+        return;
+    }
+    if (*attempts < 1024) {
+        sched_yield();
+        return;
+    }
+    struct timespec nap = {0, 50000};
+    nanosleep(&nap, NULL);
+}
+
+/******************************************************************************
+fopencookie write function: copy size bytes into the queue, waiting while it
+is full. Fails with EPIPE if the reader has gone away.
+******************************************************************************/
+ssize_t byte_queue_write(void *cookie, const char *buffer, size_t size) {
+    struct byte_queue *queue = cookie;
+    size_t written = 0;
+    int attempts = 0;
+    while (written < size) {
+        if (__atomic_load_n(&queue->reader_closed, __ATOMIC_ACQUIRE)) {
+            errno = EPIPE;
+            return written ? (ssize_t)written : -1;
+        }
+        size_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+        size_t space = queue->capacity - (queue->tail - head);
+        if (space == 0) {
+            byte_queue_wait(&attempts);
+            continue;
+        }
+        attempts = 0;
+        size_t count = size - written < space ? size - written : space;
+        size_t offset = queue->tail & (queue->capacity - 1);
+        size_t first = queue->capacity - offset < count ? queue->capacity - offset : count;
+        memcpy(queue->data + offset, buffer + written, first);
+        memcpy(queue->data, buffer + written + first, count - first);
+        written += count;
+        __atomic_store_n(&queue->tail, queue->tail + count, __ATOMIC_RELEASE);
+    }
+    return written;
+}
+
+/******************************************************************************
+fopencookie read function: copy up to size bytes out of the queue, waiting
+while it is empty. Returns 0 (end of file) once the queue is empty and the
+writer has closed its end.
+******************************************************************************/
+ssize_t byte_queue_read(void *cookie, char *buffer, size_t size) {
+    struct byte_queue *queue = cookie;
+    int attempts = 0;
+    while (true) {
+        // check for a closed writer before loading tail so that no data 
+        // written before the close can be missed
+        bool closed = __atomic_load_n(&queue->writer_closed, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        size_t available = tail - queue->head;
+        if (available == 0) {
+            if (closed) {
+                return 0;
+            }
+            byte_queue_wait(&attempts);
+            continue;
+        }
+        size_t count = available < size ? available : size;
+        size_t offset = queue->head & (queue->capacity - 1);
+        size_t first = queue->capacity - offset < count ? queue->capacity - offset : count;
+        memcpy(buffer, queue->data + offset, first);
+        memcpy(buffer + first, queue->data, count - first);
+        __atomic_store_n(&queue->head, queue->head + count, __ATOMIC_RELEASE);
+        return count;
+    }
+}
+
+/******************************************************************************
+fopencookie close functions for each end of a byte queue. The queue is freed
+when both ends have been closed.
+******************************************************************************/
+int byte_queue_close_writer(void *cookie) {
+    struct byte_queue *queue = cookie;
+    __atomic_store_n(&queue->writer_closed, true, __ATOMIC_RELEASE);
+    byte_queue_release(queue);
+    return 0;
+}
+
+int byte_queue_close_reader(void *cookie) {
+    struct byte_queue *queue = cookie;
+    __atomic_store_n(&queue->reader_closed, true, __ATOMIC_RELEASE);
+    byte_queue_release(queue);
+    return 0;
+}
+
+void byte_queue_release(struct byte_queue *queue) {
+    if (__atomic_sub_fetch(&queue->open_ends, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(queue->data);
+        free(queue);
+    }
+}
+
+/******************************************************************************
+Relay thread for one pipe of a pipeline run with set -o pipestat. Data is 
+moved from the writer's pipe to the reader's with splice, so it is not copied
+through the shell. Each splice is non-blocking: while there is nothing to 
+read the relay waits for the writer (empty_ns); when the reader's pipe is full
+it waits for the reader (full_ns), and meanwhile the writer's pipe fills up 
+and blocks the writer. Ends when the writer closes its end (the reader then
+sees end of file) or the reader goes away (the writer then gets SIGPIPE).
+******************************************************************************/
+void *run_pipe_relay(void *arg) {
+    struct pipe_relay *relay = arg;
+    long long start = monotonic_ns();
+    struct pollfd input = {relay->in_fd, POLLIN, 0};
+    struct pollfd output = {relay->out_fd, POLLOUT, 0};
+    while (true) {
+        long long wait_start = monotonic_ns();
+        poll(&input, 1, -1);
+        relay->empty_ns += monotonic_ns() - wait_start;
+        ssize_t moved = splice(relay->in_fd, NULL, relay->out_fd, NULL, 
+                               PIPE_RELAY_CHUNK, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved > 0) {
+            relay->bytes += moved;
+            continue;
+        }
+        if ((moved == -1) && (errno == EAGAIN)) {
+            // there was input, so the reader's pipe is full
+            wait_start = monotonic_ns();
+            poll(&output, 1, -1);
+            relay->full_ns += monotonic_ns() - wait_start;
+            continue;
+        }
+        // end of input, or the reader has exited (EPIPE)
+        break;
+    }
+    relay->elapsed_ns = monotonic_ns() - start;
+    close(relay->in_fd);
+    close(relay->out_fd);
+    sigset_t pipe_signal;
+    struct timespec no_wait = {0, 0};
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    while (sigtimedwait(&pipe_signal, NULL, &no_wait) > 0) {
+    }
+    return NULL;
+}
+
+long long monotonic_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void free_pipe_relays(struct pipe_relay *relays, int count) {
+    for (int i = 0; i < count; i++) {
+        free(relays[i].writer);
+        free(relays[i].reader);
+    }
+    free(relays);
+}
+
+/******************************************************************************
+Make a batch of records from a block of text, one string record per line
+without its newline (a last line with no newline is a record as well). With
+numbers, a line that is exactly a decimal integer is a RECORD_INT instead.
+The batch takes over data, which must come from malloc.
+******************************************************************************/
+struct record_batch *record_batch_split(char *data, size_t len, bool numbers) {
+    struct record_batch *batch = calloc(1, sizeof(struct record_batch));
+    batch->data = data;
+    batch->capacity = 256;
+    batch->records = malloc(batch->capacity * sizeof(struct record));
+    size_t start = 0;
+    while (start < len) {
+        char *newline = memchr(data + start, '\n', len - start);
+        size_t end = newline ? (size_t)(newline - data) : len;
+        if (batch->count == batch->capacity) {
+            batch->capacity *= 2;
+            batch->records = realloc(batch->records, 
+                                     batch->capacity * sizeof(struct record));
+        }
+        struct record *record = &batch->records[batch->count++];
+        record->kind = RECORD_STRING;
+        record->offset = start;
+        record->len = end - start;
+        record->number = 0;
+        if (numbers && record_is_number(data + start, end - start, &record->number)) {
+            record->kind = RECORD_INT;
+        }
+        start = end + 1;
+    }
+    return batch;
+}
+
+/******************************************************************************
+Returns true if text is a decimal integer written the way it would be printed
+(an optional -, no leading zeros, at most 18 digits), and sets number to it.
+******************************************************************************/
+bool record_is_number(char *text, size_t len, long long *number) {
+    size_t start = (len > 1) && (text[0] == '-');
+    if ((len == start) || (len - start > 18) || ((text[start] == '0') && (len - start > 1))) {
+        return false;
+    }
+    long long value = 0;
+    for (size_t i = start; i < len; i++) {
+        if (!isdigit((unsigned char)text[i])) {
+            return false;
+        }
+        value = value * 10 + (text[i] - '0');
+    }
+    *number = start ? -value : value;
+    return true;
+}
+
+void record_batch_free(struct record_batch *batch) {
+    free(batch->records);
+    free(batch->data);
+    free(batch);
+}
+
+/******************************************************************************
+Create a record queue between two threaded builtin stages. Like a byte_queue
+it has no locks: the writer only advances tail and the reader only head, but
+what goes through it is a pointer to a whole batch of records.
+******************************************************************************/
+struct record_queue *record_queue_create() {
+    struct record_queue *queue = calloc(1, sizeof(struct record_queue));
+    queue->open_ends = 2;
+    return queue;
+}
+
+/******************************************************************************
+Hand a batch to the next stage, waiting while the queue is full. The batch
+belongs to the reader from then on.
+Returns: false (and frees the batch) if the reader has gone away
+******************************************************************************/
+bool record_queue_put(struct record_queue *queue, struct record_batch *batch) {
+    int attempts = 0;
+    while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) + RECORD_QUEUE_SIZE 
+               == queue->tail) {
+        if (__atomic_load_n(&queue->reader_closed, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+        byte_queue_wait(&attempts);
+    }
+    if (__atomic_load_n(&queue->reader_closed, __ATOMIC_ACQUIRE)) {
+        record_batch_free(batch);
+        return false;
+    }
+    queue->batches[queue->tail % RECORD_QUEUE_SIZE] = batch;
+    __atomic_store_n(&queue->tail, queue->tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/******************************************************************************
+Take the next batch from the previous stage, waiting while the queue is empty.
+Returns: the batch, to be freed by the caller (or passed on), or NULL once the
+writer has closed its end and every batch has been taken
+******************************************************************************/
+struct record_batch *record_queue_get(struct record_queue *queue) {
+    int attempts = 0;
+    while (true) {
+        // check for a closed writer before loading tail, as in byte_queue_read
+        bool closed = __atomic_load_n(&queue->writer_closed, __ATOMIC_ACQUIRE);
+        size_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+        if (tail != queue->head) {
+            break;
+        }
+        if (closed) {
+            return NULL;
+        }
+        byte_queue_wait(&attempts);
+    }
+    struct record_batch *batch = queue->batches[queue->head % RECORD_QUEUE_SIZE];
+    __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
+
+/******************************************************************************
+Close one end of a record queue. The queue is freed, with any batches the 
+reader did not take, when both ends have been closed.
+******************************************************************************/
+void record_queue_close(struct record_queue *queue, bool writer) {
+    __atomic_store_n(writer ? &queue->writer_closed : &queue->reader_closed, 
+                     true, __ATOMIC_RELEASE);
+    if (__atomic_sub_fetch(&queue->open_ends, 1, __ATOMIC_ACQ_REL) == 0) {
+        for (size_t i = queue->head; i != queue->tail; i++) {
+            record_batch_free(queue->batches[i % RECORD_QUEUE_SIZE]);
+        }
+        free(queue);
+    }
+}
+
+void record_reader_open(struct record_reader *reader, struct record_queue *queue,
+                        FILE *file) 
+{
+    memset(reader, 0, sizeof(struct record_reader));
+    reader->queue = queue;
+    reader->file = file;
+}
+
+/******************************************************************************
+Read the next batch of records for a builtin. From a record queue this is the
+batch the previous stage wrote. From a text stream, a block of up to 
+RECORD_BLOCK bytes is read and split into lines; an unfinished last line is 
+kept for the next block. Streams with a file descriptor are read with read(),
+so a line from a pipe is passed on as soon as it arrives.
+Returns: the batch, to be freed by the caller (or passed on), or NULL at the
+end of the input
+******************************************************************************/
+struct record_batch *record_read_batch(struct record_reader *reader) {
+    if (reader->queue) {
+        return record_queue_get(reader->queue);
+    }
+    size_t size = reader->pending_len + RECORD_BLOCK;
+    char *data = malloc(size);
+    size_t len = reader->pending_len;
+    if (len) {
+        memcpy(data, reader->pending, len);
+    }
+    free(reader->pending);
+    reader->pending = NULL;
+    reader->pending_len = 0;
+    int fd = fileno(reader->file);
+    while (!reader->done) {
+        if (len == size) {
+            size *= 2;
+            data = realloc(data, size);
+        }
+        ssize_t count = (fd != -1) ? read(fd, data + len, size - len)
+                                   : (ssize_t)fread(data + len, 1, size - len, 
+                                                    reader->file);
+        if (count <= 0) {
+            reader->done = true;
+            break;
+        }
+        char *newline = memrchr(data + len, '\n', count);
+        len += count;
+        if (newline) {
+            size_t end = newline - data + 1;
+            reader->pending_len = len - end;
+            reader->pending = malloc(reader->pending_len + 1);
+            memcpy(reader->pending, data + end, reader->pending_len);
+            len = end;
+            break;
+        }
+    }
+    if (len == 0) {
+        free(data);
+        return NULL;
+    }
+    return record_batch_split(data, len, false);
+}
+
+void record_reader_close(struct record_reader *reader) {
+    free(reader->pending);
+}
+
+/******************************************************************************
+Write a batch of records: to the next stage's record queue, or as text lines
+to out when there is no queue. Takes over the batch either way.
+Returns: false if the next stage has gone away or out has failed
+******************************************************************************/
+bool record_write_batch(struct record_queue *queue, FILE *out, 
+                        struct record_batch *batch) 
+{
+    if (queue) {
+        return record_queue_put(queue, batch);
+    }
+    for (size_t i = 0; i < batch->count; i++) {
+        struct record *record = &batch->records[i];
+        fwrite(batch->data + record->offset, 1, record->len, out);
+        fputc('\n', out);
+    }
+    record_batch_free(batch);
+    return !ferror(out);
+}
+
+/******************************************************************************
+Write text made by a builtin: as is to out, or to the next stage as one 
+record per line (see record_batch_split) when there is a record queue.
+Returns: false if the next stage has gone away or out has failed
+******************************************************************************/
+bool record_write_text(struct record_queue *queue, FILE *out, char *text, 
+                       size_t len, bool numbers) 
+{
+    if (!queue) {
+        fwrite(text, 1, len, out);
+        return !ferror(out);
+    }
+    if (len == 0) {
+        return true;
+    }
+    char *data = malloc(len);
+    memcpy(data, text, len);
+    return record_queue_put(queue, record_batch_split(data, len, numbers));
+}
+
+/******************************************************************************
+Run a builtin that prints text with its output going to memory, then pass the
+text on to the next stage as records (see record_write_text). This lets echo
+and wc start a record pipeline without changing how they print.
+Returns: the builtin's status
+******************************************************************************/
+int records_from_text(int (*run)(struct command_line *command_line, FILE *in, 
+                                 FILE *out, int *status, struct job_table *jobs),
+                      struct command_line *command_line, FILE *in, int *status,
+                      struct job_table *jobs, bool numbers)
+{
+    struct record_queue *queue = stage_records_out;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&text, &len);
+    stage_records_out = NULL;
+    int result = run(command_line, in, stream, status, jobs);
+    stage_records_out = queue;
+    fclose(stream);
+    record_write_text(queue, NULL, text, len, numbers);
+    free(text);
+    return result;
+}
+
+/******************************************************************************
+Before forking a foreground command, check for the errors that the child is 
+certain to hit: an input_file that cannot be read, or a command that does not
+exist anywhere on PATH. Prints the same message the child would print, sets
+status to 1 and returns false so the caller can skip the fork. The child still
+does its own checks, so anything that changes between now and the exec is
+still reported correctly.
+******************************************************************************/
+bool prespawn_check(struct command_line *command_line, int *status) {
+    if (command_line->input_file 
+            && (faccessat(AT_FDCWD, command_line->input_file, R_OK, AT_EACCESS) == -1)
+            && (errno != EINTR)) {
+        printf("cannot open %s for input\n", command_line->input_file);
+        fflush(stdout);
+        *status = 1;
+        return false;
+    }
+    if (resolve_command_path(command_line->command)) {
+        return true;
+    }
+    // the child would have created/truncated the output file before failing
+    // to exec, do the same here so the end result matches
+    if (command_line->output_file) {
+        int output_fd = open(command_line->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output_fd == -1) {
+            printf("cannot open %s for output\n", command_line->output_file);
+            fflush(stdout);
+            *status = 1;
+            return false;
+        }
+        close(output_fd);
+    }
+    fprintf(stderr, "%s: %s\n", command_line->args[0], strerror(ENOENT));
+    suggest_commands(command_line->command);
+    *status = 1;
+    return false;
+}
+
+/******************************************************************************
+Returns the path that execvp() would find for command, or NULL if there is no
+such file anywhere on PATH (so execvp() is certain to fail with ENOENT).
+Commands containing a '/' are checked directly. Otherwise results are kept in
+path_cache; a cached path is returned with no system calls, while a cached 
+"not found" is only trusted if none of the PATH directories have been modified
+since the cache was built. The returned string belongs to the cache.
+******************************************************************************/
+char *resolve_command_path(char *command) {
+    struct stat file_stat;
+    if (strchr(command, '/')) {
+        if ((stat(command, &file_stat) == -1) && (errno == ENOENT)) {
+            return NULL;
+        }
+        return command;
+    }
+    path_cache_sync();
+    struct path_cache_entry *entry = path_cache_lookup(command);
+    if (entry->name) {
+        if (entry->path || !path_cache.cacheable || !path_dirs_changed()) {
+            return entry->path;
+        }
+        // a PATH directory changed, the negative result may be stale
+        path_cache_clear();
+        entry = path_cache_lookup(command);
+    }
+    // search PATH the same way execvp() does: the first executable regular
+    // file wins, but a file that exists and is not executable still means
+    // execvp() fails with something other than ENOENT
+    char *found = NULL;
+    char *candidate = NULL;
+    for (int i = 0; i < path_cache.dir_count; i++) {
+        candidate = realloc(candidate, strlen(path_cache.dirs[i]) + strlen(command) + 2);
+        sprintf(candidate, "%s/%s", path_cache.dirs[i], command);
+        if (stat(candidate, &file_stat) == -1) {
+            continue;
+        }
+        if (S_ISREG(file_stat.st_mode) && (access(candidate, X_OK) == 0)) {
+            free(found);
+            found = strdup(candidate);
+            break;
+        }
+        if (!found) {
+            found = strdup(candidate);
+        }
+    }
+    free(candidate);
+    if (!path_cache.cacheable) {
+        // relative PATH entries depend on the cwd, don't keep the result
+        free(path_cache.uncached_result);
+        path_cache.uncached_result = found;
+        return found;
+    }
+    entry->name = strdup(command);
+    entry->path = found;
+    path_cache.count++;
+    if (path_cache.count * 2 > path_cache.capacity) {
+        path_cache_grow();
+    }
+    return found;
+}
+
+/******************************************************************************
+Make sure path_cache was built for the current value of PATH. If PATH changed
+(or the cache is empty) split it into directories, record each directory's 
+modification time, and drop all cached lookups.
+An unset PATH uses the same default directories as execvp().
+******************************************************************************/
+void path_cache_sync() {
+    char *path_env = getenv("PATH");
+    char default_path[256];
+    if (!path_env) {
+        confstr(_CS_PATH, default_path, sizeof(default_path));
+        path_env = default_path;
+    }
+    if (path_cache.path_env && !strcmp(path_cache.path_env, path_env)) {
+        return;
+    }
+    int i;
+    for (i = 0; i < path_cache.dir_count; i++) {
+        free(path_cache.dirs[i]);
+    }
+    free(path_cache.dirs);
+    free(path_cache.dir_mtimes);
+    free(path_cache.path_env);
+    path_cache.path_env = strdup(path_env);
+    path_cache.dir_count = 1;
+    for (i = 0; path_env[i]; i++) {
+        if (path_env[i] == ':') {
+            path_cache.dir_count++;
+        }
+    }
+    path_cache.dirs = malloc(path_cache.dir_count * sizeof(char *));
+    path_cache.dir_mtimes = calloc(path_cache.dir_count, sizeof(struct timespec));
+    path_cache.cacheable = true;
+    char *start = path_env;
+    for (i = 0; i < path_cache.dir_count; i++) {
+        char *end = strchrnul(start, ':');
+        // an empty PATH entry means the current directory
+        if (end == start) {
+            path_cache.dirs[i] = strdup(".");
+        } else {
+            path_cache.dirs[i] = strndup(start, end - start);
+        }
+        if (path_cache.dirs[i][0] != '/') {
+            path_cache.cacheable = false;
+        }
+        start = end + 1;
+    }
+    path_dirs_changed();
+    path_cache_clear();
+}
+
+/******************************************************************************
+Stat every PATH directory and compare its modification time to the one 
+recorded in path_cache (adding or removing a file updates the directory's
+mtime). Records the new times and returns true if any of them changed.
+******************************************************************************/
+bool path_dirs_changed() {
+    bool changed = false;
+    struct stat dir_stat;
+    for (int i = 0; i < path_cache.dir_count; i++) {
+        struct timespec mtime = {0};
+        if (stat(path_cache.dirs[i], &dir_stat) == 0) {
+            mtime = dir_stat.st_mtim;
+        }
+        if ((mtime.tv_sec != path_cache.dir_mtimes[i].tv_sec) 
+                || (mtime.tv_nsec != path_cache.dir_mtimes[i].tv_nsec)) {
+            path_cache.dir_mtimes[i] = mtime;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/******************************************************************************
+Find the hash table slot for command in path_cache: either the slot holding
+command, or the empty slot where it should be inserted (open addressing with
+linear probing).
+******************************************************************************/
+struct path_cache_entry *path_cache_lookup(char *command) {
+    if (path_cache.capacity == 0) {
+        path_cache_grow();
+    }
+    size_t index = hash_string(command) & (path_cache.capacity - 1);
+    while (path_cache.entries[index].name 
+               && strcmp(path_cache.entries[index].name, command)) {
+        index = (index + 1) & (path_cache.capacity - 1);
+    }
+    return &path_cache.entries[index];
+}
+
+/******************************************************************************
+Double the size of the path_cache hash table and rehash its entries.
+******************************************************************************/
+void path_cache_grow() {
+    struct path_cache_entry *old_entries = path_cache.entries;
+    size_t old_capacity = path_cache.capacity;
+    path_cache.capacity = old_capacity ? old_capacity * 2 : 64;
+    path_cache.entries = calloc(path_cache.capacity, sizeof(struct path_cache_entry));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].name) {
+            *path_cache_lookup(old_entries[i].name) = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+/******************************************************************************
+Drop all cached command lookups.
+******************************************************************************/
+void path_cache_clear() {
+    for (size_t i = 0; i < path_cache.capacity; i++) {
+        free(path_cache.entries[i].name);
+        free(path_cache.entries[i].path);
+        path_cache.entries[i].name = NULL;
+        path_cache.entries[i].path = NULL;
+    }
+    path_cache.count = 0;
+}
+
+/******************************************************************************
+After "command not found", print up to BK_MAX_SUGGESTIONS commands on PATH
+whose names are within a small edit distance of command (1 for names of up
+to 5 characters, 2 for longer ones, a swap of two characters counting as 
+one), closest first. The names come from 
+command_index, a BK-tree of every file in the PATH directories; it is built
+the first time it is needed and rebuilt when PATH or one of its directories
+changes, so a lookup only visits the few branches that can hold a close name.
+******************************************************************************/
+void suggest_commands(char *command) {
+    if (strchr(command, '/') || !command[0] || (strlen(command) >= BK_MAX_WORD)) {
+        return;
+    }
+    command_index_sync();
+    if (command_index.node_count == 0) {
+        return;
+    }
+    struct bk_suggestion suggestions[BK_MAX_SUGGESTIONS];
+    int count = 0;
+    int max_distance = (strlen(command) <= 5) ? 1 : 2;
+    struct bk_pattern pattern;
+    bk_pattern_init(&pattern, command);
+    bk_tree_search(0, &pattern, max_distance, suggestions, &count);
+    if (count == 0) {
+        return;
+    }
+    fprintf(stderr, "%s: did you mean", command);
+    for (int i = 0; i < count; i++) {
+        fprintf(stderr, "%s %s", i ? "," : "", suggestions[i].word);
+    }
+    fprintf(stderr, "?\n");
+}
+
+/******************************************************************************
+Find the names within max_distance of the pattern's word (counting swaps, 
+see edit_distance) in the subtree rooted at node. The search covers names 
+within radius = max(max_distance, 2) plain edits, so a single swap is always
+found. Since plain edit distance is a metric, a child at distance d from its
+parent can only be that close if |d - distance(parent, word)| <= radius; the
+other children are skipped. Matches are kept in suggestions sorted by 
+distance and then name, keeping the best BK_MAX_SUGGESTIONS.
+******************************************************************************/
+void bk_tree_search(int node, struct bk_pattern *pattern, int max_distance,
+                    struct bk_suggestion *suggestions, int *count) 
+{
+    struct bk_node *current = &command_index.nodes[node];
+    int radius = (max_distance < 2) ? 2 : max_distance;
+    int distance = pattern_distance(pattern, current->word);
+    // a swap of two characters is 2 plain edits but counts as 1, so rank by
+    // the distance with swaps
+    int ranked_distance = distance;
+    if ((distance > 1) && (distance <= 2 * max_distance)) {
+        ranked_distance = edit_distance(current->word, pattern->word, true, max_distance);
+    }
+    if ((ranked_distance <= max_distance) && (ranked_distance > 0)) {
+        // insertion sort into the short list
+        int i = *count;
+        while ((i > 0) 
+                   && ((suggestions[i - 1].distance > ranked_distance)
+                       || ((suggestions[i - 1].distance == ranked_distance)
+                           && (strcmp(suggestions[i - 1].word, current->word) > 0)))) {
+            if (i < BK_MAX_SUGGESTIONS) {
+                suggestions[i] = suggestions[i - 1];
+            }
+            i--;
+        }
+        if (i < BK_MAX_SUGGESTIONS) {
+            suggestions[i].word = current->word;
+            suggestions[i].distance = ranked_distance;
+            if (*count < BK_MAX_SUGGESTIONS) {
+                (*count)++;
+            }
+        }
+    }
+    if (distance > current->max_child_distance + radius) {
+        // no child is close enough
+        return;
+    }
+    int end = current->first_child + current->child_count;
+    for (int child = current->first_child; child < end; child++) {
+        int edge = command_index.nodes[child].distance;
+        if (edge > distance + radius) {
+            break;
+        }
+        if (edge >= distance - radius) {
+            bk_tree_search(child, pattern, max_distance, suggestions, count);
+        }
+    }
+}
+
+/******************************************************************************
+Prepare word (shorter than BK_MAX_WORD) for pattern_distance: for each 
+character, a bit mask of the positions where it appears in word.
+******************************************************************************/
+void bk_pattern_init(struct bk_pattern *pattern, char *word) {
+    memset(pattern->masks, 0, sizeof(pattern->masks));
+    pattern->word = word;
+    pattern->len = strlen(word);
+    for (int i = 0; i < pattern->len; i++) {
+        pattern->masks[(unsigned char)word[i]] |= (uint64_t)1 << i;
+    }
+}
+
+/******************************************************************************
+Levenshtein distance between the pattern's word and text, computed a column 
+of the dynamic programming table at a time with the column held as bit masks
+of +1/-1 steps (Myers' bit-parallel algorithm, in Hyyro's form for the 
+distance between whole strings). Costs a few operations per character of 
+text instead of one per cell of the table.
+******************************************************************************/
+int pattern_distance(struct bk_pattern *pattern, char *text) {
+    if (pattern->len == 0) {
+        return strlen(text);
+    }
+    uint64_t last = (uint64_t)1 << (pattern->len - 1);
+    uint64_t plus_v = ~(uint64_t)0;     // vertical steps of +1
+    uint64_t minus_v = 0;               // vertical steps of -1
+    int score = pattern->len;
+    for (char *c = text; *c; c++) {
+        uint64_t equal = pattern->masks[(unsigned char)*c];
+        uint64_t x_v = equal | minus_v;
+        uint64_t x_h = (((equal & plus_v) + plus_v) ^ plus_v) | equal;
+        uint64_t plus_h = minus_v | ~(x_h | plus_v);
+        uint64_t minus_h = plus_v & x_h;
+        if (plus_h & last) {
+            score++;
+        } else if (minus_h & last) {
+            score--;
+        }
+        // row 0 of the table goes up by one for each character of text
+        plus_h = (plus_h << 1) | 1;
+        minus_h <<= 1;
+        plus_v = minus_h | ~(x_v | plus_h);
+        minus_v = plus_h & x_v;
+    }
+    return score;
+}
+
+/******************************************************************************
+Edit distance between a and b (both shorter than BK_MAX_WORD): the number of
+characters to insert, delete or substitute to turn one into the other. If 
+transpose is true, swapping two adjacent characters also counts as one edit
+(optimal string alignment distance, which is not a metric, so the BK-tree 
+itself uses plain edits). Stops early and returns limit + 1 once the 
+distance is known to be more than limit.
+******************************************************************************/
+int edit_distance(char *a, char *b, bool transpose, int limit) {
+    int rows[3][BK_MAX_WORD + 1];
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    if ((int)(a_len > b_len ? a_len - b_len : b_len - a_len) > limit) {
+        return limit + 1;
+    }
+    int *before = rows[0];      // row i - 2
+    int *previous = rows[1];    // row i - 1
+    int *current = rows[2];
+    for (size_t j = 0; j <= b_len; j++) {
+        previous[j] = j;
+    }
+    for (size_t i = 1; i <= a_len; i++) {
+        current[0] = i;
+        int row_min = i;
+        for (size_t j = 1; j <= b_len; j++) {
+            int substitute = previous[j - 1] + (a[i - 1] != b[j - 1]);
+            int delete = previous[j] + 1;
+            int insert = current[j - 1] + 1;
+            int best = (substitute < delete) ? substitute : delete;
+            best = (insert < best) ? insert : best;
+            if (transpose && (i > 1) && (j > 1) && (a[i - 1] == b[j - 2]) 
+                    && (a[i - 2] == b[j - 1]) && (before[j - 2] + 1 < best)) {
+                best = before[j - 2] + 1;
+            }
+            current[j] = best;
+            row_min = (best < row_min) ? best : row_min;
+        }
+        // values never go down from one row to the next
+        if (row_min > limit) {
+            return limit + 1;
+        }
+        int *swap = before;
+        before = previous;
+        previous = current;
+        current = swap;
+    }
+    return (previous[b_len] > limit) ? limit + 1 : previous[b_len];
+}
+
+/******************************************************************************
+Make sure command_index holds the files of the current PATH directories: 
+rebuild it if PATH changed or a directory was modified since it was built 
+(checked with one stat per directory).
+******************************************************************************/
+void command_index_sync() {
+    path_cache_sync();
+    bool stale = !command_index.path_env 
+                 || strcmp(command_index.path_env, path_cache.path_env);
+    struct stat dir_stat;
+    for (int i = 0; !stale && (i < path_cache.dir_count); i++) {
+        struct timespec mtime = {0};
+        if (stat(path_cache.dirs[i], &dir_stat) == 0) {
+            mtime = dir_stat.st_mtim;
+        }
+        stale = (mtime.tv_sec != command_index.dir_mtimes[i].tv_sec) 
+                || (mtime.tv_nsec != command_index.dir_mtimes[i].tv_nsec);
+    }
+    if (!stale) {
+        return;
+    }
+    command_index_free();
+    command_index.path_env = strdup(path_cache.path_env);
+    command_index.dir_mtimes = calloc(path_cache.dir_count, sizeof(struct timespec));
+    for (int i = 0; i < path_cache.dir_count; i++) {
+        // stat before listing, so a file added meanwhile makes it stale 
+        if (stat(path_cache.dirs[i], &dir_stat) == 0) {
+            command_index.dir_mtimes[i] = dir_stat.st_mtim;
+        }
+        DIR *dir = opendir(path_cache.dirs[i]);
+        if (!dir) {
+            continue;
+        }
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if ((entry->d_name[0] != '.') && (entry->d_type != DT_DIR)
+                    && (strlen(entry->d_name) < BK_MAX_WORD)) {
+                bk_tree_insert(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    bk_tree_pack();
+}
+
+/******************************************************************************
+Reorder command_index breadth first, with the children of each node next to
+each other and sorted by distance, and copy the words into one block in the
+same order. A search then reads the nodes and words it visits mostly in 
+order instead of jumping around the heap.
+******************************************************************************/
+void bk_tree_pack() {
+    int count = command_index.node_count;
+    if (count == 0) {
+        return;
+    }
+    struct bk_node *packed = malloc(count * sizeof(struct bk_node));
+    int *order = malloc(count * sizeof(int));   // old index of each new node
+    size_t words_len = 0;
+    order[0] = 0;
+    int packed_count = 1;
+    for (int i = 0; i < count; i++) {
+        struct bk_node *node = &command_index.nodes[order[i]];
+        packed[i] = *node;
+        packed[i].first_child = packed_count;
+        packed[i].child_count = 0;
+        packed[i].next_sibling = -1;
+        words_len += strlen(node->word) + 1;
+        // append the children, insertion sorted by distance
+        for (int child = node->first_child; child != -1; 
+                 child = command_index.nodes[child].next_sibling) {
+            int j = packed_count + packed[i].child_count;
+            while ((j > packed_count) && (command_index.nodes[order[j - 1]].distance 
+                                          > command_index.nodes[child].distance)) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = child;
+            packed[i].child_count++;
+        }
+        packed_count += packed[i].child_count;
+    }
+    command_index.words = malloc(words_len);
+    char *word = command_index.words;
+    for (int i = 0; i < count; i++) {
+        size_t len = strlen(packed[i].word) + 1;
+        memcpy(word, packed[i].word, len);
+        free(packed[i].word);
+        packed[i].word = word;
+        word += len;
+    }
+    free(command_index.nodes);
+    free(order);
+    command_index.nodes = packed;
+    command_index.node_capacity = count;
+}
+
+/******************************************************************************
+Add word to command_index: walk down from the root following the child at 
+the same distance from each node as word, and attach it where there is none.
+A word that is already there is not added again.
+******************************************************************************/
+void bk_tree_insert(char *word) {
+    int parent = (command_index.node_count > 0) ? 0 : -1;
+    int distance = 0;
+    struct bk_pattern pattern;
+    bk_pattern_init(&pattern, word);
+    while (parent != -1) {
+        distance = pattern_distance(&pattern, command_index.nodes[parent].word);
+        if (distance == 0) {
+            return;
+        }
+        int child = command_index.nodes[parent].first_child;
+        while ((child != -1) && (command_index.nodes[child].distance != distance)) {
+            child = command_index.nodes[child].next_sibling;
+        }
+        if (child == -1) {
+            break;
+        }
+        parent = child;
+    }
+    if (command_index.node_count == command_index.node_capacity) {
+        command_index.node_capacity = command_index.node_capacity 
+                                      ? command_index.node_capacity * 2 : 1024;
+        command_index.nodes = realloc(command_index.nodes, 
+                                      command_index.node_capacity * sizeof(struct bk_node));
+    }
+    int node = command_index.node_count++;
+    command_index.nodes[node].word = strdup(word);
+    command_index.nodes[node].distance = distance;
+    command_index.nodes[node].max_child_distance = 0;
+    command_index.nodes[node].first_child = -1;
+    command_index.nodes[node].child_count = 0;
+    command_index.nodes[node].next_sibling = -1;
+    if (parent != -1) {
+        command_index.nodes[node].next_sibling = command_index.nodes[parent].first_child;
+        command_index.nodes[parent].first_child = node;
+        if (distance > command_index.nodes[parent].max_child_distance) {
+            command_index.nodes[parent].max_child_distance = distance;
+        }
+    }
+}
+
+/******************************************************************************
+Free command_index.
+******************************************************************************/
+void command_index_free() {
+    if (!command_index.words) {
+        for (int i = 0; i < command_index.node_count; i++) {
+            free(command_index.nodes[i].word);
+        }
+    }
+    free(command_index.words);
+    free(command_index.nodes);
+    free(command_index.path_env);
+    free(command_index.dir_mtimes);
+    memset(&command_index, 0, sizeof(command_index));
+}
+
+/******************************************************************************
+FNV-1a hash of a string, used by the open addressing hash tables.
+******************************************************************************/
+uint32_t hash_string(char *str) {
+    uint32_t hash = 2166136261u;
+    for (char *c = str; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash;
+}
+
+/******************************************************************************
+Find the hash table slot for name in shell_vars: either the slot holding the
+variable, or the empty slot where it should be inserted.
+******************************************************************************/
+struct shell_var *var_lookup(char *name) {
+    if (shell_vars.capacity == 0) {
+        var_grow();
+    }
+    size_t index = hash_string(name) & (shell_vars.capacity - 1);
+    while (shell_vars.entries[index].name 
+               && strcmp(shell_vars.entries[index].name, name)) {
+        index = (index + 1) & (shell_vars.capacity - 1);
+    }
+    return &shell_vars.entries[index];
+}
+
+/******************************************************************************
+Double the size of the shell_vars hash table and rehash its entries.
+******************************************************************************/
+void var_grow() {
+    struct shell_var *old_entries = shell_vars.entries;
+    size_t old_capacity = shell_vars.capacity;
+    shell_vars.capacity = old_capacity ? old_capacity * 2 : 64;
+    shell_vars.entries = calloc(shell_vars.capacity, sizeof(struct shell_var));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].name) {
+            *var_lookup(old_entries[i].name) = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+/******************************************************************************
+Return the variable called name, creating it (a scalar with no value) if it 
+does not exist yet. Creating a variable can move the others, so pointers to
+variables are only good until the next var_create.
+******************************************************************************/
+struct shell_var *var_create(char *name) {
+    struct shell_var *var = var_lookup(name);
+    if (var->name) {
+        return var;
+    }
+    var->name = strdup(name);
+    shell_vars.count++;
+    if (shell_vars.count * 2 > shell_vars.capacity) {
+        var_grow();
+        var = var_lookup(name);
+    }
+    return var;
+}
+
+/******************************************************************************
+Free the value or elements of a variable, leaving it a scalar with no value.
+******************************************************************************/
+void var_clear(struct shell_var *var) {
+    free(var->value);
+    for (int i = 0; i < var->element_count; i++) {
+        free_element(var, var->elements[i]);
+    }
+    free(var->elements);
+    for (size_t i = 0; i < var->assoc_capacity; i++) {
+        free(var->assoc[i].key);
+        free(var->assoc[i].value);
+    }
+    free(var->assoc);
+    free(var->storage);
+    char *name = var->name;
+    memset(var, 0, sizeof(struct shell_var));
+    var->name = name;
+}
+
+/******************************************************************************
+Free an array element, unless it points into the block mapfile read it into.
+******************************************************************************/
+void free_element(struct shell_var *var, char *element) {
+    if (!var->storage || (element < var->storage) 
+            || (element >= var->storage + var->storage_len)) {
+        free(element);
+    }
+}
+
+/******************************************************************************
+Return the variable called name with no value, creating it if needed.
+******************************************************************************/
+struct shell_var *var_reset(char *name) {
+    struct shell_var *var = var_create(name);
+    var_clear(var);
+    return var;
+}
+
+/******************************************************************************
+Set a shell variable to a copy of value.
+******************************************************************************/
+void set_var(char *name, char *value) {
+    var_reset(name)->value = strdup(value);
+}
+
+/******************************************************************************
+Make a shell variable an indexed array. Takes ownership of elements and of
+each string in it.
+******************************************************************************/
+void set_var_array(char *name, char **elements, int element_count) {
+    struct shell_var *var = var_reset(name);
+    var->type = VAR_INDEXED;
+    var->elements = elements;
+    var->element_count = element_count;
+    var->element_capacity = element_count;
+}
+
+/******************************************************************************
+Return the value of a shell variable (element 0 of an array), falling back
+to the environment. Returns NULL if name is not set.
+******************************************************************************/
+char *get_var(char *name) {
+    struct shell_var *var = var_lookup(name);
+    if (!var->name) {
+        return getenv(name);
+    }
+    if (var->type == VAR_SCALAR) {
+        return var->value;
+    }
+    return get_element(var, "0");
+}
+
+/******************************************************************************
+Convert a scalar variable to an indexed array, its value becoming element 0.
+******************************************************************************/
+void var_make_indexed(struct shell_var *var) {
+    if (var->type != VAR_SCALAR) {
+        return;
+    }
+    char *value = var->value;
+    var->value = NULL;
+    var->type = VAR_INDEXED;
+    if (value) {
+        set_index(var, 0, value, false);
+        free(value);
+    }
+}
+
+/******************************************************************************
+Turn an array subscript into an index. The subscript is a number, or the name
+of a variable holding one; a negative index counts back from the end.
+Returns: the index, or -1 if it is out of range
+******************************************************************************/
+long array_index(struct shell_var *var, char *subscript) {
+    char *end;
+    long index = strtol(subscript, &end, 10);
+    if ((end == subscript) && var_name_length(subscript)) {
+        char *value = get_var(subscript);
+        index = value ? strtol(value, NULL, 10) : 0;
+    }
+    if (index < 0) {
+        index += var->element_count;
+    }
+    return (index < 0) ? -1 : index;
+}
+
+/******************************************************************************
+Set element index of an indexed array to a copy of value, or append value to
+the element. Indexes past the end are added, with unset elements in between.
+******************************************************************************/
+void set_index(struct shell_var *var, long index, char *value, bool append) {
+    if (index >= var->element_capacity) {
+        int capacity = var->element_capacity ? var->element_capacity : 8;
+        while (capacity <= index) {
+            capacity *= 2;
+        }
+        var->elements = realloc(var->elements, capacity * sizeof(char *));
+        var->element_capacity = capacity;
+    }
+    while (var->element_count <= index) {
+        var->elements[var->element_count++] = NULL;
+    }
+    char *old = var->elements[index];
+    var->elements[index] = append_value(append ? old : NULL, value);
+    free_element(var, old);
+}
+
+/******************************************************************************
+Returns a new string: old (if not NULL) followed by value.
+******************************************************************************/
+char *append_value(char *old, char *value) {
+    if (!old) {
+        return strdup(value);
+    }
+    char *joined = malloc(strlen(old) + strlen(value) + 1);
+    strcpy(joined, old);
+    strcat(joined, value);
+    return joined;
+}
+
+/******************************************************************************
+Find the slot for key in an associative array (open addressing with linear
+probing): either the slot holding key, or the empty slot where it should go.
+******************************************************************************/
+struct assoc_entry *assoc_lookup(struct shell_var *var, char *key) {
+    if (var->assoc_capacity == 0) {
+        assoc_grow(var);
+    }
+    size_t index = hash_string(key) & (var->assoc_capacity - 1);
+    while (var->assoc[index].key && strcmp(var->assoc[index].key, key)) {
+        index = (index + 1) & (var->assoc_capacity - 1);
+    }
+    return &var->assoc[index];
+}
+
+/******************************************************************************
+Double the size of an associative array's hash table and rehash its entries.
+******************************************************************************/
+void assoc_grow(struct shell_var *var) {
+    struct assoc_entry *old_entries = var->assoc;
+    size_t old_capacity = var->assoc_capacity;
+    var->assoc_capacity = old_capacity ? old_capacity * 2 : 16;
+    var->assoc = calloc(var->assoc_capacity, sizeof(struct assoc_entry));
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old_entries[i].key) {
+            *assoc_lookup(var, old_entries[i].key) = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+/******************************************************************************
+Set key of an associative array to a copy of value, or append value to it.
+******************************************************************************/
+void assoc_set(struct shell_var *var, char *key, char *value, bool append) {
+    struct assoc_entry *entry = assoc_lookup(var, key);
+    if (!entry->key) {
+        entry->key = strdup(key);
+        var->assoc_count++;
+        if (var->assoc_count * 2 > var->assoc_capacity) {
+            assoc_grow(var);
+            entry = assoc_lookup(var, key);
+        }
+    }
+    char *old = entry->value;
+    entry->value = append_value(append ? old : NULL, value);
+    free(old);
+}
+
+/******************************************************************************
+Return an element of an array variable (or subscript 0 of a scalar), NULL if
+it is not set.
+******************************************************************************/
+char *get_element(struct shell_var *var, char *subscript) {
+    if (!var->name) {
+        return NULL;
+    }
+    if (var->type == VAR_ASSOC) {
+        return var->assoc_capacity ? assoc_lookup(var, subscript)->value : NULL;
+    }
+    long index = array_index(var, subscript);
+    if (var->type == VAR_SCALAR) {
+        return (index == 0) ? var->value : NULL;
+    }
+    return ((index >= 0) && (index < var->element_count)) ? var->elements[index] : NULL;
+}
+
+/******************************************************************************
+Returns the number of set elements of a variable (1 for a set scalar).
+******************************************************************************/
+int var_element_count(struct shell_var *var) {
+    int count = 0;
+    if (!var->name) {
+        return 0;
+    }
+    if (var->type == VAR_ASSOC) {
+        return var->assoc_count;
+    }
+    if (var->type == VAR_SCALAR) {
+        return var->value ? 1 : 0;
+    }
+    for (int i = 0; i < var->element_count; i++) {
+        count += var->elements[i] ? 1 : 0;
+    }
+    return count;
+}
+
+/******************************************************************************
+Add the set elements of a variable (or their indexes/keys if keys is true) to
+an allocated array of values.
+******************************************************************************/
+void var_all_values(struct shell_var *var, bool keys, char ***values, int *value_count) {
+    char index[32];
+    if (!var->name) {
+        return;
+    }
+    if ((var->type == VAR_SCALAR) && var->value) {
+        add_value(values, value_count, keys ? "0" : var->value);
+    }
+    for (int i = 0; i < var->element_count; i++) {
+        if (var->elements[i]) {
+            sprintf(index, "%d", i);
+            add_value(values, value_count, keys ? index : var->elements[i]);
+        }
+    }
+    for (size_t i = 0; i < var->assoc_capacity; i++) {
+        if (var->assoc[i].key) {
+            add_value(values, value_count, 
+                      keys ? var->assoc[i].key : var->assoc[i].value);
+        }
+    }
+}
+
+/******************************************************************************
+Run the assignments of an assignment line, in order:
+- NAME=VALUE sets a scalar (element 0 of an indexed array, key 0 of an
+  associative array)
+- NAME[SUBSCRIPT]=VALUE sets one element, making NAME an indexed array unless
+  it was declared associative with declare -A
+- NAME=(VALUE...) replaces the elements; [KEY]=VALUE elements set that index
+  or key (they are required for an associative array)
+- += appends to the value, or adds elements to the end of the array
+******************************************************************************/
+void run_assignments(struct command_line *command_line) {
+    for (int i = 0; i < command_line->assignment_count; i++) {
+        struct assignment *assignment = &command_line->assignments[i];
+        struct shell_var *var = var_create(assignment->name);
+        bool append = assignment->append;
+        if (assignment->is_list) {
+            enum var_type type = (var->type == VAR_ASSOC) ? VAR_ASSOC : VAR_INDEXED;
+            if (!append) {
+                var_clear(var);
+            }
+            var_make_indexed(var);
+            var->type = type;
+            long index = var->element_count;
+            for (int j = 0; j < assignment->value_count; j++) {
+                char *key = assignment->keys[j];
+                char *value = assignment->values[j];
+                if (type == VAR_ASSOC) {
+                    if (key) {
+                        assoc_set(var, key, value, false);
+                    } else {
+                        fprintf(stderr, "%s: %s: must use subscript when "
+                                "assigning associative array\n", var->name, value);
+                    }
+                    continue;
+                }
+                if (key) {
+                    index = array_index(var, key);
+                }
+                if (index < 0) {
+                    fprintf(stderr, "%s[%s]: bad array subscript\n", var->name, key);
+                    break;
+                }
+                set_index(var, index++, value, false);
+            }
+        }
+        else if (assignment->subscript && (var->type == VAR_ASSOC)) {
+            assoc_set(var, assignment->subscript, assignment->values[0], append);
+        }
+        else if (assignment->subscript) {
+            var_make_indexed(var);
+            long index = array_index(var, assignment->subscript);
+            if (index < 0) {
+                fprintf(stderr, "%s[%s]: bad array subscript\n", var->name, 
+                        assignment->subscript);
+                continue;
+            }
+            set_index(var, index, assignment->values[0], append);
+        }
+        else if (var->type == VAR_ASSOC) {
+            assoc_set(var, "0", assignment->values[0], append);
+        }
+        else if (var->type == VAR_INDEXED) {
+            set_index(var, 0, assignment->values[0], append);
+        }
+        else {
+            char *old = var->value;
+            var->value = append_value(append ? old : NULL, assignment->values[0]);
+            free(old);
+        }
+    }
+}
+
+/******************************************************************************
+Returns the length of the variable name at the start of str (a letter or _
+followed by letters, digits and _), 0 if str does not start with one.
+******************************************************************************/
+size_t var_name_length(char *str) {
+    if (!isalpha((unsigned char)str[0]) && (str[0] != '_')) {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char)str[len]) || (str[len] == '_')) {
+        len++;
+    }
+    return len;
+}
+
+/******************************************************************************
+If input_file specified in command_line, open file and use dup2() for input
+redirection.
+If command is to run in background and a file is not specified, redirect input
+to /dev/null per assignment description.
+If error, exit with exit(1) to communicate to parent process that there was an
+error.
+Code for error handling modified from course exploration Processes and I/O.
+******************************************************************************/
+void input_redirect(struct command_line *command_line, int *status) {
+    if (command_line->input_file) {
+        // open input file
+        int input_fd = open(command_line->input_file, O_RDONLY);
+        if (input_fd == -1) {
+            printf("cannot open %s for input\n", command_line->input_file);
+            // perror("source open()");
+            fflush(stdout);
+            exit(1);
+        }
+        // redirect stdin to input file
+        int result = dup2(input_fd, 0);
+        if (result == -1) {
+            printf("error redirecting stdin to input file\n");
+            // perror("source dup2()");
+            fflush(stdout);
+            exit(1);
+        }
+    }
+    if (command_line->run_in_background & !command_line->input_file) 
+    {
+        int input_fd = open("/dev/null", O_RDONLY);
+        if (input_fd == -1) {
+            printf("cannot open /dev/null for input\n");
+            // perror("source open()");
+            fflush(stdout);
+            exit(1);
+        }
+        int result = dup2(input_fd, 0);
+        if (result == -1) {
+            printf("error redirecting stdin to /dev/null\n");
+            // perror("source dup2()");
+            fflush(stdout);
+            exit(1);
+        }
+    }
+}
+
+/******************************************************************************
+If output_file specified in command_line, open file and use dup2() for output
+redirection.
+If command is to run in background and a file is not specified, redirect output
+to /dev/null per assignment description.
+If the background output is being streamed (bgstream), stderr and any stdout
+that is not going to a file are sent to the stream pipe instead.
+If error, exit with exit(1) to communicate to parent process that there was an
+error.
+Code for error handling modified from exploration Processes and I/O.
+******************************************************************************/
+void output_redirect(struct command_line *command_line, int *status) {
+    if (command_line->output_file) {
+        // open output file
+        int output_fd = open(command_line->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output_fd == -1) {
+            printf("cannot open %s for output\n", command_line->output_file);
+            fflush(stdout);
+            // perror("target open()");
+            exit(1);
+        }
+        // redirect stdout to output file
+        int result = dup2(output_fd, 1);
+        if (result == -1) {
+            printf("error redirecting stdout to output file\n");
+            fflush(stdout);
+            // perror("target dup2()");
+            exit(1);
+        }
+    }
+    if (command_line->stream_fd != -1) {
+        if ((!command_line->output_file && (dup2(command_line->stream_fd, 1) == -1))
+                || (dup2(command_line->stream_fd, 2) == -1)) {
+            printf("error redirecting output to stream\n");
+            fflush(stdout);
+            exit(1);
+        }
+    }
+    else if (command_line->run_in_background & !command_line->output_file) 
+    {
+        int output_fd = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (output_fd == -1) {
+            printf("cannot open /dev/null for output\n");
+            fflush(stdout);
+            // perror("target open()");
+            exit(1);
+        }
+        int result = dup2(output_fd, 1);
+        if (result == -1) {
+            printf("error redirecting stdout to /dev/null\n");
+            fflush(stdout);
+            // perror("target dup2()");
+            exit(1);
+        }
+    }
+}
+
+/******************************************************************************
+Sets SIG_IGN as the hander for SIGINT so that SIGINT is ignored.
+Code to setup SIG_IGN adapted from course exploration example in Signal
+Handling API.
+******************************************************************************/
+void ignore_SIGINT() {
+    // Initialize ignore_action struct to be empty
+    struct sigaction ignore_action = {{0}};
+    // Assign signal handerl SIG_IGN to ignore_action struct
+    ignore_action.sa_handler = SIG_IGN;
+    // Reigster ignore_action as the signal handler for SIGINT
+    sigaction(SIGINT, &ignore_action, NULL);
+}
+
+/******************************************************************************
+Sets SIG_DFL as the hander for SIGINT so that SIGINT is no longer ignored.
+******************************************************************************/
+void restore_SIGINT() {
+    // Initialize restore_action struct to be empty
+    struct sigaction restore_action = {{0}};
+    // Assign signal handerl SIG_DFL to restore_action struct
+    restore_action.sa_handler = SIG_DFL;
+    // Reigster restore_action as the signal handler for SIGINT
+    sigaction(SIGINT, &restore_action, NULL);
+}
+
+/******************************************************************************
+Function that handles SIGTSTP.
+Parent process SIGTSTP handling: signals shell to display message and enter or
+exit a state where subsequent commands can no longer be run in the background.
+(The & operator is ignored in this state and commands are run as foreground
+processes.)
+Switches foreground-only mode on and off and
+prints message to user about entering/exiting foreground-only mode.
+Uses global variable to switch on/off.
+******************************************************************************/
+void handle_SIGTSTP(int signo) {
+    // char *message = ("Caught SIGTSTP\n");
+    // write(STDOUT_FILENO, message, 15);
+    if (foreground_only) {
+        char *message2 = "\nExiting foreground-only mode\n: ";
+        write(STDOUT_FILENO, message2, 32);
+        fflush(stdout);
+        foreground_only = 0; // foreground only mode = off/false
+    } else {
+        char *message3 = "\nEntering foreground-only mode (& is now ignored)\n: ";
+        write(STDOUT_FILENO, message3, 53);
+        fflush(stdout);
+        foreground_only = 1; // foreground only mode = on/true
+    }
+}
+
+/******************************************************************************
+Initialize SIGTSTP_action struct and assign struct members
+Code adapted from course exploration Signal Handling API
+******************************************************************************/
+void signal_handling() {
+    // Initialize SIGTSTP_action to be empty
+    struct sigaction SIGTSTP_action = {{0}};
+    // Register handle_SIGSTP as the signal handelr
+    SIGTSTP_action.sa_handler = handle_SIGTSTP;
+    // Block all catchable signals whiel handle_SIGTSTP is running
+    sigfillset(&SIGTSTP_action.sa_mask);
+    // use SA_RESTART flag to cause an automatic restart of the interuppted 
+    // system call/library function after the signal handler is done (getline()
+    // returns an error if its interuppted by a signal, use SA_RESTART to 
+    // restart the getlien() process)
+    SIGTSTP_action.sa_flags = SA_RESTART;
+    // Install the signal handler
+    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+}
+
+/******************************************************************************
+Child foreground and background processes ignore SIGTSTP.
+Sets SIG_IGN as the hander for SIGTSTP so that SIGTSTP is ignored.
+Code to setup SIG_IGN adapted from course exploration example in Signal
+Handling API.
+******************************************************************************/
+void ignore_SIGTSTP() {
+    // Initialize ignore_action struct to be empty
+    struct sigaction ignore_action = {{0}};
+    // Assign signal handerl SIG_IGN to ignore_action struct
+    ignore_action.sa_handler = SIG_IGN;
+    // Reigster ignore_action as the signal handler for SIGTSTP
+    sigaction(SIGTSTP, &ignore_action, NULL);
+}
+
+/******************************************************************************
+Iterate through all of the PIDs in the background processes array and
+1. kill the process
+2. call waitpid() on the PID to clear it, no zombies today please
+******************************************************************************/
+void kill_children(struct job_table *jobs) {
+    int child_status;
+    int pid_check;
+    for (int i = 0; i < jobs->count; i++) {
+        free_supervisor(jobs->procs[i].supervisor);
+        if (jobs->procs[i].pid == 0) {
+            // supervised job waiting to be restarted, kill(0) would kill us
+            free(jobs->procs[i].command_str);
+            continue;
+        }
+        kill(jobs->procs[i].pid, SIGKILL);
+        pid_check = waitpid(jobs->procs[i].pid, &child_status, WNOHANG);
+        free(jobs->procs[i].command_str);
+        // printf("Killed child process %d\n", pid_check);
+        // if(WIFEXITED(child_status)) {
+        //     printf("background pid %d is done: exit value %d\n", pid_check, WEXITSTATUS(child_status));
+        // } else {
+        //     printf("background pid %d is done: terminated by signal %d\n", pid_check, WTERMSIG(child_status));
+        // }
+    }
+}
+
+/******************************************************************************
+Join the args of a parsed command line, starting at index start, back into a
+single command line string. Input and output redirection are appended so that
+the string can be parsed again later.
+Returns: allocated string, caller frees
+******************************************************************************/
+char *join_command_args(struct command_line *command_line, int start) {
+    char *command_str = NULL;
+    size_t len = 0;
+    FILE *stream = open_memstream(&command_str, &len);
+    // args may already be NULL terminated for execvp
+    for (int i = start; (i < command_line->args_count) && command_line->args[i]; i++) {
+        if (i > start) {
+            fputc(' ', stream);
+        }
+        write_quoted(command_line->args[i], stream);
+    }
+    if (command_line->input_file) {
+        fputs(" < ", stream);
+        write_quoted(command_line->input_file, stream);
+    }
+    if (command_line->output_file) {
+        fputs(" > ", stream);
+        write_quoted(command_line->output_file, stream);
+    }
+    fclose(stream);
+    return command_str;
+}
+
+/******************************************************************************
+Write a word so that parsing it again gives back the same word: in '...' 
+quotes if it is empty or has spaces, quotes, $ or special symbols (a ' itself
+is written as "'").
+******************************************************************************/
+void write_quoted(char *word, FILE *stream) {
+    if (word[0] && !word[strcspn(word, " \t'\"$|<>&")]) {
+        fputs(word, stream);
+        return;
+    }
+    fputc('\'', stream);
+    for (char *c = word; *c; c++) {
+        if (*c == '\'') {
+            fputs("'\"'\"'", stream);
+        } else {
+            fputc(*c, stream);
+        }
+    }
+    fputc('\'', stream);
+}
+
+/******************************************************************************
+Parse a duration of the form N[smhd] (seconds if no unit is given).
+Returns true and stores the number of seconds on success.
+******************************************************************************/
+bool parse_duration(char *str, long *seconds) {
+    char *end;
+    long value = strtol(str, &end, 10);
+    if ((end == str) || (value < 0)) {
+        return false;
+    }
+    switch (*end) {
+        case '\0':
+        case 's':
+            break;
+        case 'm':
+            value *= 60;
+            break;
+        case 'h':
+            value *= 60 * 60;
+            break;
+        case 'd':
+            value *= 24 * 60 * 60;
+            break;
+        default:
+            return false;
+    }
+    if ((*end != '\0') && (end[1] != '\0')) {
+        return false;
+    }
+    *seconds = value;
+    return true;
+}
+
+/******************************************************************************
+Parse the TIME argument of the "at" command into an absolute deadline:
+    +N[smhd]    N seconds/minutes/hours/days from now
+    HH:MM[:SS]  next occurrence of that local time (today or tomorrow)
+    @EPOCH      seconds since the epoch
+Returns true and stores the deadline on success.
+******************************************************************************/
+bool parse_at_time(char *str, time_t *deadline) {
+    time_t now = time(NULL);
+    if (str[0] == '+') {
+        long seconds;
+        if (!parse_duration(str + 1, &seconds)) {
+            return false;
+        }
+        *deadline = now + seconds;
+        return true;
+    }
+    if (str[0] == '@') {
+        char *end;
+        long epoch = strtol(str + 1, &end, 10);
+        if ((end == str + 1) || (*end != '\0')) {
+            return false;
+        }
+        *deadline = epoch;
+        return true;
+    }
+    int hour, minute, second = 0;
+    char extra;
+    int fields = sscanf(str, "%d:%d:%d%c", &hour, &minute, &second, &extra);
+    if ((fields < 2) || (fields > 3) || (hour < 0) || (hour > 23) 
+            || (minute < 0) || (minute > 59) || (second < 0) || (second > 59)) {
+        return false;
+    }
+    struct tm when;
+    localtime_r(&now, &when);
+    when.tm_hour = hour;
+    when.tm_min = minute;
+    when.tm_sec = second;
+    when.tm_isdst = -1;
+    *deadline = mktime(&when);
+    if (*deadline <= now) {
+        // time already passed today, run tomorrow (mktime normalizes the day)
+        when.tm_mday += 1;
+        when.tm_isdst = -1;
+        *deadline = mktime(&when);
+    }
+    return true;
+}
+
+/******************************************************************************
+Create a scheduled command from the args of command_line starting at index 
+start and add it to the scheduler heap.
+Parameters: parsed "at"/"every" command line, index of the command to run,
+            first deadline, interval (0 for one-shot), overlap policy,
+            stream for messages
+******************************************************************************/
+void schedule_command(struct command_line *command_line, int start,
+                      time_t deadline, long interval, bool queue_overlaps,
+                      FILE *out)
 {
-    int child_status;
-    pid_t spawn_pid = fork();
+    if (!strcmp(command_line->args[start], "exit")) {
+        fprintf(stderr, "cannot schedule exit\n");
+        return;
+    }
+    struct scheduled_command *entry = calloc(1, sizeof(struct scheduled_command));
+    entry->id = sched_next_id++;
+    entry->command_str = join_command_args(command_line, start);
+    entry->deadline = deadline;
+    entry->interval = interval;
+    entry->queue_overlaps = queue_overlaps;
+    sched_heap_push(entry);
+    sched_rearm_timer();
+    fprintf(out, "scheduled command %d\n", entry->id);
+}
+
+/******************************************************************************
+Compare two scheduled commands by deadline (then id) for qsort.
+******************************************************************************/
+int compare_scheduled_commands(const void *a, const void *b) {
+    const struct scheduled_command *x = *(struct scheduled_command * const *)a;
+    const struct scheduled_command *y = *(struct scheduled_command * const *)b;
+    if (x->deadline != y->deadline) {
+        return (x->deadline < y->deadline) ? -1 : 1;
+    }
+    return x->id - y->id;
+}
+
+/******************************************************************************
+Handle the "sched" built in command.
+    sched               list scheduled commands in deadline order
+    sched cancel ID...  remove scheduled commands (running jobs keep running)
+******************************************************************************/
+int sched_command(struct command_line *command_line, FILE *in, FILE *out,
+                  int *status, struct job_table *jobs)
+{
+    int i, j;
+    if (command_line->args_count == 1) {
+        struct scheduled_command **sorted = malloc((sched_count + 1) * sizeof(*sorted));
+        memcpy(sorted, sched_heap, sched_count * sizeof(*sorted));
+        qsort(sorted, sched_count, sizeof(*sorted), compare_scheduled_commands);
+        fprintf(out, "%-4s %-19s %-8s %-6s %5s %7s  %s\n", "ID", "NEXT RUN", 
+                "EVERY", "POLICY", "RUNS", "SKIPPED", "COMMAND");
+        for (i = 0; i < sched_count; i++) {
+            if (sorted[i]->restart_job_id) {
+                // restarts are listed by "jobs"
+                continue;
+            }
+            char next_run[32];
+            char every[24] = "-";
+            struct tm when;
+            localtime_r(&sorted[i]->deadline, &when);
+            strftime(next_run, sizeof(next_run), "%Y-%m-%d %H:%M:%S", &when);
+            if (sorted[i]->interval) {
+                sprintf(every, "%lds", sorted[i]->interval);
+            }
+            fprintf(out, "%-4d %-19s %-8s %-6s %5d %7d  %s", sorted[i]->id, 
+                    next_run, every, !sorted[i]->interval ? "-" 
+                           : (sorted[i]->queue_overlaps ? "queue" : "skip"),
+                    sorted[i]->run_count, sorted[i]->skipped_count, 
+                    sorted[i]->command_str);
+            if (sorted[i]->running_pid) {
+                fprintf(out, " (running pid %d", sorted[i]->running_pid);
+                if (sorted[i]->queued_runs) {
+                    fprintf(out, ", %d queued", sorted[i]->queued_runs);
+                }
+                fprintf(out, ")");
+            }
+            fprintf(out, "\n");
+        }
+        free(sorted);
+        return 0;
+    } else if (!strcmp(command_line->args[1], "cancel") 
+                   && (command_line->args_count > 2)) {
+        if (pipeline_stage_thread) {
+            // like a subshell, a pipeline stage can't change shell state
+            fprintf(stderr, "sched: cannot cancel inside a pipeline\n");
+            return 1;
+        }
+        for (j = 2; j < command_line->args_count; j++) {
+            int id = atoi(command_line->args[j]);
+            for (i = 0; i < sched_count; i++) {
+                if ((sched_heap[i]->id == id) && !sched_heap[i]->restart_job_id) {
+                    break;
+                }
+            }
+            if (i == sched_count) {
+                fprintf(stderr, "sched: no scheduled command %s\n", command_line->args[j]);
+                continue;
+            }
+            struct scheduled_command *entry = sched_heap_remove(i);
+            free(entry->command_str);
+            free(entry);
+        }
+        sched_rearm_timer();
+        return 0;
+    }
+    fprintf(stderr, "usage: sched [cancel ID...]\n");
+    return 1;
+}
+
+/******************************************************************************
+Add an entry to the scheduler min-heap, growing the heap array as needed.
+******************************************************************************/
+void sched_heap_push(struct scheduled_command *entry) {
+    if (sched_count == sched_capacity) {
+        sched_capacity = sched_capacity ? sched_capacity * 2 : 16;
+        sched_heap = realloc(sched_heap, sched_capacity * sizeof(*sched_heap));
+    }
+    entry->heap_index = sched_count;
+    sched_heap[sched_count++] = entry;
+    sched_sift_up(entry->heap_index);
+}
+
+/******************************************************************************
+Remove and return the heap entry at index, restoring the heap property.
+******************************************************************************/
+struct scheduled_command *sched_heap_remove(int index) {
+    struct scheduled_command *entry = sched_heap[index];
+    sched_count--;
+    if (index != sched_count) {
+        sched_heap[index] = sched_heap[sched_count];
+        sched_heap[index]->heap_index = index;
+        sched_sift_down(index);
+        sched_sift_up(index);
+    }
+    return entry;
+}
+
+/******************************************************************************
+Move the heap entry at index up until its parent has an earlier deadline.
+******************************************************************************/
+void sched_sift_up(int index) {
+    while (index > 0) {
+        int parent = (index - 1) / 2;
+        if (sched_heap[parent]->deadline <= sched_heap[index]->deadline) {
+            break;
+        }
+        sched_swap(index, parent);
+        index = parent;
+    }
+}
+
+/******************************************************************************
+Move the heap entry at index down until both children have later deadlines.
+******************************************************************************/
+void sched_sift_down(int index) {
+    while (true) {
+        int smallest = index;
+        int left = 2 * index + 1;
+        int right = left + 1;
+        if ((left < sched_count) 
+                && (sched_heap[left]->deadline < sched_heap[smallest]->deadline)) {
+            smallest = left;
+        }
+        if ((right < sched_count) 
+                && (sched_heap[right]->deadline < sched_heap[smallest]->deadline)) {
+            smallest = right;
+        }
+        if (smallest == index) {
+            break;
+        }
+        sched_swap(index, smallest);
+        index = smallest;
+    }
+}
+
+/******************************************************************************
+Swap two heap entries and update their stored heap positions.
+******************************************************************************/
+void sched_swap(int i, int j) {
+    struct scheduled_command *temp = sched_heap[i];
+    sched_heap[i] = sched_heap[j];
+    sched_heap[j] = temp;
+    sched_heap[i]->heap_index = i;
+    sched_heap[j]->heap_index = j;
+}
+
+/******************************************************************************
+Arm the scheduler timerfd for the earliest deadline in the heap, or disarm it
+if nothing is scheduled. The timerfd is created the first time it is needed.
+https://man7.org/linux/man-pages/man2/timerfd_create.2.html
+******************************************************************************/
+void sched_rearm_timer() {
+    struct itimerspec timer_value = {{0}};
+    if (sched_timer_fd == -1) {
+        if (sched_count == 0) {
+            return;
+        }
+        sched_timer_fd = move_shell_fd(timerfd_create(CLOCK_REALTIME, 
+                                                      TFD_NONBLOCK | TFD_CLOEXEC));
+        if (sched_timer_fd == -1) {
+            perror("timerfd_create");
+            return;
+        }
+    }
+    if (sched_count > 0) {
+        // a deadline already in the past makes the timer fire immediately
+        timer_value.it_value.tv_sec = sched_heap[0]->deadline;
+    }
+    timerfd_settime(sched_timer_fd, TFD_TIMER_ABSTIME, &timer_value, NULL);
+}
+
+/******************************************************************************
+Returns true if the earliest scheduled command is due to run.
+******************************************************************************/
+bool sched_due() {
+    // time() may use a coarse clock that lags the timerfd, ask for the
+    // precise time instead
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (sched_count > 0) && (sched_heap[0]->deadline <= now.tv_sec);
+}
+
+/******************************************************************************
+Wait at an interactive prompt for a line of input, the scheduler timer, 
+streamed background output, a supervised job exiting, or a prompt segment 
+refresh finishing or timing out, and return which one is ready (input first).
+If stdin is not a terminal, or there is nothing else to wait for, returns 
+PROMPT_INPUT right away; scheduled commands and streamed output are then 
+handled between command lines.
+******************************************************************************/
+enum prompt_event wait_for_input() {
+    bool timer = (sched_timer_fd != -1) && (sched_count > 0);
+    bool output = (output_epoll_fd != -1) && (output_stream_count > 0);
+    bool segments = (prompt_refresh_count > 0);
+    bool children = (supervise_watch_count > 0);
+    if ((!timer && !output && !segments && !children) || !isatty(STDIN_FILENO)) {
+        return PROMPT_INPUT;
+    }
+    struct pollfd fds[5] = {{STDIN_FILENO, POLLIN, 0}, 
+                            {timer ? sched_timer_fd : -1, POLLIN, 0},
+                            {output ? output_epoll_fd : -1, POLLIN, 0},
+                            {segments ? prompt_epoll_fd : -1, POLLIN, 0},
+                            {children ? supervise_epoll_fd : -1, POLLIN, 0}};
+    // SIGTSTP interrupts poll(), just go back to waiting. Wake up when the
+    // next prompt segment refresh times out
+    while (poll(fds, 5, prompt_timeout_ms()) == -1) {
+        if (errno != EINTR) {
+            return PROMPT_INPUT;
+        }
+    }
+    if (fds[0].revents) {
+        return PROMPT_INPUT;
+    }
+    if (fds[1].revents) {
+        uint64_t expirations;
+        read(sched_timer_fd, &expirations, sizeof(expirations));
+        return PROMPT_TIMER;
+    }
+    if (fds[2].revents) {
+        return PROMPT_OUTPUT;
+    }
+    if (fds[4].revents) {
+        return PROMPT_CHILD;
+    }
+    return PROMPT_SEGMENT;
+}
+
+/******************************************************************************
+Run every scheduled command whose deadline has passed.
+Periodic commands are rescheduled on absolute deadlines (deadline + interval)
+so they do not drift. Deadlines missed while the shell was busy are counted as
+skipped rather than run back to back. If the previous run of a periodic 
+command is still going, the new run is skipped or queued per its policy.
+******************************************************************************/
+void run_scheduled_commands(int *status, struct job_table *jobs) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    while (sched_due()) {
+        struct scheduled_command *entry = sched_heap[0];
+        // the previous run may have exited without being reaped yet, peek at
+        // it with WNOWAIT so check_background_procs can still report it
+        siginfo_t info = {0};
+        if (entry->running_pid 
+                && (waitid(P_PID, entry->running_pid, &info, 
+                           WEXITED | WNOHANG | WNOWAIT) == 0)
+                && (info.si_pid == entry->running_pid)) {
+            entry->running_pid = 0;
+        }
+        if (entry->running_pid) {
+            if (entry->queue_overlaps) {
+                entry->queued_runs++;
+            } else {
+                entry->skipped_count++;
+            }
+        } else {
+            launch_scheduled_command(entry, status, jobs);
+        }
+        if (entry->interval == 0) {
+            // one-shot "at" command is done
+            sched_heap_remove(0);
+            free(entry->command_str);
+            free(entry);
+            continue;
+        }
+        entry->deadline += entry->interval;
+        if (entry->deadline <= now.tv_sec) {
+            long missed = (now.tv_sec - entry->deadline) / entry->interval + 1;
+            entry->skipped_count += missed;
+            entry->deadline += missed * entry->interval;
+        }
+        sched_sift_down(0);
+    }
+    sched_rearm_timer();
+}
+
+/******************************************************************************
+Parse and run a scheduled command as a background process (scheduled commands
+always run in the background, even in foreground-only mode), and remember its
+PID so overlapping runs can be detected. Entries made by supervise restart 
+their job instead.
+******************************************************************************/
+void launch_scheduled_command(struct scheduled_command *entry, int *status,
+                              struct job_table *jobs)
+{
+    if (entry->restart_job_id) {
+        restart_supervised_job(entry->restart_job_id, status, jobs);
+        return;
+    }
+    char *command_line_str = strdup(entry->command_str);
+    struct command_line *command_line = parse_command_line(command_line_str);
+    int previous_count = jobs->count;
+    command_line->run_in_background = true;
+    handle_command_line(command_line, status, jobs);
+    if (jobs->count > previous_count) {
+        entry->running_pid = jobs->procs[jobs->count - 1].pid;
+    }
+    entry->run_count++;
+    free_memory(command_line);
+    free(command_line_str);
+}
+
+/******************************************************************************
+Called when a background process completes. Clears the running PID of the
+scheduled command that launched it and starts a queued run if there is one.
+******************************************************************************/
+void sched_job_done(pid_t pid, int *status, struct job_table *jobs) 
+{
+    int i;
+    for (i = 0; i < sched_count; i++) {
+        struct scheduled_command *entry = sched_heap[i];
+        if (entry->running_pid != pid) {
+            continue;
+        }
+        entry->running_pid = 0;
+        if (entry->queued_runs > 0) {
+            entry->queued_runs--;
+            launch_scheduled_command(entry, status, jobs);
+        }
+        break;
+    }
+}
+
+/******************************************************************************
+Free all scheduled commands and close the scheduler timer.
+******************************************************************************/
+void sched_free_all() {
+    int i;
+    for (i = 0; i < sched_count; i++) {
+        free(sched_heap[i]->command_str);
+        free(sched_heap[i]);
+    }
+    free(sched_heap);
+    sched_heap = NULL;
+    sched_count = 0;
+    if (sched_timer_fd != -1) {
+        close(sched_timer_fd);
+        sched_timer_fd = -1;
+    }
+}
+
+/******************************************************************************
+Handle the "set" built in command.
+    set             list shell options
+    set -o NAME     turn option on
+    set +o NAME     turn option off
+******************************************************************************/
+int set_command(struct command_line *command_line, FILE *in, FILE *out,
+                int *status, struct job_table *jobs)
+{
+    int i;
+    if ((command_line->args_count == 1) 
+            || ((command_line->args_count == 2) 
+                && !strcmp(command_line->args[1], "-o"))) {
+        for (i = 0; i < OPT_COUNT; i++) {
+            fprintf(out, "%-15s %s\n", shell_option_names[i], 
+                    shell_options[i] ? "on" : "off");
+        }
+        return 0;
+    }
+    if ((command_line->args_count == 3) 
+            && (!strcmp(command_line->args[1], "-o") 
+                || !strcmp(command_line->args[1], "+o"))) {
+        for (i = 0; i < OPT_COUNT; i++) {
+            if (!strcmp(command_line->args[2], shell_option_names[i])) {
+                shell_options[i] = (command_line->args[1][0] == '-');
+                return 0;
+            }
+        }
+        fprintf(stderr, "set: %s: invalid option name\n", command_line->args[2]);
+        return 1;
+    }
+    fprintf(stderr, "usage: set [-o|+o NAME]\n");
+    return 1;
+}
+
+/******************************************************************************
+Handle the "jobs" built in command: list the background processes in the job
+table with their job number, PID and command line. Supervised jobs also show
+their restart count and uptime, or when they will be restarted.
+******************************************************************************/
+int jobs_command(struct command_line *command_line, FILE *in, FILE *out,
+                 int *status, struct job_table *jobs)
+{
+    time_t now = time(NULL);
+    for (int i = 0; i < jobs->count; i++) {
+        struct supervisor *policy = jobs->procs[i].supervisor;
+        if (jobs->procs[i].pid == 0) {
+            fprintf(out, "[%d] -  Restarting  %s", jobs->procs[i].job_id, 
+                    jobs->procs[i].command_str);
+        } else {
+            fprintf(out, "[%d] %d  Running  %s", jobs->procs[i].job_id, 
+                    jobs->procs[i].pid, jobs->procs[i].command_str);
+        }
+        if (policy) {
+            fprintf(out, "  (restarts %d/%d, ", policy->restart_count, 
+                    policy->max_restarts);
+            if (jobs->procs[i].pid == 0) {
+                fprintf(out, "restart in ");
+                write_seconds((policy->restart_at > now) 
+                                  ? policy->restart_at - now : 0, out);
+            } else {
+                fprintf(out, "up ");
+                write_seconds(now - policy->started, out);
+            }
+            fprintf(out, ")");
+        }
+        if (jobs->procs[i].tag) {
+            fprintf(out, "  (tag %s)", jobs->procs[i].tag);
+        }
+        fprintf(out, "\n");
+    }
+    return 0;
+}
+
+/******************************************************************************
+Start streaming the output of a background process. fd is the non-blocking
+read end of the pipe the process writes its output to; it is added to the 
+epoll set that is used to drain all streams (created the first time).
+******************************************************************************/
+void add_output_stream(int job_id, pid_t pid, int fd) {
+    if (output_epoll_fd == -1) {
+        output_epoll_fd = move_shell_fd(epoll_create1(EPOLL_CLOEXEC));
+        if (output_epoll_fd == -1) {
+            perror("epoll_create1");
+            close(fd);
+            return;
+        }
+    }
+    struct output_stream *stream = calloc(1, sizeof(struct output_stream));
+    stream->job_id = job_id;
+    stream->pid = pid;
+    stream->fd = move_shell_fd(fd);
+    struct epoll_event event = {0};
+    event.events = EPOLLIN;
+    event.data.ptr = stream;
+    epoll_ctl(output_epoll_fd, EPOLL_CTL_ADD, stream->fd, &event);
+    output_streams = realloc(output_streams, 
+                             (output_stream_count + 1) * sizeof(*output_streams));
+    output_streams[output_stream_count++] = stream;
+}
+
+/******************************************************************************
+Read what is available from a stream's pipe into its buffer. At most 16 reads
+are done per call so that one chatty job cannot hold up the others.
+Returns true if the end of the stream was reached (the pipe is then closed
+and stream->fd set to -1).
+******************************************************************************/
+bool read_output_stream(struct output_stream *stream) {
+    for (int reads = 0; reads < 16; reads++) {
+        if (stream->capacity - stream->len < 4096) {
+            stream->capacity = stream->capacity ? stream->capacity * 2 : 8192;
+            stream->buffer = realloc(stream->buffer, stream->capacity);
+        }
+        ssize_t bytes = read(stream->fd, stream->buffer + stream->len, 
+                             stream->capacity - stream->len);
+        if (bytes > 0) {
+            stream->len += bytes;
+        } else if ((bytes == -1) && (errno == EINTR)) {
+            continue;
+        } else if ((bytes == -1) && (errno == EAGAIN)) {
+            return false;
+        } else {
+            // end of stream (or a read error, treated the same way)
+            epoll_ctl(output_epoll_fd, EPOLL_CTL_DEL, stream->fd, NULL);
+            close(stream->fd);
+            stream->fd = -1;
+            return true;
+        }
+    }
+    return false;
+}
+
+/******************************************************************************
+Print every complete line in a stream's buffer prefixed with "[jobid pid] ",
+plus the final unterminated line once the stream has ended. A partial line is
+kept in the buffer until the rest of it arrives, so lines from different jobs
+never get mixed together.
+If at_prompt is true, a newline is printed before the first line so output 
+does not run into the prompt. printed says whether anything has already been
+printed; the updated value is returned.
+******************************************************************************/
+bool emit_stream_lines(struct output_stream *stream, bool at_prompt, bool printed) {
+    size_t start = 0;
+    while (start < stream->len) {
+        char *newline = memchr(stream->buffer + start, '\n', stream->len - start);
+        size_t end;
+        if (newline) {
+            end = newline - stream->buffer;
+        } else if (stream->fd == -1) {
+            end = stream->len;
+        } else {
+            break;
+        }
+        if (at_prompt && !printed) {
+            printf("\n");
+        }
+        printed = true;
+        printf("[%d %d] ", stream->job_id, stream->pid);
+        fwrite(stream->buffer + start, 1, end - start, stdout);
+        printf("\n");
+        start = end + 1;
+    }
+    if (start > stream->len) {
+        start = stream->len;
+    }
+    memmove(stream->buffer, stream->buffer + start, stream->len - start);
+    stream->len -= start;
+    return printed;
+}
+
+/******************************************************************************
+Read all background output that is ready (without blocking) and print it.
+Normally every stream prints its complete lines as they arrive, interleaved
+with other jobs at line boundaries. In keep-order mode (bgorder) only the
+oldest stream prints; the others are buffered until every job launched before
+them has finished, so each job's output comes out in one piece in launch 
+order. Streams are freed once they have ended and been printed.
+Returns true if anything was printed.
+******************************************************************************/
+bool drain_output_streams(bool at_prompt) {
+    if (output_stream_count == 0) {
+        return false;
+    }
+    struct epoll_event events[64];
+    int ready;
+    do {
+        ready = epoll_wait(output_epoll_fd, events, 64, 0);
+        for (int i = 0; i < ready; i++) {
+            read_output_stream(events[i].data.ptr);
+        }
+    } while (ready == 64);
+    bool printed = false;
+    int i = 0;
+    while (i < output_stream_count) {
+        struct output_stream *stream = output_streams[i];
+        if (shell_options[OPT_BGORDER] && (i > 0)) {
+            break;
+        }
+        printed = emit_stream_lines(stream, at_prompt, printed);
+        if (stream->fd != -1) {
+            i++;
+            continue;
+        }
+        // stream has ended and is fully printed, the next one moves up
+        free(stream->buffer);
+        free(stream);
+        output_stream_count--;
+        memmove(&output_streams[i], &output_streams[i + 1], 
+                (output_stream_count - i) * sizeof(*output_streams));
+    }
+    if (printed) {
+        fflush(stdout);
+    }
+    return printed;
+}
+
+/******************************************************************************
+Close and free all output streams and the epoll set.
+******************************************************************************/
+void free_output_streams() {
+    for (int i = 0; i < output_stream_count; i++) {
+        if (output_streams[i]->fd != -1) {
+            close(output_streams[i]->fd);
+        }
+        free(output_streams[i]->buffer);
+        free(output_streams[i]);
+    }
+    free(output_streams);
+    output_streams = NULL;
+    output_stream_count = 0;
+    if (output_epoll_fd != -1) {
+        close(output_epoll_fd);
+        output_epoll_fd = -1;
+    }
+}
+
+/******************************************************************************
+smallsh --compile SCRIPT [-o OUTPUT.c]
+Translate a script into a C program that runs the same commands without 
+parsing anything at run time. Each command line is parsed now and written out
+as a static command_line struct (argv arrays, redirections, pipeline stages
+and '&'); commands that are not built in are resolved on PATH now as well.
+Lines containing $ (the PID of the running program, or variables) and 
+assignment lines are kept as text and expanded and parsed when they run. Compilation stops at "exit".
+The generated program includes main.c as its runtime library:
+    gcc --std=gnu99 -pthread -I path/to/smallsh prog.c -o prog
+Returns: exit status for main
+******************************************************************************/
+int compile_script(int argc, char *argv[]) {
+    char *script_path = NULL;
+    char *output_path = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "-o") && (i + 1 < argc)) {
+            output_path = argv[++i];
+        } else if (!script_path) {
+            script_path = argv[i];
+        } else {
+            script_path = NULL;
+            break;
+        }
+    }
+    if (!script_path) {
+        fprintf(stderr, "usage: smallsh --compile SCRIPT [-o OUTPUT.c]\n");
+        return 2;
+    }
+    FILE *script = fopen(script_path, "re");
+    if (!script) {
+        fprintf(stderr, "cannot open %s for input\n", script_path);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (output_path && !(out = fopen(output_path, "we"))) {
+        fprintf(stderr, "cannot open %s for output\n", output_path);
+        fclose(script);
+        return 1;
+    }
+    fprintf(out, "// Generated by smallsh --compile from %s\n", script_path);
+    fprintf(out, "// Build: gcc --std=gnu99 -pthread -I path/to/smallsh %s -o prog\n\n",
+            output_path ? output_path : "prog.c");
+    fprintf(out, "#define SMALLSH_RUNTIME\n#include \"main.c\"\n\n");
+    // the table of script lines is collected while the static data is written
+    char *lines = NULL;
+    size_t lines_len = 0;
+    FILE *line_table = open_memstream(&lines, &lines_len);
+    // and so is the list of commands resolved on PATH at compile time
+    char *resolved = NULL;
+    size_t resolved_len = 0;
+    FILE *resolved_list = open_memstream(&resolved, &resolved_len);
+    char *line = NULL;
+    size_t len = 0;
+    int line_number = 0;
+    while (getline(&line, &len, script) != -1) {
+        line_number++;
+        if (isspace(line[0]) || (line[0] == '#')) {
+            continue;
+        }
+        if (!strcmp(line, "exit\n") || !strcmp(line, "exit")) {
+            break;
+        }
+        if (strchr(line, '$')) {
+            fprintf(line_table, "    {NULL, ");
+            emit_c_string(line_table, line);
+            fprintf(line_table, "},\n");
+            continue;
+        }
+        struct command_line *command_line = parse_command_line(line);
+        if (command_line->assignment_count) {
+            // assignment lines are run from source as well
+            fprintf(line_table, "    {NULL, ");
+            emit_c_string(line_table, line);
+            fprintf(line_table, "},\n");
+        } else {
+            emit_command_line(out, resolved_list, command_line, line_number, 1);
+            fprintf(line_table, "    {&line_%d_1, NULL},\n", line_number);
+        }
+        free_memory(command_line);
+    }
+    fclose(line_table);
+    fclose(resolved_list);
+    fprintf(out, "// commands resolved on PATH by the compiler\n");
+    fprintf(out, "static struct command_line *resolved_commands[] = {\n%s    NULL\n};\n\n",
+            resolved);
+    fprintf(out, "static struct compiled_line script[] = {\n%s    {NULL, NULL}\n};\n\n",
+            lines);
+    fprintf(out, "int main() {\n");
+    fprintf(out, "    return run_compiled_script(script, resolved_commands);\n}\n");
+    free(lines);
+    free(resolved);
+    free(line);
+    fclose(script);
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
+
+/******************************************************************************
+Write one parsed command line (and, after it, the rest of its pipeline) as
+static C data named line_N_STAGE. The next stage is written first so the
+struct can point to it. A command that is not built in and is found on PATH
+has its full path stored as command (argv[0] is left as written) and is added
+to resolved_list.
+******************************************************************************/
+void emit_command_line(FILE *out, FILE *resolved_list, 
+                      struct command_line *command_line, int line_number, 
+                      int stage)
+{
+    if (command_line->next) {
+        emit_command_line(out, resolved_list, command_line->next, line_number,
+                          stage + 1);
+    }
+    // one extra slot for the NULL that is added before execvp
+    fprintf(out, "static char *line_%d_%d_args[] = {", line_number, stage);
+    for (int i = 0; i < command_line->args_count; i++) {
+        emit_c_string(out, command_line->args[i]);
+        fprintf(out, ", ");
+    }
+    fprintf(out, "NULL};\n");
+    char *command = command_line->command;
+    if (!find_builtin(command) && !strchr(command, '/')) {
+        char *path = resolve_command_path(command);
+        if (path && (path[0] == '/')) {
+            command = path;
+            fprintf(resolved_list, "    &line_%d_%d,\n", line_number, stage);
+        }
+    }
+    fprintf(out, "static struct command_line line_%d_%d = {\n", line_number, stage);
+    fprintf(out, "    .command = ");
+    emit_c_string(out, command);
+    fprintf(out, ",\n    .args = line_%d_%d_args,\n", line_number, stage);
+    fprintf(out, "    .args_count = %d,\n", command_line->args_count);
+    fprintf(out, "    .input_file = ");
+    emit_c_string(out, command_line->input_file);
+    fprintf(out, ",\n    .output_file = ");
+    emit_c_string(out, command_line->output_file);
+    fprintf(out, ",\n    .run_in_background = %s,\n", 
+            command_line->run_in_background ? "true" : "false");
+    fprintf(out, "    .stream_fd = -1,\n");
+    if (command_line->next) {
+        fprintf(out, "    .next = &line_%d_%d\n};\n\n", line_number, stage + 1);
+    } else {
+        fprintf(out, "    .next = NULL\n};\n\n");
+    }
+}
+
+/******************************************************************************
+Write str as a C string literal, or NULL if str is NULL.
+******************************************************************************/
+void emit_c_string(FILE *out, char *str) {
+    if (!str) {
+        fprintf(out, "NULL");
+        return;
+    }
+    fputc('"', out);
+    for (unsigned char *c = (unsigned char *)str; *c; c++) {
+        if ((*c == '"') || (*c == '\\')) {
+            fprintf(out, "\\%c", *c);
+        } else if (*c == '\n') {
+            fprintf(out, "\\n");
+        } else if (isprint(*c)) {
+            fputc(*c, out);
+        } else {
+            // octal escapes are always 3 digits, so they cannot swallow the
+            // next character
+            fprintf(out, "\\%03o", *c);
+        }
+    }
+    fputc('"', out);
+}
+
+/******************************************************************************
+Runtime for compiled scripts, called by the generated main:
+- Set up signal handling the same way the shell does.
+- Check the commands that were resolved on PATH at compile time. If a resolved
+  path no longer exists (the program was moved to another machine, or the
+  command was uninstalled), fall back to a normal PATH search for it.
+- Run each line with the same background work the shell does before each
+  prompt. Pre-parsed lines run as they are, lines kept as source (they use $$)
+  are expanded and parsed first.
+- Clean up as the exit command does.
+******************************************************************************/
+int run_compiled_script(struct compiled_line *script, 
+                        struct command_line **resolved_commands)
+{
+    int status = 0;
+    struct job_table jobs = {NULL, 0, 0, 1};
+    ignore_SIGINT();
+    signal_handling();
+    for (int i = 0; resolved_commands[i]; i++) {
+        if (access(resolved_commands[i]->command, X_OK) == -1) {
+            resolved_commands[i]->command = resolved_commands[i]->args[0];
+        }
+    }
+    for (struct compiled_line *line = script; line->command_line || line->source; line++) {
+        run_background_work(&status, &jobs);
+        if (line->command_line) {
+            run_command_line(line->command_line, &status, &jobs);
+            continue;
+        }
+        struct command_line *command_line_parsed = parse_command_line(line->source);
+        run_command_line(command_line_parsed, &status, &jobs);
+        free_memory(command_line_parsed);
+    }
+    shell_cleanup(&jobs);
+    return 0;
+}
 
-    // If process to run in background and program is NOT in foreground 
-    // only mode, add child PID to background_proc array
-    if (command_line->run_in_background & !foreground_only) {
-        background_procs[*bg_proc_count] = spawn_pid;
-        *bg_proc_count += 1;
+/******************************************************************************
+smallsh --parallel N SCRIPT
+Run a script the way "smallsh < SCRIPT" does, except that consecutive command
+lines that do not touch the same files run at the same time, up to N at once.
+Each line runs in a subshell whose stdout and stderr go to temporary files;
+lines are finished in script order, so prompts, output and the status each
+line leaves are the same as when the lines run one after another.
+A line waits for every earlier line it conflicts with: one of them writes a 
+file the other reads or writes. The files a line reads are its input_file and
+its arguments that are not options, and the files it writes are its 
+output_file (and the arguments of commands such as rm or cp that change the
+files they are given). Other side effects can be declared on comment lines
+before the command, which the shell otherwise ignores:
+    #@ reads FILE...    the next command reads these files
+    #@ writes FILE...   the next command writes these files
+    #@ serial           the next command runs on its own
+Lines that change the shell itself (builtins, assignments, '&') always run on
+their own, in the shell, after every earlier line has finished.
+Returns: exit status for main
+******************************************************************************/
+int parallel_script(int argc, char *argv[]) {
+    char *end = NULL;
+    long workers = (argc == 4) ? strtol(argv[2], &end, 10) : 0;
+    if ((argc != 4) || (*end != '\0') || (workers < 1) || (workers > 1024)) {
+        fprintf(stderr, "usage: smallsh --parallel N SCRIPT\n");
+        return 2;
     }
-    switch(spawn_pid) {
-        case -1:
-            perror("fork()\n");
-            exit(1);
-            break;
-        case 0: ;
-            // child process
-            // printf("testing child process pid = %d\n", getpid());
-            // If process is to run in foreground, restore SIGINT
-            if (!command_line->run_in_background || !foreground_only) {
-                restore_SIGINT();
-            }
-            // Child processes ignore SIGTSTP
-            ignore_SIGTSTP();
-            // Setup input and output redirection
-            input_redirect(command_line, status);
-            output_redirect(command_line, status);
-            // printf("Child %d running %s command\n", getpid(), command_line->command);
-            execvp(command_line->args[0], command_line->args);
-            // perror and exit are only reached if execvp fails
-            // perror("execvp");
-            perror(command_line->args[0]);
-            exit(1);
+    FILE *script = fopen(argv[3], "re");
+    if (!script) {
+        fprintf(stderr, "cannot open %s for input\n", argv[3]);
+        return 1;
+    }
+    ignore_SIGINT();
+    signal_handling();
+    int status = 0;
+    struct job_table jobs = {NULL, 0, 0, 1};
+    // lines that are running or waiting to be finished, oldest first
+    struct parallel_line *window = calloc(workers, sizeof(struct parallel_line));
+    int first = 0;
+    int count = 0;
+    struct file_effects declared = {0};
+    bool serial = false;
+    int prompts = 0;        // prompts for blank and comment lines
+    char *line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, script) != -1) {
+        if (!strncmp(line, "#@", 2)) {
+            serial |= parse_effects_directive(line + 2, &declared);
+        }
+        if (isspace(line[0]) || (line[0] == '#')) {
+            prompts++;
+            continue;
+        }
+        if (!strcmp(line, "exit\n") || !strcmp(line, "exit")) {
             break;
-        default:
-            // Parent process
-            if (command_line->run_in_background & !foreground_only) {
-                // run child in background, do not wait for child to terminate
-                printf("background PID is %d\n", spawn_pid);
-                fflush(stdout);
-            } else {
-                // run child in foreground, wait for child to terminate
-                // printf("run proces in foreground child pid: %d\n", spawn_pid);
-                spawn_pid = waitpid(spawn_pid, &child_status, 0);
-                // printf("spawn_pid after waitpid: %d; child_status: %d\n", spawn_pid, child_status);
-                // check exit status of foreground process
-                if(WIFEXITED(child_status)) {
-                    // printf("pid %d is done: exit value %d\n", spawn_pid, WEXITSTATUS(child_status));
-                    *status = WEXITSTATUS(child_status);
-                } else {
-                    printf("terminated by signal %d\n", WTERMSIG(child_status));
-                    fflush(stdout);
-                    *status = WTERMSIG(child_status);
+        }
+        struct command_line *command_line = parse_command_line(line);
+        if (serial || changes_shell(command_line)) {
+            while (count > 0) {
+                wait_parallel_lines(window, first, count, workers);
+                finish_parallel_lines(window, &first, &count, workers, 
+                                      &status, &jobs);
+            }
+            print_prompts(prompts + 1, true, &status, &jobs);
+            run_command_line(command_line, &status, &jobs);
+            // for the prompts of the next line (see finish_parallel_lines)
+            run_background_work(&status, &jobs);
+            free_file_effects(&declared);
+        } else {
+            struct file_effects effects = declared;
+            memset(&declared, 0, sizeof(declared));
+            add_command_effects(command_line, &effects);
+            // wait for a free worker and for the lines it conflicts with
+            for (;;) {
+                finish_parallel_lines(window, &first, &count, workers, 
+                                      &status, &jobs);
+                if ((count < workers) 
+                        && !effects_conflict(window, first, count, workers, 
+                                             &effects)) {
+                    break;
                 }
+                wait_parallel_lines(window, first, count, workers);
             }
-            break;
+            struct parallel_line *next = &window[(first + count++) % workers];
+            next->prompts = prompts;
+            next->effects = effects;
+            start_parallel_line(next, command_line, &status, &jobs);
+        }
+        prompts = 0;
+        serial = false;
+        free_memory(command_line);
+    }
+    while (count > 0) {
+        wait_parallel_lines(window, first, count, workers);
+        finish_parallel_lines(window, &first, &count, workers, &status, &jobs);
     }
+    // the prompt that exit (or the end of the script) was read at
+    print_prompts(prompts + 1, true, &status, &jobs);
+    free_file_effects(&declared);
+    free(window);
+    free(line);
+    fclose(script);
+    shell_cleanup(&jobs);
+    return 0;
 }
 
 /******************************************************************************
-If input_file specified in command_line, open file and use dup2() for input
-redirection.
-If command is to run in background and a file is not specified, redirect input
-to /dev/null per assignment description.
-If error, exit with exit(1) to communicate to parent process that there was an
-error.
-Code for error handling modified from course exploration Processes and I/O.
+Print count prompts, as the shell does for lines that have no output (blank 
+lines, comments, and lines run with --parallel once their output is ready).
+With background_work, the background work the shell does before each prompt
+is done first.
 ******************************************************************************/
-void input_redirect(struct command_line *command_line, int *status) {
-    if (command_line->input_file) {
-        // open input file
-        int input_fd = open(command_line->input_file, O_RDONLY);
-        if (input_fd == -1) {
-            printf("cannot open %s for input\n", command_line->input_file);
-            // perror("source open()");
-            fflush(stdout);
-            exit(1);
-        }
-        // redirect stdin to input file
-        int result = dup2(input_fd, 0);
-        if (result == -1) {
-            printf("error redirecting stdin to input file\n");
-            // perror("source dup2()");
-            fflush(stdout);
-            exit(1);
+void print_prompts(int count, bool background_work, int *status, 
+                   struct job_table *jobs) 
+{
+    for (int i = 0; i < count; i++) {
+        if (background_work) {
+            run_background_work(status, jobs);
         }
+        char *prompt = render_prompt(status, jobs, false);
+        printf("%s", prompt);
+        fflush(stdout);
+        free(prompt);
     }
-    if (command_line->run_in_background & !foreground_only
-            & !command_line->input_file) 
-    {
-        int input_fd = open("/dev/null", O_RDONLY);
-        if (input_fd == -1) {
-            printf("cannot open /dev/null for input\n");
-            // perror("source open()");
-            fflush(stdout);
-            exit(1);
-        }
-        int result = dup2(input_fd, 0);
-        if (result == -1) {
-            printf("error redirecting stdin to /dev/null\n");
-            // perror("source dup2()");
-            fflush(stdout);
-            exit(1);
+}
+
+/******************************************************************************
+Returns true if running command_line changes the state of the shell, so it 
+can't run in a subshell: assignments, background commands, and commands or
+pipelines that use a builtin.
+******************************************************************************/
+bool changes_shell(struct command_line *command_line) {
+    if (command_line->assignment_count || command_line->run_in_background
+            || !command_line->command[0]) {
+        return true;
+    }
+    for (struct command_line *stage = command_line; stage; stage = stage->next) {
+        if (find_builtin(stage->command)) {
+            return true;
         }
     }
+    return false;
 }
 
 /******************************************************************************
-If output_file specified in command_line, open file and use dup2() for output
-redirection.
-If command is to run in background and a file is not specified, redirect output
-to /dev/null per assignment description.
-If error, exit with exit(1) to communicate to parent process that there was an
-error.
-Code for error handling modified from exploration Processes and I/O.
+Parse the text after "#@" on a comment line: "reads FILE...", 
+"writes FILE..." or "serial". The files are added to effects.
+Returns true for "serial".
 ******************************************************************************/
-void output_redirect(struct command_line *command_line, int *status) {
-    if (command_line->output_file) {
-        // open output file
-        int output_fd = open(command_line->output_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (output_fd == -1) {
-            printf("cannot open %s for output\n", command_line->output_file);
-            fflush(stdout);
-            // perror("target open()");
-            exit(1);
+bool parse_effects_directive(char *text, struct file_effects *effects) {
+    char *save = NULL;
+    char *word = strtok_r(text, " \t\n", &save);
+    if (!word) {
+        return false;
+    }
+    if (!strcmp(word, "serial")) {
+        return true;
+    }
+    bool write = !strcmp(word, "writes");
+    if (!write && strcmp(word, "reads")) {
+        return false;
+    }
+    while ((word = strtok_r(NULL, " \t\n", &save))) {
+        add_file_effect(effects, word, write);
+    }
+    return false;
+}
+
+/******************************************************************************
+Add the files read and written by each command of a pipeline to effects.
+Arguments that are not options are taken to be files that are read, or 
+written if the command is one that changes the files it is given.
+******************************************************************************/
+void add_command_effects(struct command_line *command_line, 
+                         struct file_effects *effects)
+{
+    static char *file_writers[] = {"rm", "rmdir", "mkdir", "mv", "cp", "ln", 
+                                   "touch", "truncate", "chmod", "chown", 
+                                   "tee", "install", "unlink", NULL};
+    for (struct command_line *stage = command_line; stage; stage = stage->next) {
+        char *name = strrchr(stage->command, '/');
+        name = name ? name + 1 : stage->command;
+        bool write = false;
+        for (int i = 0; file_writers[i]; i++) {
+            write |= !strcmp(name, file_writers[i]);
         }
-        // redirect stdout to output file
-        int result = dup2(output_fd, 1);
-        if (result == -1) {
-            printf("error redirecting stdout to output file\n");
-            fflush(stdout);
-            // perror("target dup2()");
-            exit(1);
+        for (int i = 1; i < stage->args_count; i++) {
+            if (stage->args[i][0] && (stage->args[i][0] != '-')) {
+                add_file_effect(effects, stage->args[i], write);
+            }
         }
-    }
-    if (command_line->run_in_background & !foreground_only
-            & !command_line->output_file) 
-    {
-        int output_fd = open("/dev/null", O_WRONLY | O_CREAT | O_TRUNC, 0666);
-        if (output_fd == -1) {
-            printf("cannot open /dev/null for output\n");
-            fflush(stdout);
-            // perror("target open()");
-            exit(1);
+        if (stage->input_file) {
+            add_file_effect(effects, stage->input_file, false);
         }
-        int result = dup2(output_fd, 1);
-        if (result == -1) {
-            printf("error redirecting stdout to /dev/null\n");
-            fflush(stdout);
-            // perror("target dup2()");
-            exit(1);
+        if (stage->output_file) {
+            add_file_effect(effects, stage->output_file, true);
         }
     }
 }
 
 /******************************************************************************
-Sets SIG_IGN as the hander for SIGINT so that SIGINT is ignored.
-Code to setup SIG_IGN adapted from course exploration example in Signal
-Handling API.
+Add a file to effects as an absolute path, so that "junk", "./junk" and 
+"$PWD/junk" are seen to be the same file. Devices such as /dev/null are left
+out, many lines can use them at once.
 ******************************************************************************/
-void ignore_SIGINT() {
-    // Initialize ignore_action struct to be empty
-    struct sigaction ignore_action = {{0}};
-    // Assign signal handerl SIG_IGN to ignore_action struct
-    ignore_action.sa_handler = SIG_IGN;
-    // Reigster ignore_action as the signal handler for SIGINT
-    sigaction(SIGINT, &ignore_action, NULL);
+void add_file_effect(struct file_effects *effects, char *path, bool write) {
+    if (!strncmp(path, "/dev/", 5)) {
+        return;
+    }
+    while ((path[0] == '.') && (path[1] == '/')) {
+        path += 2;
+    }
+    char *absolute;
+    if (path[0] == '/') {
+        absolute = strdup(path);
+    } else {
+        char *cwd = get_cwd();
+        absolute = malloc(strlen(cwd) + strlen(path) + 2);
+        sprintf(absolute, "%s/%s", cwd, path);
+        free(cwd);
+    }
+    size_t len = strlen(absolute);
+    while ((len > 1) && (absolute[len - 1] == '/')) {
+        absolute[--len] = '\0';
+    }
+    effects->paths = realloc(effects->paths, (effects->count + 1) * sizeof(char *));
+    effects->writes = realloc(effects->writes, (effects->count + 1) * sizeof(bool));
+    effects->paths[effects->count] = absolute;
+    effects->writes[effects->count++] = write;
 }
 
 /******************************************************************************
-Sets SIG_DFL as the hander for SIGINT so that SIGINT is no longer ignored.
+Returns true if effects conflict with a line in the window that is still 
+running: either one writes a file (or a directory holding a file) that the 
+other reads or writes.
 ******************************************************************************/
-void restore_SIGINT() {
-    // Initialize restore_action struct to be empty
-    struct sigaction restore_action = {{0}};
-    // Assign signal handerl SIG_DFL to restore_action struct
-    restore_action.sa_handler = SIG_DFL;
-    // Reigster restore_action as the signal handler for SIGINT
-    sigaction(SIGINT, &restore_action, NULL);
+bool effects_conflict(struct parallel_line *window, int first, int count,
+                      int workers, struct file_effects *effects)
+{
+    for (int k = 0; k < count; k++) {
+        struct parallel_line *running = &window[(first + k) % workers];
+        if (running->pid == 0) {
+            continue;
+        }
+        for (int i = 0; i < effects->count; i++) {
+            for (int j = 0; j < running->effects.count; j++) {
+                if ((effects->writes[i] || running->effects.writes[j])
+                        && paths_overlap(effects->paths[i], 
+                                         running->effects.paths[j])) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
 }
 
 /******************************************************************************
-Function that handles SIGTSTP.
-Parent process SIGTSTP handling: signals shell to display message and enter or
-exit a state where subsequent commands can no longer be run in the background.
-(The & operator is ignored in this state and commands are run as foreground
-processes.)
-Switches foreground-only mode on and off and
-prints message to user about entering/exiting foreground-only mode.
-Uses global variable to switch on/off.
+Returns true if two absolute paths are the same, or one is in the directory
+named by the other.
 ******************************************************************************/
-void handle_SIGTSTP(int signo) {
-    // char *message = ("Caught SIGTSTP\n");
-    // write(STDOUT_FILENO, message, 15);
-    if (foreground_only) {
-        char *message2 = "\nExiting foreground-only mode\n: ";
-        write(STDOUT_FILENO, message2, 32);
-        fflush(stdout);
-        foreground_only = 0; // foreground only mode = off/false
-    } else {
-        char *message3 = "\nEntering foreground-only mode (& is now ignored)\n: ";
-        write(STDOUT_FILENO, message3, 53);
-        fflush(stdout);
-        foreground_only = 1; // foreground only mode = on/true
+bool paths_overlap(char *a, char *b) {
+    size_t a_len = strlen(a);
+    size_t b_len = strlen(b);
+    if (a_len > b_len) {
+        return paths_overlap(b, a);
     }
+    return !strncmp(a, b, a_len) 
+               && ((b[a_len] == '\0') || (b[a_len] == '/') || (a_len == 1));
 }
 
 /******************************************************************************
-Initialize SIGTSTP_action struct and assign struct members
-Code adapted from course exploration Signal Handling API
+Free the file lists of effects and empty it.
 ******************************************************************************/
-void signal_handling() {
-    // Initialize SIGTSTP_action to be empty
-    struct sigaction SIGTSTP_action = {{0}};
-    // Register handle_SIGSTP as the signal handelr
-    SIGTSTP_action.sa_handler = handle_SIGTSTP;
-    // Block all catchable signals whiel handle_SIGTSTP is running
-    sigfillset(&SIGTSTP_action.sa_mask);
-    // use SA_RESTART flag to cause an automatic restart of the interuppted 
-    // system call/library function after the signal handler is done (getline()
-    // returns an error if its interuppted by a signal, use SA_RESTART to 
-    // restart the getlien() process)
-    SIGTSTP_action.sa_flags = SA_RESTART;
-    // Install the signal handler
-    sigaction(SIGTSTP, &SIGTSTP_action, NULL);
+void free_file_effects(struct file_effects *effects) {
+    for (int i = 0; i < effects->count; i++) {
+        free(effects->paths[i]);
+    }
+    free(effects->paths);
+    free(effects->writes);
+    memset(effects, 0, sizeof(*effects));
 }
 
 /******************************************************************************
-Child foreground and background processes ignore SIGTSTP.
-Sets SIG_IGN as the hander for SIGTSTP so that SIGTSTP is ignored.
-Code to setup SIG_IGN adapted from course exploration example in Signal
-Handling API.
+Start a line of a --parallel script in a subshell. The subshell runs the line
+the way the shell would, with stdout and stderr sent to temporary files, and
+exits with the status the line left. A pidfd lets wait_parallel_lines wait 
+for any of the running lines at once.
 ******************************************************************************/
-void ignore_SIGTSTP() {
-    // Initialize ignore_action struct to be empty
-    struct sigaction ignore_action = {{0}};
-    // Assign signal handerl SIG_IGN to ignore_action struct
-    ignore_action.sa_handler = SIG_IGN;
-    // Reigster ignore_action as the signal handler for SIGTSTP
-    sigaction(SIGTSTP, &ignore_action, NULL);
+void start_parallel_line(struct parallel_line *line, 
+                         struct command_line *command_line, int *status,
+                         struct job_table *jobs)
+{
+    line->out = tmpfile();
+    line->err = tmpfile();
+    if (!line->out || !line->err) {
+        perror("tmpfile");
+        exit(1);
+    }
+    fcntl(fileno(line->out), F_SETFD, FD_CLOEXEC);
+    fcntl(fileno(line->err), F_SETFD, FD_CLOEXEC);
+    fflush(NULL);
+    line->pid = fork();
+    switch (line->pid) {
+        case -1:
+            perror("fork()\n");
+            exit(1);
+            break;
+        case 0:
+            dup2(fileno(line->out), STDOUT_FILENO);
+            dup2(fileno(line->err), STDERR_FILENO);
+            handle_command_line(command_line, status, jobs);
+            fflush(NULL);
+            _exit(*status);
+            break;
+        default:
+            line->pidfd = syscall(SYS_pidfd_open, line->pid, 0);
+            if (line->pidfd != -1) {
+                fcntl(line->pidfd, F_SETFD, FD_CLOEXEC);
+            }
+            break;
+    }
 }
 
 /******************************************************************************
-Iterate through all of the PIDs in the background processes array and
-1. kill the process
-2. call waitpid() on the PID to clear it, no zombies today please
+Wait until at least one running line in the window has exited, and record the
+status it left. Falls back to waiting for the oldest running line if there is
+no pidfd for every line (kernels before 5.3).
 ******************************************************************************/
-void kill_children(int *background_procs, int bg_proc_count) {
+void wait_parallel_lines(struct parallel_line *window, int first, int count, 
+                         int workers) 
+{
+    struct pollfd *fds = malloc(count * sizeof(struct pollfd));
+    struct parallel_line **lines = malloc(count * sizeof(struct parallel_line *));
+    struct parallel_line *oldest = NULL;
+    int fd_count = 0;
+    bool all_pidfds = true;
+    for (int k = 0; k < count; k++) {
+        struct parallel_line *line = &window[(first + k) % workers];
+        if (line->pid == 0) {
+            continue;
+        }
+        oldest = oldest ? oldest : line;
+        all_pidfds &= (line->pidfd != -1);
+        fds[fd_count].fd = line->pidfd;
+        fds[fd_count].events = POLLIN;
+        lines[fd_count++] = line;
+    }
     int child_status;
-    int pid_check;
-    for (int i = 0; i < bg_proc_count; i++) {
-        kill(background_procs[i], SIGKILL);
-        pid_check = waitpid(background_procs[i], &child_status, WNOHANG);
-        // printf("Killed child process %d\n", pid_check);
-        // if(WIFEXITED(child_status)) {
-        //     printf("background pid %d is done: exit value %d\n", pid_check, WEXITSTATUS(child_status));
-        // } else {
-        //     printf("background pid %d is done: terminated by signal %d\n", pid_check, WTERMSIG(child_status));
-        // }
+    if (oldest && !all_pidfds) {
+        waitpid(oldest->pid, &child_status, 0);
+        parallel_line_done(oldest, child_status);
+    } else if (oldest) {
+        // SIGTSTP interrupts poll(), just go back to waiting
+        while ((poll(fds, fd_count, -1) == -1) && (errno == EINTR)) {
+        }
+        for (int i = 0; i < fd_count; i++) {
+            if (fds[i].revents) {
+                waitpid(lines[i]->pid, &child_status, 0);
+                parallel_line_done(lines[i], child_status);
+            }
+        }
+    }
+    free(fds);
+    free(lines);
+}
+
+/******************************************************************************
+Record the exit of a line's subshell. A subshell killed by a signal leaves
+the signal number, the way a foreground command does.
+******************************************************************************/
+void parallel_line_done(struct parallel_line *line, int child_status) {
+    line->status = WIFEXITED(child_status) ? WEXITSTATUS(child_status) 
+                                           : WTERMSIG(child_status);
+    line->pid = 0;
+    if (line->pidfd != -1) {
+        close(line->pidfd);
+        line->pidfd = -1;
+    }
+}
+
+/******************************************************************************
+Finish the lines at the start of the window that have exited, in script 
+order: print their prompts and then their output, and take their status.
+The background work before a line's prompts was done when the line before it
+finished, and is done again after the line's output, so a background job that
+ended while the line ran is reported after the line, as the shell reading the
+script would (the prompts of the blank and comment lines before a line are
+read at once after the line before it, so nothing is done between them).
+******************************************************************************/
+void finish_parallel_lines(struct parallel_line *window, int *first, 
+                           int *count, int workers, int *status, 
+                           struct job_table *jobs)
+{
+    while ((*count > 0) && (window[*first].pid == 0)) {
+        struct parallel_line *line = &window[*first];
+        print_prompts(line->prompts + 1, false, status, jobs);
+        copy_stream(line->out, stdout);
+        copy_stream(line->err, stderr);
+        *status = line->status;
+        run_background_work(status, jobs);
+        fclose(line->out);
+        fclose(line->err);
+        free_file_effects(&line->effects);
+        *first = (*first + 1) % workers;
+        *count -= 1;
+    }
+}
+
+/******************************************************************************
+Copy everything written to the temporary file from to the stream to.
+******************************************************************************/
+void copy_stream(FILE *from, FILE *to) {
+    char buffer[8192];
+    size_t len;
+    rewind(from);
+    while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        fwrite(buffer, 1, len, to);
     }
+    fflush(to);
 }
 
 /******************************************************************************
 Frees memory allocated for command_line_parsed struct, frees each string in
-the args array.
+the args array and the assignments, and frees the rest of the pipeline.
 ******************************************************************************/
 void free_memory(struct command_line *command_line_parsed) {
     int i;
@@ -680,6 +9706,25 @@ void free_memory(struct command_line *command_line_parsed) {
         free(command_line_parsed->args[i]);
     }
     free(command_line_parsed->args);
+    for (i = 0; i < command_line_parsed->assignment_count; i++) {
+        struct assignment *assignment = &command_line_parsed->assignments[i];
+        free(assignment->name);
+        free(assignment->subscript);
+        for (int j = 0; j < assignment->value_count; j++) {
+            free(assignment->values[j]);
+            if (assignment->keys) {
+                free(assignment->keys[j]);
+            }
+        }
+        free(assignment->values);
+        free(assignment->keys);
+    }
+    free(command_line_parsed->assignments);
+    free(command_line_parsed->listen_fds);
+    free(command_line_parsed->listen_names);
+    if (command_line_parsed->next) {
+        free_memory(command_line_parsed->next);
+    }
     free(command_line_parsed);
 }
 